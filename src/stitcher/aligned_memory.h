@@ -0,0 +1,67 @@
+#ifndef ALIGNED_MEMORY_H
+#define ALIGNED_MEMORY_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <sys/mman.h>
+
+
+/// Alignment of all voxel and image buffers, one cache line.
+const size_t memoryAlignment = 64;
+
+/// Buffers of at least this size are aligned to and backed by huge pages.
+const size_t hugePageSize = 2 << 20;
+
+
+/**
+ * \brief Allocates uninitialized memory aligned for SIMD loads.
+ *
+ * Small buffers are aligned to the cache line. Large ones start at a huge
+ * page boundary and are advised to the kernel as huge page candidates, which
+ * reduces TLB misses when whole volumes are traversed. Memory must be freed
+ * with alignedFree().
+ *
+ * \param[in] bytes Size of buffer in bytes
+ * \return Pointer to the buffer or nullptr if failed.
+ */
+inline void* alignedAlloc(const size_t bytes) {
+    const size_t alignment = bytes >= hugePageSize ? hugePageSize : memoryAlignment;
+    void* ptr = nullptr;
+
+    if (posix_memalign(&ptr, alignment, bytes > 0 ? bytes : alignment) != 0) {
+        return nullptr;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (bytes >= hugePageSize) {
+        madvise(ptr, bytes, MADV_HUGEPAGE);
+    }
+#endif
+
+    return ptr;
+}
+
+
+/**
+ * \brief Allocates uninitialized aligned array.
+ *
+ * \param[in] count Number of elements
+ * \return Pointer to the array or nullptr if failed.
+ */
+template<typename T>
+T* alignedAlloc(const size_t count) {
+    return static_cast<T*>(alignedAlloc(count * sizeof(T)));
+}
+
+
+/**
+ * \brief Frees memory allocated with alignedAlloc().
+ *
+ * \param[in] ptr Pointer to the buffer, may be nullptr
+ */
+inline void alignedFree(void* ptr) {
+    free(ptr);
+}
+
+
+#endif // ALIGNED_MEMORY_H
@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "brick_store.h"
+
+
+/// Cache slot holding no brick.
+static const size_t noBrick = std::numeric_limits<size_t>::max();
+
+/// Longest run of equal bytes encoded by a single control byte.
+static const size_t maxRun = 130;
+
+/// Longest sequence of literal bytes encoded by a single control byte.
+static const size_t maxLiterals = 128;
+
+
+BrickStore::BrickStore(const size_t _bricksNum, const size_t _brickSamples, const size_t _sampleBytes, const size_t _cacheBricks) :
+    brickSamples(_brickSamples),
+    sampleBytes(_sampleBytes),
+    cacheSlots(_bricksNum, -1) {
+    std::vector<uint8_t> zeros(brickSamples * sampleBytes, 0);
+    encode(zeros.data(), brickSamples, sampleBytes, zeroBrick);
+    bricks.assign(_bricksNum, zeroBrick);
+
+    cache.resize(std::max<size_t>(1, std::min(_cacheBricks, _bricksNum)));
+
+    for (auto& slot : cache) {
+        slot.brickId = noBrick;
+        slot.lastUse = 0;
+        slot.dirty = false;
+    }
+}
+
+
+void BrickStore::setLoader(const Loader& _loader) {
+    std::lock_guard<std::mutex> lock(mutex);
+    loader = _loader;
+
+    for (auto& brick : bricks) {
+        std::vector<uint8_t>().swap(brick);
+    }
+
+    for (auto& slot : cache) {
+        if (slot.brickId != noBrick) {
+            cacheSlots[slot.brickId] = -1;
+        }
+
+        slot.brickId = noBrick;
+        slot.lastUse = 0;
+        slot.dirty = false;
+    }
+}
+
+
+void BrickStore::store(const size_t brickId, const void* src) {
+    // Compress outside of the lock, so bricks can be stored in parallel
+    std::vector<uint8_t> coded;
+    encode(src, brickSamples, sampleBytes, coded);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Cached copy is outdated now
+    const int slotId = cacheSlots[brickId];
+
+    if (slotId >= 0) {
+        cache[slotId].brickId = noBrick;
+        cache[slotId].lastUse = 0;
+        cache[slotId].dirty = false;
+        cacheSlots[brickId] = -1;
+    }
+
+    bricks[brickId].swap(coded);
+}
+
+
+void BrickStore::load(const size_t brickId, void* dst) const {
+    std::unique_lock<std::mutex> lock(mutex);
+    require(brickId, lock);
+
+    const int slotId = cacheSlots[brickId];
+
+    if (slotId >= 0) {
+        memcpy(dst, cache[slotId].samples.data(), brickSamples * sampleBytes);
+        return;
+    }
+
+    decode(bricks[brickId], brickSamples, sampleBytes, dst);
+}
+
+
+void BrickStore::read(const size_t brickId, const size_t offset, void* dst) const {
+    std::unique_lock<std::mutex> lock(mutex);
+    require(brickId, lock);
+    memcpy(dst, fetch(brickId) + offset * sampleBytes, sampleBytes);
+}
+
+
+void BrickStore::write(const size_t brickId, const size_t offset, const void* src) {
+    std::unique_lock<std::mutex> lock(mutex);
+    require(brickId, lock);
+    memcpy(fetch(brickId) + offset * sampleBytes, src, sampleBytes);
+    cache[cacheSlots[brickId]].dirty = true;
+}
+
+
+size_t BrickStore::getStoredBytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t bytes = cacheSlots.size() * sizeof(int);
+
+    for (const auto& brick : bricks) {
+        bytes += brick.capacity() + sizeof(brick);
+    }
+
+    for (const auto& slot : cache) {
+        bytes += slot.samples.capacity();
+    }
+
+    return bytes;
+}
+
+
+void BrickStore::encode(const void* src, const size_t count, const size_t sampleBytes, std::vector<uint8_t>& dst) {
+    const uint8_t* samples = static_cast<const uint8_t*>(src);
+    const size_t bits = 8 * sampleBytes;
+    const uint64_t mask = (uint64_t(1) << bits) - 1;
+    const size_t bytes = count * sampleBytes;
+
+    // Differences of neighbouring samples are zigzag coded, so small negative
+    // ones stay small, and split into planes of bytes of the same order
+    std::vector<uint8_t> planes(bytes);
+    uint64_t prev = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t val = 0;
+        memcpy(&val, samples + i * sampleBytes, sampleBytes);
+
+        const uint64_t delta = (val - prev) & mask;
+        const uint64_t code = (delta >> (bits - 1)) ? (((~delta & mask) << 1) | 1) : (delta << 1);
+        prev = val;
+
+        for (size_t k = 0; k < sampleBytes; ++k) {
+            planes[k * count + i] = code >> (8 * k);
+        }
+    }
+
+    // Control byte 0x80 | (n - 3) repeats the next byte n times,
+    // control byte n - 1 is followed by n literal bytes
+    std::vector<uint8_t> coded;
+    coded.reserve(bytes / 4);
+    coded.push_back(1);
+
+    size_t literalsBegin = 0;
+    size_t i = 0;
+
+    auto flushLiterals = [&](const size_t end) {
+        while (literalsBegin < end) {
+            const size_t n = std::min(maxLiterals, end - literalsBegin);
+            coded.push_back(n - 1);
+            coded.insert(coded.end(), planes.begin() + literalsBegin, planes.begin() + literalsBegin + n);
+            literalsBegin += n;
+        }
+    };
+
+    while (i < bytes) {
+        size_t run = 1;
+
+        while (i + run < bytes && run < maxRun && planes[i + run] == planes[i]) {
+            ++run;
+        }
+
+        if (run < 3) {
+            ++i;
+            continue;
+        }
+
+        flushLiterals(i);
+        coded.push_back(0x80 | (run - 3));
+        coded.push_back(planes[i]);
+        i += run;
+        literalsBegin = i;
+    }
+
+    flushLiterals(bytes);
+
+    // Incompressible samples are kept as is
+    if (coded.size() >= bytes + 1) {
+        coded.assign(1, 0);
+        coded.insert(coded.end(), samples, samples + bytes);
+    }
+
+    // Exact size, as stores keep millions of small bricks
+    std::vector<uint8_t>(coded.begin(), coded.end()).swap(dst);
+}
+
+
+void BrickStore::decode(const std::vector<uint8_t>& src, const size_t count, const size_t sampleBytes, void* dst) {
+    uint8_t* samples = static_cast<uint8_t*>(dst);
+    const size_t bits = 8 * sampleBytes;
+    const uint64_t mask = (uint64_t(1) << bits) - 1;
+    const size_t bytes = count * sampleBytes;
+
+    if (src[0] == 0) {
+        memcpy(samples, src.data() + 1, bytes);
+        return;
+    }
+
+    std::vector<uint8_t> planes(bytes);
+    size_t j = 1;
+
+    for (size_t i = 0; i < bytes;) {
+        const uint8_t control = src[j++];
+
+        if (control & 0x80) {
+            const size_t run = (control & 0x7F) + 3;
+            memset(planes.data() + i, src[j++], run);
+            i += run;
+        }
+        else {
+            const size_t n = control + 1;
+            memcpy(planes.data() + i, src.data() + j, n);
+            j += n;
+            i += n;
+        }
+    }
+
+    uint64_t prev = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t code = 0;
+
+        for (size_t k = 0; k < sampleBytes; ++k) {
+            code |= static_cast<uint64_t>(planes[k * count + i]) << (8 * k);
+        }
+
+        const uint64_t delta = (code & 1) ? (~(code >> 1) & mask) : (code >> 1);
+        prev = (prev + delta) & mask;
+        memcpy(samples + i * sampleBytes, &prev, sampleBytes);
+    }
+}
+
+
+void BrickStore::require(const size_t brickId, std::unique_lock<std::mutex>& lock) const {
+    if (!bricks[brickId].empty() || !loader) {
+        return;
+    }
+
+    // Other bricks stay accessible while this one is loaded
+    lock.unlock();
+    Bricks loaded;
+    loader(brickId, loaded);
+    lock.lock();
+
+    // Bricks loaded meanwhile by other threads might be modified already
+    for (auto& brick : loaded) {
+        if (bricks[brick.first].empty() && !brick.second.empty()) {
+            bricks[brick.first].swap(brick.second);
+        }
+    }
+
+    if (bricks[brickId].empty()) {
+        bricks[brickId] = zeroBrick;
+    }
+}
+
+
+uint8_t* BrickStore::fetch(const size_t brickId) const {
+    int slotId = cacheSlots[brickId];
+
+    if (slotId < 0) {
+        // Replace the least recently used brick
+        slotId = 0;
+
+        for (size_t i = 1; i < cache.size(); ++i) {
+            if (cache[i].lastUse < cache[slotId].lastUse) {
+                slotId = i;
+            }
+        }
+
+        CacheSlot& slot = cache[slotId];
+        evict(slot);
+        slot.samples.resize(brickSamples * sampleBytes);
+        decode(bricks[brickId], brickSamples, sampleBytes, slot.samples.data());
+        slot.brickId = brickId;
+        cacheSlots[brickId] = slotId;
+    }
+
+    cache[slotId].lastUse = ++useCounter;
+
+    return cache[slotId].samples.data();
+}
+
+
+void BrickStore::evict(CacheSlot& slot) const {
+    if (slot.brickId == noBrick) {
+        return;
+    }
+
+    if (slot.dirty) {
+        encode(slot.samples.data(), brickSamples, sampleBytes, bricks[slot.brickId]);
+        slot.dirty = false;
+    }
+
+    cacheSlots[slot.brickId] = -1;
+    slot.brickId = noBrick;
+}
@@ -0,0 +1,143 @@
+#ifndef BRICK_STORE_H
+#define BRICK_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+
+/**
+ * \brief Storage of independently compressed voxel bricks.
+ *
+ * Every brick is compressed losslessly on its own: samples are replaced by
+ * differences with the previous ones, split into byte planes and run-length
+ * encoded. Air and smooth background give long runs of zero bytes, which
+ * are packed tightly, while noisy bricks are kept raw if they don't shrink.
+ *
+ * Single samples are accessed through a small cache of decompressed bricks,
+ * so neighbouring requests decompress each brick only once. Modified cached
+ * bricks are compressed back when evicted. All methods are thread-safe.
+ *
+ * With a loader set, bricks are missing until first accessed and are then
+ * requested from the loader, so stores backed by files are opened lazily.
+ */
+class BrickStore {
+public:
+    /// Default number of decompressed bricks kept in the cache.
+    static const size_t defaultCacheBricks = 256;
+
+    /// Compressed bricks with their indices.
+    using Bricks = std::vector<std::pair<size_t, std::vector<uint8_t>>>;
+
+    /// Function giving the compressed brick and possibly its neighbours.
+    using Loader = std::function<bool(const size_t brickId, Bricks& bricks)>;
+
+    /**
+     * \brief Constructs storage of zero-filled bricks.
+     *
+     * \param[in] _bricksNum Number of bricks
+     * \param[in] _brickSamples Number of samples in each brick
+     * \param[in] _sampleBytes Size of sample in bytes, 1, 2 or 4
+     * \param[in] _cacheBricks Number of decompressed bricks kept in the cache
+     */
+    BrickStore(const size_t _bricksNum, const size_t _brickSamples, const size_t _sampleBytes, const size_t _cacheBricks = defaultCacheBricks);
+
+    /**
+     * \brief Marks all bricks missing, to be loaded on first access.
+     *
+     * The loader is called without locking the store, so several bricks
+     * are loaded in parallel. Bricks it fails to give are zero-filled.
+     *
+     * \param[in] _loader Source of missing bricks compressed by encode()
+     */
+    void setLoader(const Loader& _loader);
+
+    /**
+     * \brief Compresses brick replacing the stored one.
+     *
+     * \param[in] brickId Index of the brick
+     * \param[in] src Brick samples
+     */
+    void store(const size_t brickId, const void* src);
+
+    /**
+     * \brief Decompresses brick.
+     *
+     * \param[in] brickId Index of the brick
+     * \param[out] dst Buffer for the brick samples
+     */
+    void load(const size_t brickId, void* dst) const;
+
+    /**
+     * \brief Reads a single sample through the cache.
+     *
+     * \param[in] brickId Index of the brick
+     * \param[in] offset Index of the sample in the brick
+     * \param[out] dst Buffer for the sample
+     */
+    void read(const size_t brickId, const size_t offset, void* dst) const;
+
+    /**
+     * \brief Writes a single sample through the cache.
+     *
+     * \param[in] brickId Index of the brick
+     * \param[in] offset Index of the sample in the brick
+     * \param[in] src Sample
+     */
+    void write(const size_t brickId, const size_t offset, const void* src);
+
+    /**
+     * \brief Gives memory used by compressed bricks and the cache.
+     *
+     * \return Size in bytes.
+     */
+    size_t getStoredBytes() const;
+
+    /**
+     * \brief Compresses samples.
+     *
+     * \param[in] src Samples
+     * \param[in] count Number of samples
+     * \param[in] sampleBytes Size of sample in bytes, 1, 2 or 4
+     * \param[out] dst Compressed data
+     */
+    static void encode(const void* src, const size_t count, const size_t sampleBytes, std::vector<uint8_t>& dst);
+
+    /**
+     * \brief Decompresses samples compressed by encode().
+     *
+     * \param[in] src Compressed data
+     * \param[in] count Number of samples
+     * \param[in] sampleBytes Size of sample in bytes, 1, 2 or 4
+     * \param[out] dst Buffer for the samples
+     */
+    static void decode(const std::vector<uint8_t>& src, const size_t count, const size_t sampleBytes, void* dst);
+
+private:
+    struct CacheSlot {
+        size_t brickId;
+        uint64_t lastUse;
+        bool dirty;
+        std::vector<uint8_t> samples;
+    };
+
+    void require(const size_t brickId, std::unique_lock<std::mutex>& lock) const;
+    uint8_t* fetch(const size_t brickId) const;
+    void evict(CacheSlot& slot) const;
+
+    size_t brickSamples;
+    size_t sampleBytes;
+    mutable std::vector<std::vector<uint8_t>> bricks;
+    std::vector<uint8_t> zeroBrick;
+    Loader loader;
+    mutable std::vector<CacheSlot> cache;
+    mutable std::vector<int> cacheSlots;
+    mutable uint64_t useCounter = 0;
+    mutable std::mutex mutex;
+};
+
+
+#endif // BRICK_STORE_H
@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include "chunk_file.h"
+#include "io_stats.h"
+
+
+const size_t ChunkFile::chunkSize;
+
+
+ChunkFile::ChunkFile(const size_t sizeX, const size_t sizeY, const size_t sizeZ, const size_t _brickSize, const size_t _sampleBytes) :
+    brickSize(_brickSize),
+    sampleBytes(_sampleBytes),
+    offsets(1, 0) {
+    size[0] = sizeX;
+    size[1] = sizeY;
+    size[2] = sizeZ;
+
+    for (int i = 0; i < 3; ++i) {
+        bricksNum[i] = (size[i] + brickSize - 1) / brickSize;
+        chunksNum[i] = (size[i] + chunkSize - 1) / chunkSize;
+    }
+}
+
+
+bool ChunkFile::open(const std::string& fileName, const std::vector<uint64_t>& _offsets) {
+    if (_offsets.size() != getChunksNum() + 1) {
+        printf("Error: Index of %s has %zu offsets instead of %zu\n", fileName.data(), _offsets.size(), getChunksNum() + 1);
+        return false;
+    }
+
+    file = std::make_shared<RawFile>();
+
+    if (!file->open(fileName)) {
+        return false;
+    }
+
+    if (file->getSize() < _offsets.back()) {
+        printf("Error: Chunks file %s is truncated\n", fileName.data());
+        return false;
+    }
+
+    offsets = _offsets;
+
+    return true;
+}
+
+
+bool ChunkFile::create(const std::string& fileName) {
+    file = std::make_shared<RawFile>();
+    offsets.assign(1, 0);
+
+    return file->create(fileName, 0);
+}
+
+
+size_t ChunkFile::getChunksNum() const {
+    return chunksNum[0] * chunksNum[1] * chunksNum[2];
+}
+
+
+const std::vector<uint64_t>& ChunkFile::getOffsets() const {
+    return offsets;
+}
+
+
+size_t ChunkFile::getBrickChunk(const size_t brickId) const {
+    size_t origin[3];
+    getBrickOrigin(brickId, origin);
+
+    return ((origin[2] / chunkSize) * chunksNum[1] + origin[1] / chunkSize) * chunksNum[0] + origin[0] / chunkSize;
+}
+
+
+bool ChunkFile::readChunk(const size_t chunkId, Bricks& bricks) const {
+    std::vector<size_t> brickIds;
+    getChunkBricks(chunkId, brickIds);
+
+    std::vector<uint8_t> chunk(offsets[chunkId + 1] - offsets[chunkId]);
+    const size_t headerBytes = brickIds.size() * sizeof(uint32_t);
+
+    if (chunk.size() < headerBytes || !file->read(offsets[chunkId], chunk.data(), chunk.size())) {
+        printf("Error: Unable to read chunk %zu\n", chunkId);
+        return false;
+    }
+
+    bricks.resize(brickIds.size());
+    size_t pos = headerBytes;
+
+    for (size_t i = 0; i < brickIds.size(); ++i) {
+        uint32_t brickBytes;
+        memcpy(&brickBytes, chunk.data() + i * sizeof(uint32_t), sizeof(uint32_t));
+
+        if (brickBytes == 0 || pos + brickBytes > chunk.size()) {
+            printf("Error: Chunk %zu is broken\n", chunkId);
+            return false;
+        }
+
+        bricks[i].first = brickIds[i];
+        bricks[i].second.assign(chunk.begin() + pos, chunk.begin() + pos + brickBytes);
+        pos += brickBytes;
+    }
+
+    return true;
+}
+
+
+bool ChunkFile::readRegion(void* dst, const size_t* regionOrigin, const size_t* regionSize, ThreadPool& pool) const {
+    size_t first[3];
+    size_t count[3];
+
+    for (int i = 0; i < 3; ++i) {
+        first[i] = regionOrigin[i] / chunkSize;
+        count[i] = (regionOrigin[i] + regionSize[i] - 1) / chunkSize + 1 - first[i];
+    }
+
+    std::atomic<bool> failed(false);
+
+    // Only chunks intersecting the region are read, each by its own thread
+    pool.parallelFor(0, count[0] * count[1] * count[2], 1, [&](const int begin, const int end) {
+        Bricks bricks;
+        std::vector<uint8_t> brick(brickSize * brickSize * brickSize * sampleBytes);
+
+        for (int i = begin; i < end && !failed; ++i) {
+            const size_t cx = first[0] + i % count[0];
+            const size_t cy = first[1] + i / count[0] % count[1];
+            const size_t cz = first[2] + i / (count[0] * count[1]);
+
+            if (!readChunk((cz * chunksNum[1] + cy) * chunksNum[0] + cx, bricks)) {
+                failed = true;
+                return;
+            }
+
+            IoStats::Timer timer(file->getFileName().c_str(), IoStats::Stage::Read);
+
+            for (const auto& coded : bricks) {
+                size_t origin[3];
+                size_t lo[3];
+                size_t hi[3];
+                getBrickOrigin(coded.first, origin);
+                bool inside = true;
+
+                for (int j = 0; j < 3; ++j) {
+                    lo[j] = std::max(regionOrigin[j], origin[j]);
+                    hi[j] = std::min(std::min(regionOrigin[j] + regionSize[j], origin[j] + brickSize), size[j]);
+                    inside = inside && lo[j] < hi[j];
+                }
+
+                if (!inside) {
+                    continue;
+                }
+
+                BrickStore::decode(coded.second, brick.size() / sampleBytes, sampleBytes, brick.data());
+
+                for (size_t z = lo[2]; z < hi[2]; ++z) {
+                    for (size_t y = lo[1]; y < hi[1]; ++y) {
+                        const uint8_t* srcRow = brick.data() + (((z - origin[2]) * brickSize + (y - origin[1])) * brickSize + lo[0] - origin[0]) * sampleBytes;
+                        uint8_t* dstRow = static_cast<uint8_t*>(dst) + (((z - regionOrigin[2]) * regionSize[1] + y - regionOrigin[1]) * regionSize[0] + lo[0] - regionOrigin[0]) * sampleBytes;
+                        memcpy(dstRow, srcRow, (hi[0] - lo[0]) * sampleBytes);
+                    }
+                }
+            }
+        }
+    });
+
+    return !failed;
+}
+
+
+bool ChunkFile::appendLayers(const void* src, const int zBegin, ThreadPool& pool) {
+    const size_t layerSpace = size[0] * size[1];
+    const size_t rowChunks = chunksNum[1] * chunksNum[0];
+    const size_t chunksFirst = zBegin / chunkSize * rowChunks;
+    std::vector<std::vector<uint8_t>> chunks(rowChunks);
+
+    // Chunks of the row are compressed in parallel
+    pool.parallelFor(0, rowChunks, 1, [&](const int chunkBegin, const int chunkEnd) {
+        std::vector<size_t> brickIds;
+        std::vector<uint8_t> brick(brickSize * brickSize * brickSize * sampleBytes);
+        std::vector<uint8_t> coded;
+
+        for (int i = chunkBegin; i < chunkEnd; ++i) {
+            std::vector<uint8_t>& chunk = chunks[i];
+            IoStats::Timer timer(file->getFileName().c_str(), IoStats::Stage::Write);
+            getChunkBricks(chunksFirst + i, brickIds);
+            chunk.assign(brickIds.size() * sizeof(uint32_t), 0);
+
+            for (size_t j = 0; j < brickIds.size(); ++j) {
+                size_t origin[3];
+                getBrickOrigin(brickIds[j], origin);
+
+                // Bricks at the far borders are padded with zeros
+                const size_t zLast = std::min(origin[2] + brickSize, size[2]);
+                const size_t yLast = std::min(origin[1] + brickSize, size[1]);
+                const size_t count = std::min(brickSize, size[0] - origin[0]);
+                std::fill(brick.begin(), brick.end(), 0);
+
+                for (size_t z = origin[2]; z < zLast; ++z) {
+                    for (size_t y = origin[1]; y < yLast; ++y) {
+                        const uint8_t* srcRow = static_cast<const uint8_t*>(src) + ((z - zBegin) * layerSpace + y * size[0] + origin[0]) * sampleBytes;
+                        memcpy(brick.data() + ((z - origin[2]) * brickSize + (y - origin[1])) * brickSize * sampleBytes, srcRow, count * sampleBytes);
+                    }
+                }
+
+                BrickStore::encode(brick.data(), brick.size() / sampleBytes, sampleBytes, coded);
+
+                const uint32_t codedBytes = coded.size();
+                memcpy(chunk.data() + j * sizeof(uint32_t), &codedBytes, sizeof(uint32_t));
+                chunk.insert(chunk.end(), coded.begin(), coded.end());
+            }
+        }
+    });
+
+    for (const auto& chunk : chunks) {
+        if (!file->write(offsets.back(), chunk.data(), chunk.size())) {
+            return false;
+        }
+
+        offsets.push_back(offsets.back() + chunk.size());
+    }
+
+    return true;
+}
+
+
+void ChunkFile::getChunkBricks(const size_t chunkId, std::vector<size_t>& brickIds) const {
+    const size_t bricksPerChunk = chunkSize / brickSize;
+    const size_t chunk[3] = {chunkId % chunksNum[0], chunkId / chunksNum[0] % chunksNum[1], chunkId / (chunksNum[0] * chunksNum[1])};
+    size_t first[3];
+    size_t last[3];
+
+    for (int i = 0; i < 3; ++i) {
+        first[i] = chunk[i] * bricksPerChunk;
+        last[i] = std::min(first[i] + bricksPerChunk, bricksNum[i]);
+    }
+
+    brickIds.clear();
+
+    for (size_t bz = first[2]; bz < last[2]; ++bz) {
+        for (size_t by = first[1]; by < last[1]; ++by) {
+            for (size_t bx = first[0]; bx < last[0]; ++bx) {
+                brickIds.push_back((bz * bricksNum[1] + by) * bricksNum[0] + bx);
+            }
+        }
+    }
+}
+
+
+void ChunkFile::getBrickOrigin(const size_t brickId, size_t* origin) const {
+    origin[0] = brickId % bricksNum[0] * brickSize;
+    origin[1] = brickId / bricksNum[0] % bricksNum[1] * brickSize;
+    origin[2] = brickId / (bricksNum[0] * bricksNum[1]) * brickSize;
+}
@@ -0,0 +1,130 @@
+#ifndef CHUNK_FILE_H
+#define CHUNK_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "brick_store.h"
+#include "raw_file.h"
+#include "thread_pool.h"
+
+
+/**
+ * \brief Volume stored as a single file of compressed cubic chunks.
+ *
+ * The volume is split into bricks of brickSize voxels per side, numbered in
+ * the same way as bricks of VoxelContainer::Layout::Bricked. Each brick is
+ * compressed by BrickStore::encode(), and bricks are grouped into chunks of
+ * chunkSize voxels per side. A chunk is the unit of reading: sizes of its
+ * bricks in 32-bit words are followed by the compressed bricks, both in
+ * z-y-x order. Chunks follow each other in z-y-x order, and their offsets
+ * form the index kept in the volume parameters.
+ *
+ * Any region of the volume is read by fetching only the chunks it
+ * intersects, so slices in any plane and bands of layers are extracted
+ * without reading the whole file.
+ */
+class ChunkFile {
+public:
+    /// Side of a chunk in voxels.
+    static const size_t chunkSize = 32;
+
+    /// Compressed bricks of a chunk with their indices in the volume.
+    using Bricks = BrickStore::Bricks;
+
+    /**
+     * \brief Constructs description of the chunked volume.
+     *
+     * \param[in] sizeX, sizeY, sizeZ Volume size
+     * \param[in] _brickSize Side of a brick in voxels, must divide chunkSize
+     * \param[in] _sampleBytes Size of sample in bytes
+     */
+    ChunkFile(const size_t sizeX, const size_t sizeY, const size_t sizeZ, const size_t _brickSize, const size_t _sampleBytes);
+
+    /**
+     * \brief Opens existing file.
+     *
+     * \param[in] fileName Path to the file
+     * \param[in] _offsets Offsets of chunks followed by the end of the last one
+     * \return True - if success, false - if failed.
+     */
+    bool open(const std::string& fileName, const std::vector<uint64_t>& _offsets);
+
+    /**
+     * \brief Creates empty file to be filled by appendLayers().
+     *
+     * \param[in] fileName Path to the file
+     * \return True - if success, false - if failed.
+     */
+    bool create(const std::string& fileName);
+
+    /**
+     * \brief Gives number of chunks.
+     *
+     * \return Number of chunks.
+     */
+    size_t getChunksNum() const;
+
+    /**
+     * \brief Gives offsets of the chunks written so far.
+     *
+     * \return Offsets of chunks followed by the end of the last one.
+     */
+    const std::vector<uint64_t>& getOffsets() const;
+
+    /**
+     * \brief Gives chunk holding the brick.
+     *
+     * \param[in] brickId Index of the brick
+     * \return Index of the chunk.
+     */
+    size_t getBrickChunk(const size_t brickId) const;
+
+    /**
+     * \brief Reads compressed bricks of the chunk.
+     *
+     * \param[in] chunkId Index of the chunk
+     * \param[out] bricks Compressed bricks
+     * \return True - if success, false - if failed.
+     */
+    bool readChunk(const size_t chunkId, Bricks& bricks) const;
+
+    /**
+     * \brief Reads region decompressing only the chunks it intersects.
+     *
+     * \param[out] dst Buffer of the region in z-y-x order
+     * \param[in] regionOrigin First voxel of the region along x, y and z
+     * \param[in] regionSize Size of the region along x, y and z
+     * \param[in] pool Threads reading chunks
+     * \return True - if success, false - if failed.
+     */
+    bool readRegion(void* dst, const size_t* regionOrigin, const size_t* regionSize, ThreadPool& pool) const;
+
+    /**
+     * \brief Compresses the next row of chunks and appends it to the file.
+     *
+     * \param[in] src Layers [zBegin, zBegin + chunkSize) in z-y-x order, or
+     *                fewer at the end of the volume
+     * \param[in] zBegin First layer, must be the first layer of a chunk
+     * \param[in] pool Threads compressing chunks
+     * \return True - if success, false - if failed.
+     */
+    bool appendLayers(const void* src, const int zBegin, ThreadPool& pool);
+
+private:
+    void getChunkBricks(const size_t chunkId, std::vector<size_t>& brickIds) const;
+    void getBrickOrigin(const size_t brickId, size_t* origin) const;
+
+    size_t size[3];
+    size_t brickSize;
+    size_t sampleBytes;
+    size_t bricksNum[3];
+    size_t chunksNum[3];
+    std::vector<uint64_t> offsets;
+    std::shared_ptr<RawFile> file;
+};
+
+
+#endif // CHUNK_FILE_H
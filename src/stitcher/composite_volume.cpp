@@ -0,0 +1,517 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "composite_volume.h"
+
+
+/// Distance to a border standing for no border at all.
+static const int unbounded = std::numeric_limits<int>::max() / 2;
+
+
+static void fillSamples(unsigned char* dst, const unsigned char* sample, const size_t count, const size_t sampleSize) {
+    if (count == 0) {
+        return;
+    }
+
+    // Filled part is doubled by each copy
+    const size_t bytes = count * sampleSize;
+    size_t filled = sampleSize;
+    memcpy(dst, sample, sampleSize);
+
+    while (filled < bytes) {
+        const size_t chunk = std::min(filled, bytes - filled);
+        memcpy(dst + filled, dst, chunk);
+        filled += chunk;
+    }
+}
+
+
+static void getCoveredSpan(const int offset, const int extent, int& begin, int& end) {
+    begin = std::min(extent, std::max(0, -offset));
+    end = std::max(begin, std::min(extent, extent - offset));
+}
+
+
+static int clampIndex(const int i, const int extent) {
+    return std::min(extent - 1, std::max(0, i));
+}
+
+
+static void splitFraction(const float fraction, int& base, float& weight) {
+    base = std::floor(fraction);
+    weight = fraction - base;
+}
+
+
+static void mixSamples(const float* a, const float* b, const float weight, float* dst, const size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = a[i] + weight * (b[i] - a[i]);
+    }
+}
+
+
+static void shiftSamples(const float* src, const int length, const int base, const float weight, float* dst) {
+    // Samples with both neighbours inside are mixed as one span, the ends are clamped
+    const int begin = std::min(length, std::max(0, -base));
+    const int end = std::max(begin, std::min(length, length - 1 - base));
+
+    for (int i = 0; i < begin; ++i) {
+        const float a = src[clampIndex(i + base, length)];
+        dst[i] = a + weight * (src[clampIndex(i + base + 1, length)] - a);
+    }
+
+    mixSamples(src + begin + base, src + begin + base + 1, weight, dst + begin, end - begin);
+
+    for (int i = end; i < length; ++i) {
+        const float a = src[clampIndex(i + base, length)];
+        dst[i] = a + weight * (src[clampIndex(i + base + 1, length)] - a);
+    }
+}
+
+
+static int getBorderDistance(const int i, const int begin, const int end, const int extent) {
+    // Ends of the span at the volume borders are not seams
+    const int toBegin = begin > 0 ? i - begin + 1 : unbounded;
+    const int toEnd = end < extent ? end - i : unbounded;
+
+    return std::min(toBegin, toEnd);
+}
+
+
+static float getLowerWeight(const CompositeVolume::BlendMode mode, const int z_2, const int overlap, const int border_1, const int border_2) {
+    switch (mode) {
+        case CompositeVolume::BlendMode::HardCut:
+            return 2 * z_2 >= overlap ? 1 : 0;
+        case CompositeVolume::BlendMode::Linear:
+            return (z_2 + 0.5f) / overlap;
+        default: {
+            // Layers of the upper part left below and of the lower one above, including the current one
+            const float d_1 = std::min(overlap - z_2, border_1);
+            const float d_2 = std::min(z_2 + 1, border_2);
+
+            return d_2 / (d_1 + d_2);
+        }
+    }
+}
+
+
+CompositeVolume::CompositeVolume(const std::vector<std::shared_ptr<VoxelContainer>>& _parts) {
+    setParts(_parts);
+}
+
+
+void CompositeVolume::setParts(const std::vector<std::shared_ptr<VoxelContainer>>& _parts) {
+    parts = _parts;
+    partEnds.clear();
+    placements.clear();
+    size = {0, 0, 0};
+    range = {0, 0};
+    sampleType = VoxelContainer::SampleType::Float32;
+    referenceParams = {0, 0, 0};
+    stats.reset(0);
+
+    if (parts.empty()) {
+        return;
+    }
+
+    const VoxelContainer::Vector3& firstSize = parts.front()->getSize();
+    size = {firstSize.x, firstSize.y, 0};
+    range = parts.front()->getRange();
+    sampleType = parts.front()->getSampleType();
+    referenceParams = parts.front()->getRefStitchParams();
+
+    // Each part ends at its offset plus height, but never before the previous one
+    for (const auto& part : parts) {
+        placements.push_back(part->getEstStitchParams());
+        const int partEnd = placements.back().offsetZ + static_cast<int>(part->getSize().z);
+        size.z = std::max(static_cast<int>(size.z), partEnd);
+        partEnds.push_back(size.z);
+
+        range.min = std::min(range.min, part->getRange().min);
+        range.max = std::max(range.max, part->getRange().max);
+
+        if (part->getSampleType() != sampleType) {
+            sampleType = VoxelContainer::SampleType::Float32;
+        }
+    }
+}
+
+
+const std::vector<std::shared_ptr<VoxelContainer>>& CompositeVolume::getParts() const {
+    return parts;
+}
+
+
+bool CompositeVolume::isEmpty() const {
+    return parts.empty();
+}
+
+
+const VoxelContainer::Vector3& CompositeVolume::getSize() const {
+    return size;
+}
+
+
+const VoxelContainer::Range& CompositeVolume::getRange() const {
+    return range;
+}
+
+
+const VolumeStats& CompositeVolume::getStats() const {
+    std::lock_guard<std::mutex> lock(statsMutex);
+
+    // Parts might be loaded without statistics, so they are merged on demand
+    if (stats.isEmpty()) {
+        for (const auto& part : parts) {
+            stats.merge(part->getStats());
+        }
+    }
+
+    return stats;
+}
+
+
+VoxelContainer::SampleType CompositeVolume::getSampleType() const {
+    return sampleType;
+}
+
+
+const VoxelContainer::StitchParams& CompositeVolume::getRefStitchParams() const {
+    return referenceParams;
+}
+
+
+void CompositeVolume::setBlendMode(const BlendMode mode) {
+    blendMode = mode;
+}
+
+
+CompositeVolume::BlendMode CompositeVolume::getBlendMode() const {
+    return blendMode;
+}
+
+
+float CompositeVolume::get(const int x, const int y, const int z) const {
+    const int partId = findPart(z);
+    float upperValue = range.min;
+    const bool upperCovered = getPartVoxel(partId, x, y, z, upperValue);
+    float lowerValue = range.min;
+
+    if (!isBlended(partId, z) || !getPartVoxel(partId + 1, x, y, z, lowerValue)) {
+        return upperValue;
+    }
+
+    if (!upperCovered) {
+        return lowerValue;
+    }
+
+    // Same weights as blendLayer() gives
+    const VoxelContainer::StitchParams& upperParams = placements[partId];
+    const VoxelContainer::StitchParams& lowerParams = placements[partId + 1];
+    int begin[4];
+    int end[4];
+    getCoveredSpan(upperParams.offsetX, size.x, begin[0], end[0]);
+    getCoveredSpan(upperParams.offsetY, size.y, begin[1], end[1]);
+    getCoveredSpan(lowerParams.offsetX, size.x, begin[2], end[2]);
+    getCoveredSpan(lowerParams.offsetY, size.y, begin[3], end[3]);
+
+    const int border_1 = std::min(getBorderDistance(x, begin[0], end[0], size.x), getBorderDistance(y, begin[1], end[1], size.y));
+    const int border_2 = std::min(getBorderDistance(x, begin[2], end[2], size.x), getBorderDistance(y, begin[3], end[3], size.y));
+    const int overlap = upperParams.offsetZ + static_cast<int>(parts[partId]->getSize().z) - lowerParams.offsetZ;
+    const float weight = getLowerWeight(blendMode, z - lowerParams.offsetZ, overlap, border_1, border_2);
+
+    return (1 - weight) * upperValue + weight * lowerValue;
+}
+
+
+void CompositeVolume::copyLayers(void* dst, const int zBegin, const int zEnd, const VoxelContainer::SampleType dstType) const {
+    const size_t layerBytes = size.x * size.y * VoxelContainer::getSampleSize(dstType);
+
+    // Layers are independent, so they are placed by all threads
+    ThreadPool::getDefault().parallelFor(zBegin, zEnd, 1, [&](const int layerBegin, const int layerEnd) {
+        for (int z = layerBegin; z < layerEnd; ++z) {
+            unsigned char* dstLayer = static_cast<unsigned char*>(dst) + (z - zBegin) * layerBytes;
+            const int partId = findPart(z);
+            const VoxelContainer::StitchParams& params = placements[partId];
+
+            if (isBlended(partId, z)) {
+                blendLayer(*parts[partId], params, *parts[partId + 1], placements[partId + 1], z, blendMode, dstLayer, dstType, range.min);
+            }
+            else {
+                placeLayer(*parts[partId], z - params.offsetZ, params, dstLayer, dstType, range.min);
+            }
+        }
+    });
+}
+
+
+void CompositeVolume::placeLayer(const VoxelContainer& part, const int z, const VoxelContainer::StitchParams& shift, void* dst, const VoxelContainer::SampleType dstType, const float fill) {
+    const VoxelContainer::Vector3& partSize = part.getSize();
+    const int offsetX = shift.offsetX;
+    const int offsetY = shift.offsetY;
+    const int width = partSize.x;
+    const int height = partSize.y;
+    const size_t layerSpace = partSize.x * partSize.y;
+    const size_t dstSampleSize = VoxelContainer::getSampleSize(dstType);
+    const size_t rowBytes = width * dstSampleSize;
+    unsigned char* dstLayer = static_cast<unsigned char*>(dst);
+
+    unsigned char fillSample[sizeof(float)];
+    VoxelContainer::convertSamples(&fill, VoxelContainer::SampleType::Float32, fillSample, 1, dstType);
+
+    if (z < 0 || z >= partSize.z) {
+        fillSamples(dstLayer, fillSample, layerSpace, dstSampleSize);
+        return;
+    }
+
+    // Unshifted layer is copied in place
+    if (offsetX == 0 && offsetY == 0 && shift.isWhole()) {
+        part.copyLayers(dst, z, z + 1, dstType);
+        return;
+    }
+
+    std::vector<unsigned char> layer(layerSpace * dstSampleSize);
+
+    if (shift.isWhole()) {
+        part.copyLayers(layer.data(), z, z + 1, dstType);
+    }
+    else {
+        std::vector<float> resampled(layerSpace);
+        resampleLayer(part, z, shift, resampled.data());
+        VoxelContainer::convertSamples(resampled.data(), VoxelContainer::SampleType::Float32, layer.data(), layerSpace, dstType);
+    }
+
+    // Covered columns are the same in every row, so rows are copied as spans between margins
+    const int xBegin = std::min(width, std::max(0, -offsetX));
+    const int xEnd = std::max(xBegin, std::min(width, width - offsetX));
+
+    for (int y = 0; y < height; ++y) {
+        const int y2 = y + offsetY;
+        unsigned char* dstRow = dstLayer + y * rowBytes;
+
+        if (y2 < 0 || y2 >= height || xBegin == xEnd) {
+            fillSamples(dstRow, fillSample, width, dstSampleSize);
+            continue;
+        }
+
+        fillSamples(dstRow, fillSample, xBegin, dstSampleSize);
+        memcpy(dstRow + xBegin * dstSampleSize, layer.data() + (y2 * width + xBegin + offsetX) * dstSampleSize, (xEnd - xBegin) * dstSampleSize);
+        fillSamples(dstRow + xEnd * dstSampleSize, fillSample, width - xEnd, dstSampleSize);
+    }
+}
+
+
+void CompositeVolume::blendLayer(const VoxelContainer& upper, const VoxelContainer::StitchParams& upperParams, const VoxelContainer& lower, const VoxelContainer::StitchParams& lowerParams, const int z, const BlendMode mode, void* dst, const VoxelContainer::SampleType dstType, const float fill) {
+    const VoxelContainer::Vector3& partSize = upper.getSize();
+    const int width = partSize.x;
+    const int height = partSize.y;
+    const size_t layerSpace = partSize.x * partSize.y;
+    const int z_2 = z - lowerParams.offsetZ;
+    const int overlap = upperParams.offsetZ + static_cast<int>(partSize.z) - lowerParams.offsetZ;
+    std::vector<float> layer_1(layerSpace);
+    std::vector<float> layer_2(layerSpace);
+    std::vector<float> blended(layerSpace);
+
+    resampleLayer(upper, z - upperParams.offsetZ, upperParams, layer_1.data());
+    resampleLayer(lower, z_2, lowerParams, layer_2.data());
+
+    int xBegin_1, xEnd_1, yBegin_1, yEnd_1;
+    int xBegin_2, xEnd_2, yBegin_2, yEnd_2;
+    getCoveredSpan(upperParams.offsetX, width, xBegin_1, xEnd_1);
+    getCoveredSpan(upperParams.offsetY, height, yBegin_1, yEnd_1);
+    getCoveredSpan(lowerParams.offsetX, width, xBegin_2, xEnd_2);
+    getCoveredSpan(lowerParams.offsetY, height, yBegin_2, yEnd_2);
+
+    const int xBegin = std::max(xBegin_1, xBegin_2);
+    const int xEnd = std::max(xBegin, std::min(xEnd_1, xEnd_2));
+
+    // Weights of HardCut and Linear are the same over the whole layer
+    const float layerWeight = getLowerWeight(mode, z_2, overlap, unbounded, unbounded);
+
+    for (int y = 0; y < height; ++y) {
+        float* row = blended.data() + y * width;
+        const bool covered_1 = y >= yBegin_1 && y < yEnd_1 && xBegin_1 < xEnd_1;
+        const bool covered_2 = y >= yBegin_2 && y < yEnd_2 && xBegin_2 < xEnd_2;
+        const float* row_2 = nullptr;
+
+        // Spans of the parts are laid over the fill, the upper one on top
+        std::fill(row, row + width, fill);
+
+        if (covered_2) {
+            row_2 = layer_2.data() + (y + lowerParams.offsetY) * width;
+            memcpy(row + xBegin_2, row_2 + xBegin_2 + lowerParams.offsetX, (xEnd_2 - xBegin_2) * sizeof(float));
+        }
+
+        if (covered_1) {
+            const float* row_1 = layer_1.data() + (y + upperParams.offsetY) * width;
+            memcpy(row + xBegin_1, row_1 + xBegin_1 + upperParams.offsetX, (xEnd_1 - xBegin_1) * sizeof(float));
+        }
+
+        if (!covered_1 || !covered_2) {
+            continue;
+        }
+
+        if (mode != BlendMode::Distance) {
+            for (int x = xBegin; x < xEnd; ++x) {
+                row[x] = (1 - layerWeight) * row[x] + layerWeight * row_2[x + lowerParams.offsetX];
+            }
+
+            continue;
+        }
+
+        // Distances to the borders along y are shared by the row
+        const int rowBorder_1 = getBorderDistance(y, yBegin_1, yEnd_1, height);
+        const int rowBorder_2 = getBorderDistance(y, yBegin_2, yEnd_2, height);
+
+        for (int x = xBegin; x < xEnd; ++x) {
+            const int border_1 = std::min(rowBorder_1, getBorderDistance(x, xBegin_1, xEnd_1, width));
+            const int border_2 = std::min(rowBorder_2, getBorderDistance(x, xBegin_2, xEnd_2, width));
+            const float weight = getLowerWeight(mode, z_2, overlap, border_1, border_2);
+            row[x] = (1 - weight) * row[x] + weight * row_2[x + lowerParams.offsetX];
+        }
+    }
+
+    VoxelContainer::convertSamples(blended.data(), VoxelContainer::SampleType::Float32, dst, layerSpace, dstType);
+}
+
+
+void CompositeVolume::resampleLayer(const VoxelContainer& part, const int z, const VoxelContainer::StitchParams& shift, float* dst) {
+    if (shift.isWhole()) {
+        part.copyLayers(dst, z, z + 1, VoxelContainer::SampleType::Float32);
+        return;
+    }
+
+    const VoxelContainer::Vector3& partSize = part.getSize();
+    const int width = partSize.x;
+    const int height = partSize.y;
+    const size_t layerSpace = partSize.x * partSize.y;
+
+    // Every axis mixes two neighbours starting from the floor of the sample position
+    int baseX, baseY, baseZ;
+    float weightX, weightY, weightZ;
+    splitFraction(shift.fractionX, baseX, weightX);
+    splitFraction(shift.fractionY, baseY, weightY);
+    splitFraction(-shift.fractionZ, baseZ, weightZ);
+
+    const int z_0 = clampIndex(z + baseZ, partSize.z);
+    const int z_1 = clampIndex(z + baseZ + 1, partSize.z);
+    std::vector<float> layer(layerSpace);
+    part.copyLayers(layer.data(), z_0, z_0 + 1, VoxelContainer::SampleType::Float32);
+
+    if (weightZ != 0 && z_1 != z_0) {
+        std::vector<float> nextLayer(layerSpace);
+        part.copyLayers(nextLayer.data(), z_1, z_1 + 1, VoxelContainer::SampleType::Float32);
+        mixSamples(layer.data(), nextLayer.data(), weightZ, layer.data(), layerSpace);
+    }
+
+    std::vector<float> row(width);
+
+    for (int y = 0; y < height; ++y) {
+        const float* row_0 = layer.data() + clampIndex(y + baseY, height) * width;
+        const float* row_1 = layer.data() + clampIndex(y + baseY + 1, height) * width;
+
+        mixSamples(row_0, row_1, weightY, row.data(), width);
+        shiftSamples(row.data(), width, baseX, weightX, dst + y * width);
+    }
+}
+
+
+std::shared_ptr<VoxelContainer> CompositeVolume::materialize() const {
+    auto stitched = std::make_shared<VoxelContainer>();
+    stitched->setSampleType(sampleType);
+
+    // Every voxel is written by copyLayers(), so the memory isn't cleared first
+    if (!stitched->reshape(size, range)) {
+        return nullptr;
+    }
+
+    stitched->setRefStitchParams(referenceParams);
+
+    copyLayers(stitched->getRawData(), 0, size.z, sampleType);
+
+    return stitched;
+}
+
+
+bool CompositeVolume::saveToJson(const std::string& dirName, const VoxelContainer::FileFormat format, const VoxelContainer::SaveMapping* mapping) const {
+    return VoxelContainer::saveToJson(dirName, size, range, sampleType, [this](void* dst, const int z, const VoxelContainer::SampleType type) {
+        copyLayers(dst, z, z + 1, type);
+    }, nullptr, format, mapping);
+}
+
+
+std::future<bool> CompositeVolume::saveToJsonAsync(const std::string& dirName, std::atomic<int>* savedLayers, const VoxelContainer::FileFormat format, const VoxelContainer::SaveMapping* mapping) const {
+    return VoxelContainer::saveToJsonAsync(dirName, size, range, sampleType, [this](void* dst, const int z, const VoxelContainer::SampleType type) {
+        copyLayers(dst, z, z + 1, type);
+    }, savedLayers, format, mapping);
+}
+
+
+bool CompositeVolume::isBlended(const int partId, const int z) const {
+    if (blendMode == BlendMode::None || partId + 1 >= static_cast<int>(parts.size())) {
+        return false;
+    }
+
+    const int z_1 = z - placements[partId].offsetZ;
+    const int z_2 = z - placements[partId + 1].offsetZ;
+
+    return z_1 >= 0 && z_1 < static_cast<int>(parts[partId]->getSize().z) && z_2 >= 0 && z_2 < static_cast<int>(parts[partId + 1]->getSize().z);
+}
+
+
+bool CompositeVolume::getPartVoxel(const int partId, const int x, const int y, const int z, float& val) const {
+    const VoxelContainer& part = *parts[partId];
+    const VoxelContainer::StitchParams& params = placements[partId];
+    const VoxelContainer::Vector3& partSize = part.getSize();
+    const int x2 = x + params.offsetX;
+    const int y2 = y + params.offsetY;
+    const int z2 = z - params.offsetZ;
+
+    if (x2 < 0 || x2 >= partSize.x || y2 < 0 || y2 >= partSize.y || z2 < 0 || z2 >= partSize.z) {
+        return false;
+    }
+
+    if (params.isWhole()) {
+        val = part.get(x2, y2, z2);
+        return true;
+    }
+
+    // Same order of mixing as resampleLayer() has
+    int baseX, baseY, baseZ;
+    float weightX, weightY, weightZ;
+    splitFraction(params.fractionX, baseX, weightX);
+    splitFraction(params.fractionY, baseY, weightY);
+    splitFraction(-params.fractionZ, baseZ, weightZ);
+
+    const int xs[2] = {clampIndex(x2 + baseX, partSize.x), clampIndex(x2 + baseX + 1, partSize.x)};
+    const int ys[2] = {clampIndex(y2 + baseY, partSize.y), clampIndex(y2 + baseY + 1, partSize.y)};
+    const int zs[2] = {clampIndex(z2 + baseZ, partSize.z), clampIndex(z2 + baseZ + 1, partSize.z)};
+    float row[2];
+
+    for (int i = 0; i < 2; ++i) {
+        float column[2];
+
+        for (int j = 0; j < 2; ++j) {
+            const float a = part.get(xs[i], ys[j], zs[0]);
+            column[j] = a + weightZ * (part.get(xs[i], ys[j], zs[1]) - a);
+        }
+
+        row[i] = column[0] + weightY * (column[1] - column[0]);
+    }
+
+    val = row[0] + weightX * (row[1] - row[0]);
+
+    return true;
+}
+
+
+int CompositeVolume::findPart(const int z) const {
+    auto it = std::upper_bound(partEnds.begin(), partEnds.end(), z);
+
+    if (it == partEnds.end()) {
+        return parts.size() - 1;
+    }
+
+    return it - partEnds.begin();
+}
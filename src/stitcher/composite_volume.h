@@ -0,0 +1,345 @@
+#ifndef COMPOSITE_VOLUME_H
+#define COMPOSITE_VOLUME_H
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "voxel_container.h"
+
+
+/**
+ * \brief Stitched reconstruction resolved from its parts on demand.
+ *
+ * CompositeVolume references the partial reconstructions and places each of
+ * them according to its estimated stitch parameters, which must hold the
+ * absolute offsets of the part inside the stitched volume (as set by
+ * StitcherImpl::compose()). Voxel and slice requests are answered directly
+ * from the parts, so nothing of the stitched volume size is allocated until
+ * materialize() is called. saveToJson() writes the result layer by layer.
+ *
+ * Parts are placed by the whole voxels of their offsets. Fractions of
+ * voxels are resampled by trilinear interpolation of the part, see
+ * resampleLayer(), only for the parts having them.
+ *
+ * Every part covers the layers from the end of the previous one up to its
+ * own end, so overlaps are taken from the upper part unless a blend mode
+ * is selected by setBlendMode(). Voxels not covered by any part are filled
+ * with the minimum of the common range.
+ */
+class CompositeVolume {
+public:
+    /// Mixing of the layers covered by two neighbouring parts.
+    enum class BlendMode {
+        None,    ///< Overlap is taken from the upper part
+        HardCut, ///< Overlap is taken from the upper part down to its middle layer and from the lower one below
+        Linear,  ///< Weight of the lower part grows linearly across the overlap
+        Distance ///< Weights are proportional to distances to the nearest borders of the parts inside the stitched volume
+    };
+
+    /// Default constructor. Creates an empty instance.
+    CompositeVolume() = default;
+
+    /**
+     * \brief Constructs composite of the given parts.
+     *
+     * \param[in] _parts Partial reconstructions with absolute estimated stitch parameters
+     */
+    CompositeVolume(const std::vector<std::shared_ptr<VoxelContainer>>& _parts);
+
+    /**
+     * \brief Replaces parts and recalculates their placement.
+     *
+     * Estimated stitch parameters are copied, so the composite keeps its
+     * placement when parts are estimated again (for example while it is
+     * being saved in the background). Call it again to take the new ones.
+     *
+     * \param[in] _parts Partial reconstructions with absolute estimated stitch parameters
+     */
+    void setParts(const std::vector<std::shared_ptr<VoxelContainer>>& _parts);
+
+    /**
+     * \brief Gives the referenced parts.
+     *
+     * \return Partial reconstructions.
+     */
+    const std::vector<std::shared_ptr<VoxelContainer>>& getParts() const;
+
+    /**
+     * \brief Checks if composite is empty.
+     *
+     * \return True - if empty, false - if not.
+     */
+    bool isEmpty() const;
+
+    /**
+     * \brief Gives stitched volume size.
+     *
+     * \return Stitched volume size.
+     */
+    const VoxelContainer::Vector3& getSize() const;
+
+    /**
+     * \brief Gives common range of the parts.
+     *
+     * \return Stitched volume range.
+     */
+    const VoxelContainer::Range& getRange() const;
+
+    /**
+     * \brief Gives value statistics merged from all parts.
+     *
+     * Statistics are merged on the first call, collecting them first for
+     * parts loaded without. Per-layer moments are not available for the
+     * composite.
+     *
+     * \return Value statistics.
+     */
+    const VolumeStats& getStats() const;
+
+    /**
+     * \brief Gives sample type shared by all parts.
+     *
+     * \return Common sample type or SampleType::Float32 if parts differ.
+     */
+    VoxelContainer::SampleType getSampleType() const;
+
+    /**
+     * \brief Gives reference stitch parameters of the first part.
+     *
+     * \return Reference stitch parameters.
+     */
+    const VoxelContainer::StitchParams& getRefStitchParams() const;
+
+    /**
+     * \brief Selects mixing of overlaps of neighbouring parts.
+     *
+     * Applies to voxels, slices and layers of the composite, so views,
+     * saves and materialize() give the same values.
+     *
+     * \param[in] mode Blend mode, BlendMode::None by default
+     */
+    void setBlendMode(const BlendMode mode);
+
+    /**
+     * \brief Gives mixing of overlaps of neighbouring parts.
+     *
+     * \return Blend mode.
+     */
+    BlendMode getBlendMode() const;
+
+    /**
+     * \brief Gives voxel value by its 3D index in the stitched volume.
+     *
+     * \return Voxel value converted to float.
+     */
+    float get(const int x, const int y, const int z) const;
+
+    /**
+     * \brief Copies horizontal layers of the stitched volume in z-y-x order.
+     *
+     * \param[in] dst Destination buffer of (zEnd - zBegin) layers size
+     * \param[in] zBegin First layer to copy
+     * \param[in] zEnd Layer after the last one to copy
+     * \param[in] dstType Type of values in the destination buffer
+     */
+    void copyLayers(void* dst, const int zBegin, const int zEnd, const VoxelContainer::SampleType dstType) const;
+
+    /**
+     * \brief Gives a specified slice of the stitched volume.
+     *
+     * Same as VoxelContainer::getSlice().
+     *
+     * \param[in] img Destination image of slice
+     * \param[in] planeId Index of the slice plane
+     * \param[in] sliceId Index of the slice. Must be inside volume borders
+     * \param[in] fitToRange Is needed to fit slice to the range of its data type
+     */
+    template<typename T>
+    void getSlice(TiffImage<T>& img, const int planeId, const int sliceId, bool fitToRange = true) const;
+
+    /**
+     * \brief Gives a specified slice with values windowed to the data type.
+     *
+     * Same as VoxelContainer::getSlice() with window.
+     *
+     * \param[in] img Destination image of slice
+     * \param[in] planeId Index of the slice plane
+     * \param[in] sliceId Index of the slice. Must be inside volume borders
+     * \param[in] window Range of values to be displayed
+     */
+    template<typename T>
+    void getSlice(TiffImage<T>& img, const int planeId, const int sliceId, const VoxelContainer::Range& window) const;
+
+    /**
+     * \brief Allocates the stitched volume and fills it from the parts.
+     *
+     * \return Shared pointer to the new stitched reconstruction or nullptr if it can't be allocated.
+     */
+    std::shared_ptr<VoxelContainer> materialize() const;
+
+    /**
+     * \brief Saves stitched volume into special format layer by layer.
+     *
+     * \param[in] dirName Path to the output directory
+     * \param[in] format Layout of the saved files
+     * \param[in] mapping Conversion of values into saved samples, might be nullptr to save them as they are
+     * \return True - if success, false - if failed.
+     */
+    bool saveToJson(const std::string& dirName, const VoxelContainer::FileFormat format = VoxelContainer::FileFormat::Slices, const VoxelContainer::SaveMapping* mapping = nullptr) const;
+
+    /**
+     * \brief Saves stitched volume into special format in the background.
+     *
+     * Same as saveToJson(), see VoxelContainer::saveToJsonAsync(). The
+     * composite must outlive the save.
+     *
+     * \param[in] dirName Path to the output directory
+     * \param[out] savedLayers Counter of written layers, might be nullptr
+     * \param[in] format Layout of the saved files
+     * \param[in] mapping Conversion of values into saved samples, might be nullptr to save them as they are
+     * \return Future giving true - if success, false - if failed.
+     */
+    std::future<bool> saveToJsonAsync(const std::string& dirName, std::atomic<int>* savedLayers = nullptr, const VoxelContainer::FileFormat format = VoxelContainer::FileFormat::Slices, const VoxelContainer::SaveMapping* mapping = nullptr) const;
+
+    /**
+     * \brief Copies a layer of the part shifted in its plane.
+     *
+     * Voxel (x, y) of the destination is taken from (x + offsetX, y + offsetY)
+     * of the part, resampled by resampleLayer() if the shift has fractions.
+     * Voxels outside of the part, or the whole layer if z is outside of it,
+     * are filled with the given value.
+     *
+     * \param[in] part Partial reconstruction
+     * \param[in] z Index of the layer in the part
+     * \param[in] shift Shift of the part, its offsetZ is not used as z is given in the part
+     * \param[in] dst Destination buffer of one layer of the part size
+     * \param[in] dstType Type of values in the destination buffer
+     * \param[in] fill Value of uncovered voxels
+     */
+    static void placeLayer(const VoxelContainer& part, const int z, const VoxelContainer::StitchParams& shift, void* dst, const VoxelContainer::SampleType dstType, const float fill);
+
+    /**
+     * \brief Reads a layer of the part moved by fractions of a voxel.
+     *
+     * Voxel (x, y) of the destination is interpolated trilinearly at
+     * (x + fractionX, y + fractionY, z - fractionZ) of the part, samples
+     * beyond its borders are taken from the nearest border voxels. Layers,
+     * rows and columns are mixed in turn over contiguous samples, so the
+     * loops are vectorized. The layer is copied as it is if all fractions
+     * are zero.
+     *
+     * \param[in] part Partial reconstruction
+     * \param[in] z Index of the layer in the part, inside it
+     * \param[in] shift Shift of the part, only its fractions are used
+     * \param[out] dst Destination buffer of one layer of the part size
+     */
+    static void resampleLayer(const VoxelContainer& part, const int z, const VoxelContainer::StitchParams& shift, float* dst);
+
+    /**
+     * \brief Mixes a layer of the overlap of two parts.
+     *
+     * Both parts are placed like by placeLayer(), and each of their layers
+     * is read once. Voxels covered by one part only are taken from it, and
+     * voxels covered by both are mixed with weights computed per row.
+     *
+     * \param[in] upper Upper partial reconstruction
+     * \param[in] upperParams Absolute offsets of the upper part
+     * \param[in] lower Lower partial reconstruction, starting inside the upper one
+     * \param[in] lowerParams Absolute offsets of the lower part
+     * \param[in] z Index of the layer in the stitched volume, inside both parts
+     * \param[in] mode Mixing of the parts
+     * \param[in] dst Destination buffer of one layer of the part size
+     * \param[in] dstType Type of values in the destination buffer
+     * \param[in] fill Value of uncovered voxels
+     */
+    static void blendLayer(const VoxelContainer& upper, const VoxelContainer::StitchParams& upperParams, const VoxelContainer& lower, const VoxelContainer::StitchParams& lowerParams, const int z, const BlendMode mode, void* dst, const VoxelContainer::SampleType dstType, const float fill);
+
+private:
+    bool isBlended(const int partId, const int z) const;
+
+    bool getPartVoxel(const int partId, const int x, const int y, const int z, float& val) const;
+
+    int findPart(const int z) const;
+    template<typename T>
+    void fillSlice(TiffImage<T>& img, const int planeId, const int sliceId, const VoxelContainer::Range& srcRange, const VoxelContainer::Range& newRange, const bool clamp) const;
+
+    std::vector<std::shared_ptr<VoxelContainer>> parts;
+    std::vector<int> partEnds;
+    std::vector<VoxelContainer::StitchParams> placements;
+    VoxelContainer::Vector3 size = {0, 0, 0};
+    VoxelContainer::Range range = {0, 0};
+    VoxelContainer::SampleType sampleType = VoxelContainer::SampleType::Float32;
+    VoxelContainer::StitchParams referenceParams = {0, 0, 0};
+    BlendMode blendMode = BlendMode::None;
+    mutable VolumeStats stats;
+    mutable std::mutex statsMutex;
+};
+
+
+template<typename T>
+void CompositeVolume::getSlice(TiffImage<T>& img, const int planeId, const int sliceId, bool fitToRange) const {
+    VoxelContainer::Range newRange = range;
+
+    if (fitToRange) {
+        newRange.max = std::numeric_limits<T>::max();
+        newRange.min = std::numeric_limits<T>::min();
+    }
+
+    fillSlice(img, planeId, sliceId, range, newRange, false);
+}
+
+
+template<typename T>
+void CompositeVolume::getSlice(TiffImage<T>& img, const int planeId, const int sliceId, const VoxelContainer::Range& window) const {
+    VoxelContainer::Range srcRange = window;
+
+    if (srcRange.max <= srcRange.min) {
+        srcRange.max = srcRange.min + 1;
+    }
+
+    fillSlice(img, planeId, sliceId, srcRange, {static_cast<float>(std::numeric_limits<T>::min()), static_cast<float>(std::numeric_limits<T>::max())}, true);
+}
+
+
+template<typename T>
+void CompositeVolume::fillSlice(TiffImage<T>& img, const int planeId, const int sliceId, const VoxelContainer::Range& srcRange, const VoxelContainer::Range& newRange, const bool clamp) const {
+    if (parts.empty()) {
+        img.clear();
+        return;
+    }
+
+    int origin[3];
+    int du[3];
+    int dv[3];
+    size_t width = 0;
+    size_t height = 0;
+
+    if (!VoxelContainer::getSlicePlane(size, planeId, sliceId, origin, du, dv, width, height)) {
+        img.clear();
+        return;
+    }
+
+    img.resize(width, height);
+    T* bits = img.getData();
+
+    for (size_t v = 0; v < height; ++v) {
+        for (size_t u = 0; u < width; ++u) {
+            const int x = origin[0] + u * du[0] + v * dv[0];
+            const int y = origin[1] + u * du[1] + v * dv[1];
+            const int z = origin[2] + u * du[2] + v * dv[2];
+            float val = srcRange.fit(get(x, y, z), newRange);
+
+            if (clamp) {
+                val = std::min(std::max(val, newRange.min), newRange.max);
+            }
+
+            bits[v * width + u] = val;
+        }
+    }
+}
+
+
+#endif // COMPOSITE_VOLUME_H
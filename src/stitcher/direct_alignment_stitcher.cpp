@@ -1,23 +1,64 @@
 #include "direct_alignment_stitcher.h"
 
 
-float DirectAlignmentStitcher::countDifference(const VoxelContainer& scan_1, const VoxelContainer& scan_2, const int overlap) {
-    VoxelContainer::Vector3 size_1 = scan_1.getSize();
+template<typename S>
+float DirectAlignmentStitcher::countDifference(const VoxelView& overlap_1, const VoxelView& overlap_2) {
+    VoxelContainer::Vector3 size = overlap_1.getSize();
+    VoxelContainer::Vector3 strides_1 = overlap_1.getStrides();
+    VoxelContainer::Vector3 strides_2 = overlap_2.getStrides();
+    const S* data_1 = static_cast<const S*>(overlap_1.getRawData());
+    const S* data_2 = static_cast<const S*>(overlap_2.getRawData());
+    float diff = 0;
 
-    const float* data_1 = scan_1.getData();
-    const float* data_2 = scan_2.getData();
+    for (size_t z = 0; z < size.z; ++z) {
+        for (size_t y = 0; y < size.y; ++y) {
+            const S* row_1 = data_1 + z * strides_1.z + y * strides_1.y;
+            const S* row_2 = data_2 + z * strides_2.z + y * strides_2.y;
 
-    float diff = 0;
+            for (size_t x = 0; x < size.x; ++x) {
+                diff += kernel(row_1[x], row_2[x]);
+            }
+        }
+    }
+
+    return diff;
+}
 
-    int scanOffset = size_1.x * size_1.y * (size_1.z - overlap);
-    int offsetVolume = overlap * size_1.x * size_1.y;
 
-    for (int i = 0; i < offsetVolume; ++i) {
-        diff += kernel(data_1[i + scanOffset], data_2[i]);
-        // diff += (data_1[i + scanOffset] - data_2[i]) * (data_1[i + scanOffset] - data_2[i]);
+float DirectAlignmentStitcher::countDifference(const VoxelView& overlap_1, const VoxelView& overlap_2) {
+    VoxelContainer::Vector3 size = overlap_1.getSize();
+    float diff = 0;
+
+    const bool linear = overlap_1.getRawData() != nullptr && overlap_2.getRawData() != nullptr;
+
+    // Compare native values directly if both buffers are ordered the same way
+    if (linear && overlap_1.getSampleType() == overlap_2.getSampleType()) {
+        switch (overlap_1.getSampleType()) {
+            case VoxelContainer::SampleType::UInt8:
+                diff = countDifference<uint8_t>(overlap_1, overlap_2);
+                break;
+            case VoxelContainer::SampleType::UInt16:
+                diff = countDifference<uint16_t>(overlap_1, overlap_2);
+                break;
+            case VoxelContainer::SampleType::Float16:
+                diff = countDifference<half>(overlap_1, overlap_2);
+                break;
+            default:
+                diff = countDifference<float>(overlap_1, overlap_2);
+                break;
+        }
+    }
+    else {
+        for (int z = 0; z < size.z; ++z) {
+            for (int y = 0; y < size.y; ++y) {
+                for (int x = 0; x < size.x; ++x) {
+                    diff += kernel(overlap_1.get(x, y, z), overlap_2.get(x, y, z));
+                }
+            }
+        }
     }
 
-    return diff / overlap;
+    return diff / size.z;
 }
 
 
@@ -25,7 +66,7 @@ void DirectAlignmentStitcher::estimateStitchParams(const VoxelContainer& scan_1,
     const int offsetStep = 1;
     const int height_1 = scan_1.getSize().z;
     const int height_2 = scan_2.getSize().z;
-    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ;
+    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ - scan_1.getRefStitchParams().offsetZ;
     int maxDeviation = std::min(height_1, height_2) / 4;
     int refOverlap = maxDeviation;
 
@@ -37,8 +78,14 @@ void DirectAlignmentStitcher::estimateStitchParams(const VoxelContainer& scan_1,
     float minDiff = std::numeric_limits<float>::max();
     int optimalOverlap = 0;
 
-    for (int overlap = refOverlap - maxDeviation; overlap < refOverlap + maxDeviation; overlap += offsetStep) {
-        float currDiff = countDifference(scan_1, scan_2, overlap);
+    // Overlaps are searched within both parts, parts placed apart are left adjoining
+    const int overlapBegin = std::max(1, refOverlap - maxDeviation);
+    const int overlapEnd = std::min(refOverlap + maxDeviation, std::min(height_1, height_2) + 1);
+
+    for (int overlap = overlapBegin; overlap < overlapEnd; overlap += offsetStep) {
+        VoxelView overlap_1 = VoxelView(scan_1).band(height_1 - overlap, height_1);
+        VoxelView overlap_2 = VoxelView(scan_2).band(0, overlap);
+        float currDiff = countDifference(overlap_1, overlap_2);
         
         if (currDiff < minDiff) {
             minDiff = currDiff;
@@ -2,6 +2,7 @@
 #define DIRECT_ALIGNMENT_STITCHER_H
 
 #include "stitcher.h"
+#include "voxel_view.h"
 
 /**
  * \brief Abstract base stitcher class for all direct alignment algorithms.
@@ -26,18 +27,29 @@ protected:
     /**
      * \brief Calculates kernel() metric on two reconstructions overlap.
      * 
-     * \param[in] scan_1 First reconstruction
-     * \param[in] scan_1 Second reconstruction
-     * \param[in] overlap Vertical offset of one reconstruction relatively to another
-     * \return Common range.
+     * \param[in] overlap_1 Overlapping band of the first reconstruction
+     * \param[in] overlap_2 Overlapping band of the second reconstruction
+     * \return Metric value per overlapping layer.
+     */
+    float countDifference(const VoxelView& overlap_1, const VoxelView& overlap_2);
+
+    /**
+     * \brief Sums kernel() metric over two linear views of native voxel values.
+     * 
+     * \param[in] overlap_1 Overlapping band of the first reconstruction
+     * \param[in] overlap_2 Overlapping band of the second reconstruction
+     * \return Sum of metric values.
      */
-    float countDifference(const VoxelContainer& scan_1, const VoxelContainer& scan_2, const int overlap);
+    template<typename S>
+    float countDifference(const VoxelView& overlap_1, const VoxelView& overlap_2);
 
     /**
      * \brief Overrides StitcherImpl::estimateStitchParams(). Implements direct alignment algorithm.
      * 
      * Goes through range of vertical overlaps searching for the optimal one
-     * which gives the smallest countDifference() result.
+     * which gives the smallest countDifference() result. Overlaps are kept
+     * within [1, min(height_1, height_2)], if none of them is searched the
+     * second reconstruction is placed right after the first one.
      * 
      * \param[in] scan_1 First reconstruction
      * \param[in] scan_1 Second reconstruction
@@ -0,0 +1,142 @@
+#ifndef HALF_H
+#define HALF_H
+
+#include <cstdint>
+#include <cstring>
+
+
+/**
+ * \brief 16-bit IEEE 754 floating point number.
+ *
+ * Used only as a compact storage type for voxels. All arithmetic is done
+ * after implicit conversion to float. Conversion from float rounds to the
+ * nearest even value, overflows go to infinity.
+ */
+struct half {
+    uint16_t bits;
+
+    /// Default constructor. Leaves value uninitialized.
+    half() = default;
+
+    /**
+     * \brief Constructs half from float value.
+     *
+     * \param[in] val Value to be converted
+     */
+    half(const float val) : bits(fromFloat(val)) {}
+
+    /**
+     * \brief Converts half to float value.
+     *
+     * \return Float value.
+     */
+    operator float() const {
+        return toFloat(bits);
+    }
+
+    /**
+     * \brief Converts float value to half bits.
+     *
+     * \param[in] val Value to be converted
+     * \return Bits of the half value.
+     */
+    static uint16_t fromFloat(const float val);
+
+    /**
+     * \brief Converts half bits to float value.
+     *
+     * \param[in] h Bits of the half value
+     * \return Float value.
+     */
+    static float toFloat(const uint16_t h);
+};
+
+
+inline uint16_t half::fromFloat(const float val) {
+    uint32_t x = 0;
+    memcpy(&x, &val, sizeof(x));
+
+    const uint16_t sign = (x >> 16) & 0x8000;
+    const uint32_t floatExp = (x >> 23) & 0xff;
+    const int exp = static_cast<int>(floatExp) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+
+    // Infinity and NaN
+    if (floatExp == 0xff) {
+        return sign | 0x7c00 | (mant != 0 ? 0x200 : 0);
+    }
+
+    // Overflow
+    if (exp >= 31) {
+        return sign | 0x7c00;
+    }
+
+    // Subnormal half or underflow to zero
+    if (exp <= 0) {
+        if (exp < -10) {
+            return sign;
+        }
+
+        mant |= 0x800000;
+        const int shift = 14 - exp;
+        uint32_t h = mant >> shift;
+        const uint32_t rem = mant & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+
+        if (rem > halfway || (rem == halfway && (h & 1))) {
+            ++h;
+        }
+
+        return sign | h;
+    }
+
+    // Normal value, rounding carry may overflow to infinity as expected
+    uint32_t h = (static_cast<uint32_t>(exp) << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1fff;
+
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+        ++h;
+    }
+
+    return sign | h;
+}
+
+
+inline float half::toFloat(const uint16_t h) {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x = 0;
+
+    if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        }
+        else {
+            // Normalize subnormal value
+            exp = 1;
+
+            while ((mant & 0x400) == 0) {
+                mant <<= 1;
+                --exp;
+            }
+
+            mant &= 0x3ff;
+            x = sign | (static_cast<uint32_t>(exp + 112) << 23) | (mant << 13);
+        }
+    }
+    else if (exp == 31) {
+        x = sign | 0x7f800000 | (mant << 13);
+    }
+    else {
+        x = sign | (static_cast<uint32_t>(exp + 112) << 23) | (mant << 13);
+    }
+
+    float val = 0;
+    memcpy(&val, &x, sizeof(val));
+
+    return val;
+}
+
+
+#endif // HALF_H
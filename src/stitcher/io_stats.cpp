@@ -0,0 +1,180 @@
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include "io_stats.h"
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+
+std::atomic<bool> IoStats::enabled(false);
+
+
+/// Wall time of reading or writing, from the first start to the last finish.
+struct Span {
+    Clock::time_point begin;
+    Clock::time_point end;
+    bool empty = true;
+};
+
+
+static std::mutex statsMutex;
+static std::map<std::string, IoStats::FileStats> filesStats;
+static Span readSpan;
+static Span writeSpan;
+
+
+static void extendSpan(Span& span, const Clock::time_point begin, const Clock::time_point end) {
+    if (span.empty || begin < span.begin) {
+        span.begin = begin;
+    }
+
+    if (span.empty || end > span.end) {
+        span.end = end;
+    }
+
+    span.empty = false;
+}
+
+
+static double getSpeed(const uint64_t bytes, const Span& span) {
+    const double seconds = std::chrono::duration<double>(span.end - span.begin).count();
+
+    return span.empty || seconds <= 0 ? 0 : bytes / seconds / (1 << 20);
+}
+
+
+static json getStatsJson(const IoStats::FileStats& stats) {
+    json data;
+    data["open_s"] = stats.openTime;
+    data["read_s"] = stats.readTime;
+    data["write_s"] = stats.writeTime;
+    data["copy_s"] = stats.copyTime;
+    data["read_bytes"] = stats.readBytes;
+    data["written_bytes"] = stats.writtenBytes;
+
+    return data;
+}
+
+
+IoStats::Timer::Timer(const char* _fileName, const Stage _stage, const uint64_t _bytes) :
+    fileName(_fileName),
+    stage(_stage),
+    bytes(_bytes),
+    active(enabled.load(std::memory_order_relaxed)) {
+    if (active) {
+        start = Clock::now();
+    }
+}
+
+
+IoStats::Timer::~Timer() {
+    if (active) {
+        add(fileName, stage, start, Clock::now(), bytes);
+    }
+}
+
+
+void IoStats::Timer::setBytes(const uint64_t _bytes) {
+    bytes = _bytes;
+}
+
+
+void IoStats::setEnabled(const bool _enabled) {
+    enabled = _enabled;
+}
+
+
+bool IoStats::isEnabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+
+void IoStats::reset() {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    filesStats.clear();
+    readSpan = Span();
+    writeSpan = Span();
+}
+
+
+void IoStats::add(const std::string& fileName, const Stage stage, const Clock::time_point begin, const Clock::time_point end, const uint64_t bytes) {
+    const double seconds = std::chrono::duration<double>(end - begin).count();
+
+    std::lock_guard<std::mutex> lock(statsMutex);
+    FileStats& stats = filesStats[fileName];
+
+    switch (stage) {
+        case Stage::Open:
+            stats.openTime += seconds;
+            break;
+        case Stage::Read:
+            stats.readTime += seconds;
+            stats.readBytes += bytes;
+            extendSpan(readSpan, begin, end);
+            break;
+        case Stage::Write:
+            stats.writeTime += seconds;
+            stats.writtenBytes += bytes;
+            extendSpan(writeSpan, begin, end);
+            break;
+        case Stage::Copy:
+            stats.copyTime += seconds;
+            break;
+    }
+}
+
+
+std::map<std::string, IoStats::FileStats> IoStats::getFiles() {
+    std::lock_guard<std::mutex> lock(statsMutex);
+
+    return filesStats;
+}
+
+
+IoStats::Totals IoStats::getTotals() {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    Totals totals;
+
+    for (const auto& file : filesStats) {
+        totals.openTime += file.second.openTime;
+        totals.readTime += file.second.readTime;
+        totals.writeTime += file.second.writeTime;
+        totals.copyTime += file.second.copyTime;
+        totals.readBytes += file.second.readBytes;
+        totals.writtenBytes += file.second.writtenBytes;
+    }
+
+    totals.filesNum = filesStats.size();
+    totals.readSpeed = getSpeed(totals.readBytes, readSpan);
+    totals.writeSpeed = getSpeed(totals.writtenBytes, writeSpan);
+
+    return totals;
+}
+
+
+bool IoStats::writeReport(const std::string& fileName) {
+    const Totals totals = getTotals();
+    json data;
+    data["total"] = getStatsJson(totals);
+    data["total"]["files_num"] = totals.filesNum;
+    data["total"]["read_mb_s"] = totals.readSpeed;
+    data["total"]["write_mb_s"] = totals.writeSpeed;
+    data["files"] = json::object();
+
+    for (const auto& file : getFiles()) {
+        data["files"][file.first] = getStatsJson(file.second);
+    }
+
+    std::ofstream fs(fileName);
+
+    if (!fs.is_open()) {
+        printf("Error: Unable to write I/O report %s\n", fileName.data());
+        return false;
+    }
+
+    fs << data.dump(4) << std::endl;
+
+    return true;
+}
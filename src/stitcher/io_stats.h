@@ -0,0 +1,143 @@
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+
+/**
+ * \brief Timings and throughput of reading and writing volume files.
+ *
+ * File readers and writers report time spent on opening files, on reading
+ * or writing their contents (decoding and encoding included) and on copying
+ * samples between files and containers, together with the number of bytes
+ * moved. Records are summed per file name and can be queried or written as
+ * a JSON report. Collecting is off by default, then a Timer costs a single
+ * relaxed atomic load. All methods are thread-safe.
+ */
+class IoStats {
+public:
+    /// Kind of work with a file.
+    enum class Stage {
+        Open,  ///< Opening or creating the file and parsing its headers
+        Read,  ///< Reading and decoding contents
+        Write, ///< Encoding and writing contents
+        Copy   ///< Copying and converting samples between the file and a container
+    };
+
+    /// Statistics of a single file.
+    struct FileStats {
+        double openTime = 0;       ///< Seconds spent on Stage::Open
+        double readTime = 0;       ///< Seconds spent on Stage::Read
+        double writeTime = 0;      ///< Seconds spent on Stage::Write
+        double copyTime = 0;       ///< Seconds spent on Stage::Copy
+        uint64_t readBytes = 0;    ///< Bytes read from the file
+        uint64_t writtenBytes = 0; ///< Bytes written into the file
+    };
+
+    /// Statistics of all files.
+    struct Totals : FileStats {
+        size_t filesNum = 0;   ///< Number of files
+        double readSpeed = 0;  ///< Read bytes per second of reading wall time in MB/s
+        double writeSpeed = 0; ///< Written bytes per second of writing wall time in MB/s
+    };
+
+    /**
+     * \brief Measures a stage of work with a file from construction to destruction.
+     *
+     * Nothing is measured if collecting is disabled at construction.
+     */
+    class Timer {
+    public:
+        /**
+         * \brief Starts measuring.
+         *
+         * \param[in] _fileName Path to the file, must outlive the timer
+         * \param[in] _stage Kind of work
+         * \param[in] _bytes Number of bytes moved by Stage::Read or Stage::Write
+         */
+        Timer(const char* _fileName, const Stage _stage, const uint64_t _bytes = 0);
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        /// Destructor. Adds the measured time to the statistics.
+        ~Timer();
+
+        /**
+         * \brief Sets number of moved bytes known only after the work started.
+         *
+         * \param[in] _bytes Number of bytes
+         */
+        void setBytes(const uint64_t _bytes);
+
+    private:
+        const char* fileName;
+        Stage stage;
+        uint64_t bytes;
+        bool active;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    /**
+     * \brief Turns collecting on or off.
+     *
+     * \param[in] enabled Collect statistics
+     */
+    static void setEnabled(const bool enabled);
+
+    /**
+     * \brief Checks if statistics are collected.
+     *
+     * \return True - if enabled, false - if disabled.
+     */
+    static bool isEnabled();
+
+    /// Clears collected statistics.
+    static void reset();
+
+    /**
+     * \brief Adds measured work with a file.
+     *
+     * \param[in] fileName Path to the file
+     * \param[in] stage Kind of work
+     * \param[in] begin Start of the work
+     * \param[in] end Finish of the work
+     * \param[in] bytes Number of bytes moved by Stage::Read or Stage::Write
+     */
+    static void add(const std::string& fileName, const Stage stage, const std::chrono::steady_clock::time_point begin, const std::chrono::steady_clock::time_point end, const uint64_t bytes);
+
+    /**
+     * \brief Gives statistics of every file.
+     *
+     * \return Statistics by file name.
+     */
+    static std::map<std::string, FileStats> getFiles();
+
+    /**
+     * \brief Gives statistics summed over all files.
+     *
+     * Speeds are computed over the time from the first start to the last
+     * finish of reading or writing, so work of parallel threads overlaps.
+     *
+     * \return Total statistics.
+     */
+    static Totals getTotals();
+
+    /**
+     * \brief Writes totals and statistics of every file into JSON file.
+     *
+     * \param[in] fileName Path to the report
+     * \return True - if success, false - if failed.
+     */
+    static bool writeReport(const std::string& fileName);
+
+private:
+    static std::atomic<bool> enabled;
+};
+
+
+#endif // IO_STATS_H
@@ -1,5 +1,6 @@
 #include "opencv_sift_2d_stitcher.h"
 #include <algorithm>
+#include <cmath>
 
 
 float OpenCVSIFT2DStitcher::getMedian(std::vector<float>& array) {
@@ -31,7 +32,7 @@ void OpenCVSIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, Vo
     VoxelContainer::Vector3 size_1 = scan_1.getSize();
     VoxelContainer::Vector3 size_2 = scan_2.getSize();
 
-    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ;
+    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ - scan_1.getRefStitchParams().offsetZ;
     int maxOverlap = size_2.z / 2;
 
     if (refOffsetZ > 0) {
@@ -50,15 +51,24 @@ void OpenCVSIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, Vo
     cv::Ptr<cv::SIFT> sift = cv::SIFT::create();
     std::vector<std::pair<int, float>> planes = {{0, 0.4}, {0, 0.5}, {0, 0.6}, {1, 0.4}, {1, 0.5}, {1, 0.6}, {3, 0}, {4, 0}};
 
+    // Both scans are windowed equally, ignoring outliers
+    VolumeStats commonStats = scan_1.getStats();
+    commonStats.merge(scan_2.getStats());
+    VoxelContainer::Range window = {commonStats.getPercentile(0.001), commonStats.getPercentile(0.999)};
+
+    // Keypoints are searched only in the bands which may overlap
+    VoxelView band_1 = VoxelView(scan_1).band(size_1.z - maxOverlap, size_1.z);
+    VoxelView band_2 = VoxelView(scan_2).band(0, maxOverlap);
+
     for (auto plane : planes) {
         // Find keypoints and compute descriptors on the middle current plane
         int slice_id = size_1.x * plane.second;
-        scan_1.getSlice<uint8_t>(sliceImg_1, plane.first, slice_id, true);
-        cv::Mat_<unsigned char> slice_1(maxOverlap, size_1.y, sliceImg_1.getData() + (size_1.z - maxOverlap) * size_1.y);
+        band_1.getSlice<uint8_t>(sliceImg_1, plane.first, slice_id, window);
+        cv::Mat_<unsigned char> slice_1(sliceImg_1.getHeight(), sliceImg_1.getWidth(), sliceImg_1.getData());
         sift->detectAndCompute(slice_1, cv::Mat(), keypoints_1, descriptors_1);
 
-        scan_2.getSlice<uint8_t>(sliceImg_2, plane.first, slice_id, true);
-        cv::Mat_<unsigned char> slice_2(maxOverlap, size_2.y, sliceImg_2.getData());
+        band_2.getSlice<uint8_t>(sliceImg_2, plane.first, slice_id, window);
+        cv::Mat_<unsigned char> slice_2(sliceImg_2.getHeight(), sliceImg_2.getWidth(), sliceImg_2.getData());
         sift->detectAndCompute(slice_2, cv::Mat(), keypoints_2, descriptors_2);
 
         matcher.match(descriptors_1, descriptors_2, matches);
@@ -89,21 +99,25 @@ void OpenCVSIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, Vo
         descriptors_2.release();
     }
 
-    // Get optimal offset
-    int offsetZ = getMedian(offsetsZ);
+    // Get optimal offset, bands below are taken by whole layers of it
+    const float overlapZ = getMedian(offsetsZ);
+    int offsetZ = std::lround(overlapZ);
 
     std::vector<std::pair<int, float>> h_planes = {{2, 0.3}, {2, 0.4}, {2, 0.5}, {2, 0.6}, {2, 0.7}};
 
+    // Horizontal slices are taken at the same height of the found overlap
+    VoxelView overlap_1 = VoxelView(scan_1).band(size_1.z - offsetZ, size_1.z);
+    VoxelView overlap_2 = VoxelView(scan_2).band(0, offsetZ);
+
     for (auto plane : h_planes) {
         // Find keypoints and compute descriptors on the middle current plane
-        int slice_id_2 = offsetZ * plane.second;
-        int slice_id_1 = size_1.z - offsetZ + slice_id_2;
-        scan_1.getSlice<uint8_t>(sliceImg_1, plane.first, slice_id_1, true);
-        cv::Mat_<unsigned char> slice_1(size_1.x, size_1.y, sliceImg_1.getData());
+        int slice_id = offsetZ * plane.second;
+        overlap_1.getSlice<uint8_t>(sliceImg_1, plane.first, slice_id, window);
+        cv::Mat_<unsigned char> slice_1(sliceImg_1.getHeight(), sliceImg_1.getWidth(), sliceImg_1.getData());
         sift->detectAndCompute(slice_1, cv::Mat(), keypoints_1, descriptors_1);
 
-        scan_2.getSlice<uint8_t>(sliceImg_2, plane.first, slice_id_2, true);
-        cv::Mat_<unsigned char> slice_2(size_2.x, size_2.y, sliceImg_2.getData());
+        overlap_2.getSlice<uint8_t>(sliceImg_2, plane.first, slice_id, window);
+        cv::Mat_<unsigned char> slice_2(sliceImg_2.getHeight(), sliceImg_2.getWidth(), sliceImg_2.getData());
         sift->detectAndCompute(slice_2, cv::Mat(), keypoints_2, descriptors_2);
 
         matcher.match(descriptors_1, descriptors_2, matches);
@@ -127,12 +141,12 @@ void OpenCVSIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, Vo
     }
 
     // Get optimal offset
-    int offsetX = getMedian(offsetsX);
-    int offsetY = getMedian(offsetsY);
+    float offsetX = getMedian(offsetsX);
+    float offsetY = getMedian(offsetsY);
 
-    scan_2.setEstStitchParams({offsetX, offsetY, static_cast<int>(size_1.z) - offsetZ});
+    scan_2.setEstStitchParams(VoxelContainer::StitchParams::fromOffsets(offsetX, offsetY, size_1.z - overlapZ));
 
     auto refParams_1 = scan_1.getRefStitchParams();
     auto refParams_2 = scan_2.getRefStitchParams();
-    printf("Offsets are %i %i %i. Should be %i %i %i\n", offsetX, offsetY, static_cast<int>(size_1.z) - offsetZ, refParams_2.offsetX - refParams_1.offsetX, refParams_2.offsetY - refParams_1.offsetY, refParams_2.offsetZ - refParams_1.offsetZ);
+    printf("Offsets are %.2f %.2f %.2f. Should be %i %i %i\n", offsetX, offsetY, size_1.z - overlapZ, refParams_2.offsetX - refParams_1.offsetX, refParams_2.offsetY - refParams_1.offsetY, refParams_2.offsetZ - refParams_1.offsetZ);
 }
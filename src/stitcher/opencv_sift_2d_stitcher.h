@@ -2,6 +2,7 @@
 #define OPENCV_SIFT_2D_STITCHER_H
 
 #include "stitcher.h"
+#include "voxel_view.h"
 
 /**
  * \brief Stitcher class based on the SIFT algorithm from OpenCV.
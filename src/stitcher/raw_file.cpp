@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "io_stats.h"
+#include "raw_file.h"
+
+
+const size_t RawFile::directIoAlignment;
+
+
+RawFile::~RawFile() {
+    close();
+}
+
+
+bool RawFile::open(const std::string& _fileName, const bool directIo) {
+    close();
+    fileName = _fileName;
+    IoStats::Timer timer(fileName.c_str(), IoStats::Stage::Open);
+    fd = ::open(fileName.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        printf("Error: Unable to open file %s\n", fileName.data());
+        return false;
+    }
+
+#ifdef O_DIRECT
+    // Filesystems without direct I/O are read through the page cache
+    if (directIo) {
+        directFd = ::open(fileName.c_str(), O_RDONLY | O_DIRECT);
+    }
+#endif
+
+    return true;
+}
+
+
+bool RawFile::create(const std::string& _fileName, const uint64_t bytes, const bool directIo) {
+    close();
+    fileName = _fileName;
+    IoStats::Timer timer(fileName.c_str(), IoStats::Stage::Open);
+    fd = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        printf("Error: Unable to create file %s\n", fileName.data());
+        return false;
+    }
+
+    if (ftruncate(fd, bytes) != 0) {
+        printf("Error: Unable to resize file %s to %llu bytes\n", fileName.data(), static_cast<unsigned long long>(bytes));
+        close();
+        return false;
+    }
+
+#ifdef O_DIRECT
+    if (directIo) {
+        directFd = ::open(fileName.c_str(), O_RDWR | O_DIRECT);
+    }
+#endif
+
+    return true;
+}
+
+
+void RawFile::close() {
+    if (directFd >= 0) {
+        ::close(directFd);
+        directFd = -1;
+    }
+
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+
+uint64_t RawFile::getSize() const {
+    struct stat fileStat;
+
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        return 0;
+    }
+
+    return fileStat.st_size;
+}
+
+
+const std::string& RawFile::getFileName() const {
+    return fileName;
+}
+
+
+bool RawFile::read(const uint64_t offset, void* dst, const size_t bytes) const {
+    IoStats::Timer timer(fileName.c_str(), IoStats::Stage::Read, bytes);
+
+    return transfer(offset, static_cast<uint8_t*>(dst), bytes, false);
+}
+
+
+bool RawFile::write(const uint64_t offset, const void* src, const size_t bytes) const {
+    IoStats::Timer timer(fileName.c_str(), IoStats::Stage::Write, bytes);
+
+    return transfer(offset, static_cast<uint8_t*>(const_cast<void*>(src)), bytes, true);
+}
+
+
+bool RawFile::isHostLittleEndian() {
+    const uint16_t probe = 1;
+    uint8_t firstByte;
+    memcpy(&firstByte, &probe, 1);
+
+    return firstByte == 1;
+}
+
+
+void RawFile::swapBytes(void* samples, const size_t count, const size_t sampleBytes) {
+    uint8_t* bytes = static_cast<uint8_t*>(samples);
+
+    for (size_t i = 0; i < count; ++i) {
+        std::reverse(bytes + i * sampleBytes, bytes + (i + 1) * sampleBytes);
+    }
+}
+
+
+bool RawFile::transfer(const uint64_t offset, uint8_t* buffer, const size_t bytes, const bool writing) const {
+    const size_t misalignment = offset % directIoAlignment;
+
+    // Direct I/O needs the file position and the buffer equally aligned
+    if (directFd < 0 || misalignment != reinterpret_cast<uintptr_t>(buffer) % directIoAlignment) {
+        return transferAll(fd, offset, buffer, bytes, writing);
+    }
+
+    const size_t head = std::min(bytes, (directIoAlignment - misalignment) % directIoAlignment);
+    const size_t body = (bytes - head) / directIoAlignment * directIoAlignment;
+    const size_t tail = bytes - head - body;
+
+    return transferAll(fd, offset, buffer, head, writing) &&
+           transferAll(directFd, offset + head, buffer + head, body, writing) &&
+           transferAll(fd, offset + head + body, buffer + head + body, tail, writing);
+}
+
+
+bool RawFile::transferAll(const int fileFd, const uint64_t offset, uint8_t* buffer, const size_t bytes, const bool writing) const {
+    size_t done = 0;
+
+    while (done < bytes) {
+        const ssize_t n = writing ? pwrite(fileFd, buffer + done, bytes - done, offset + done) : pread(fileFd, buffer + done, bytes - done, offset + done);
+
+        if (n <= 0) {
+            printf("Error: Unable to %s %zu bytes at %llu of %s\n", writing ? "write" : "read", bytes, static_cast<unsigned long long>(offset), fileName.data());
+            return false;
+        }
+
+        done += n;
+    }
+
+    return true;
+}
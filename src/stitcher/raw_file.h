@@ -0,0 +1,115 @@
+#ifndef RAW_FILE_H
+#define RAW_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+/**
+ * \brief File of raw samples accessed by large positioned reads and writes.
+ *
+ * With direct I/O the file is additionally opened with O_DIRECT, and parts
+ * of requests aligned to directIoAlignment bypass the page cache. This
+ * streams volumes at the device bandwidth without evicting the rest of the
+ * cache. Unaligned heads and tails of requests, and filesystems without
+ * O_DIRECT, fall back to the buffered descriptor. All methods are
+ * thread-safe.
+ */
+class RawFile {
+public:
+    /// Alignment of offsets, sizes and buffers required by direct I/O.
+    static const size_t directIoAlignment = 4096;
+
+    /// Default constructor. Creates an instance without a file.
+    RawFile() = default;
+
+    RawFile(const RawFile&) = delete;
+    RawFile& operator=(const RawFile&) = delete;
+
+    /// Destructor. Closes the file.
+    ~RawFile();
+
+    /**
+     * \brief Opens file for reading.
+     *
+     * \param[in] _fileName Path to the file
+     * \param[in] directIo Bypass the page cache where possible
+     * \return True - if success, false - if failed.
+     */
+    bool open(const std::string& _fileName, const bool directIo = false);
+
+    /**
+     * \brief Creates file of the given size for writing.
+     *
+     * \param[in] _fileName Path to the file
+     * \param[in] bytes Size of the file
+     * \param[in] directIo Bypass the page cache where possible
+     * \return True - if success, false - if failed.
+     */
+    bool create(const std::string& _fileName, const uint64_t bytes, const bool directIo = false);
+
+    /// Closes the file.
+    void close();
+
+    /**
+     * \brief Gives size of the file.
+     *
+     * \return Size in bytes.
+     */
+    uint64_t getSize() const;
+
+    /**
+     * \brief Gives path to the file.
+     *
+     * \return Path given to open() or create().
+     */
+    const std::string& getFileName() const;
+
+    /**
+     * \brief Reads bytes at the given position.
+     *
+     * \param[in] offset Position in the file
+     * \param[out] dst Buffer of bytes size
+     * \param[in] bytes Number of bytes
+     * \return True - if success, false - if failed.
+     */
+    bool read(const uint64_t offset, void* dst, const size_t bytes) const;
+
+    /**
+     * \brief Writes bytes at the given position.
+     *
+     * \param[in] offset Position in the file
+     * \param[in] src Buffer of bytes size
+     * \param[in] bytes Number of bytes
+     * \return True - if success, false - if failed.
+     */
+    bool write(const uint64_t offset, const void* src, const size_t bytes) const;
+
+    /**
+     * \brief Checks if the host stores numbers little-endian.
+     *
+     * \return True - if little-endian, false - if big-endian.
+     */
+    static bool isHostLittleEndian();
+
+    /**
+     * \brief Reverses byte order of samples in place.
+     *
+     * \param[in,out] samples Samples
+     * \param[in] count Number of samples
+     * \param[in] sampleBytes Size of sample in bytes
+     */
+    static void swapBytes(void* samples, const size_t count, const size_t sampleBytes);
+
+private:
+    bool transfer(const uint64_t offset, uint8_t* buffer, const size_t bytes, const bool writing) const;
+    bool transferAll(const int fileFd, const uint64_t offset, uint8_t* buffer, const size_t bytes, const bool writing) const;
+
+    int fd = -1;
+    int directFd = -1;
+    std::string fileName;
+};
+
+
+#endif // RAW_FILE_H
@@ -12,22 +12,43 @@ std::shared_ptr<VoxelContainer> SeparationStitcher::stitch(const VoxelContainer&
 
     VoxelContainer::Vector3 stitchedSize = {size_1.x, size_1.y, size_1.z + size_2.z + gap.z};
     VoxelContainer::Range stitchedRange = getStitchedRange(scan_1, scan_2);
-    float* stitchedData = new float[stitchedSize.volume()];
 
-    memcpy(stitchedData, scan_1.getData(), size_1.volume() * sizeof(float));
+    // Keep native values if both scans have the same sample type
+    VoxelContainer::SampleType stitchedType = scan_1.getSampleType();
+
+    if (scan_2.getSampleType() != stitchedType) {
+        stitchedType = VoxelContainer::SampleType::Float32;
+    }
+
+    auto stitched = std::make_shared<VoxelContainer>();
+    stitched->setSampleType(stitchedType);
+
+    if (!stitched->create(stitchedSize, stitchedRange)) {
+        return nullptr;
+    }
+
+    stitched->setRefStitchParams(scan_1.getRefStitchParams());
+
+    scan_1.copyLayers(stitched->getRawData(), 0, size_1.z, stitchedType);
 
     // Fill the gap with black
-    float* gapData = stitchedData + size_1.volume();
-    for (int i = 0; i < gap.volume(); ++ i) {
-        gapData[i] = stitchedRange.min;
+    for (int z = size_1.z; z < size_1.z + gap.z; ++ z) {
+        for (int y = 0; y < gap.y; ++y) {
+            for (int x = 0; x < gap.x; ++x) {
+                stitched->set(x, y, z, stitchedRange.min);
+            }
+        }
     }
 
-    memcpy(stitchedData + size_1.volume() + gap.volume(), scan_2.getData(), size_2.volume() * sizeof(float));
+    unsigned char* scanData = static_cast<unsigned char*>(stitched->getRawData()) + (size_1.volume() + gap.volume()) * stitched->sampleSize();
+    scan_2.copyLayers(scanData, 0, size_2.z, stitchedType);
 
-    scan_2.setEstStitchParams({0, 0, static_cast<int>(size_1.z) + 5});
+    estimateStitchParams(scan_1, scan_2);
 
-    return std::make_shared<VoxelContainer>(stitchedData, stitchedSize, stitchedRange, scan_1.getRefStitchParams());
+    return stitched;
 }
 
 
-void SeparationStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelContainer& scan_2) {}
\ No newline at end of file
+void SeparationStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelContainer& scan_2) {
+    scan_2.setEstStitchParams({0, 0, static_cast<int>(scan_1.getSize().z) + 5});
+}
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <atomic>
 #include <cmath>
 #include "sift_2d_stitcher.h"
 
@@ -33,13 +34,11 @@ void SIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
 
     // Calculate optimal params
     int size = std::max(size_1.x, size_1.y);
-    octaves_num = std::log2(size / 16);
+    int octaves_num;
+    double sigma;
+    getScaleParams(size, octaves_num, sigma);
 
-    if (size < 512) {
-        sigma = 1.4 * size / 512 + 0.2;
-    }
-
-    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ;
+    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ - scan_1.getRefStitchParams().offsetZ;
     int maxOverlap = size_2.z / 2;
 
     if (refOffsetZ > 0) {
@@ -56,14 +55,18 @@ void SIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
     cv::BFMatcher matcher;
     std::vector<cv::DMatch> matches;
 
+    // Keypoints are searched only in the bands which may overlap
+    VoxelView band_1 = VoxelView(scan_1).band(size_1.z - maxOverlap, size_1.z);
+    VoxelView band_2 = VoxelView(scan_2).band(0, maxOverlap);
+
     for (auto plane : planes) {
         int slice_id = size_1.x * plane.second;
 
-        scan_1.getSlice<float>(sliceImg_1, plane.first, slice_id, false);
-        scan_2.getSlice<float>(sliceImg_2, plane.first, slice_id, false);
+        band_1.getSlice<float>(sliceImg_1, plane.first, slice_id, false);
+        band_2.getSlice<float>(sliceImg_2, plane.first, slice_id, false);
 
-        cv::Mat_<float> slice_1(maxOverlap, size_1.y, sliceImg_1.getData() + (size_1.z - maxOverlap) * size_1.y);
-        cv::Mat_<float> slice_2(maxOverlap, size_2.y, sliceImg_2.getData());
+        cv::Mat_<float> slice_1(sliceImg_1.getHeight(), sliceImg_1.getWidth(), sliceImg_1.getData());
+        cv::Mat_<float> slice_2(sliceImg_2.getHeight(), sliceImg_2.getWidth(), sliceImg_2.getData());
 
         DoG_1.clear();
         DoG_2.clear();
@@ -73,16 +76,16 @@ void SIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
         descriptors_2.release();
         matches.clear();
 
-        buildDoG(slice_1, gaussians_1, DoG_1);
-        buildDoG(slice_2, gaussians_2, DoG_2);
+        buildDoG(slice_1, octaves_num, sigma, gaussians_1, DoG_1);
+        buildDoG(slice_2, octaves_num, sigma, gaussians_2, DoG_2);
 
         detect(DoG_1, keypoints_1);
         detect(DoG_2, keypoints_2);
 
         // printf("Finded %lu and %lu candidates to keypoints\n", keypoints_1.size(), keypoints_2.size());
 
-        localize(DoG_1, keypoints_1);
-        localize(DoG_2, keypoints_2);
+        localize(DoG_1, sigma, keypoints_1);
+        localize(DoG_2, sigma, keypoints_2);
 
         // printf("Localized %lu and %lu keypoints\n", keypoints_1.size(), keypoints_2.size());
 
@@ -126,20 +129,24 @@ void SIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
         }
     }
 
-    // Get optimal offset
-    int offsetZ = getMedian(offsetsZ);
+    // Get optimal offset, bands below are taken by whole layers of it
+    const float overlapZ = getMedian(offsetsZ);
+    int offsetZ = std::lround(overlapZ);
 
     std::vector<std::pair<int, float>> h_planes = {{2, 0.3}, {2, 0.4}, {2, 0.5}, {2, 0.6}, {2, 0.7}};
 
+    // Horizontal slices are taken at the same height of the found overlap
+    VoxelView overlap_1 = VoxelView(scan_1).band(size_1.z - offsetZ, size_1.z);
+    VoxelView overlap_2 = VoxelView(scan_2).band(0, offsetZ);
+
     for (auto plane : h_planes) {
-        int slice_id_2 = offsetZ * plane.second;
-        int slice_id_1 = size_1.z - offsetZ + slice_id_2;
+        int slice_id = offsetZ * plane.second;
 
-        scan_1.getSlice<float>(sliceImg_1, plane.first, slice_id_1, false);
-        scan_2.getSlice<float>(sliceImg_2, plane.first, slice_id_2, false);
+        overlap_1.getSlice<float>(sliceImg_1, plane.first, slice_id, false);
+        overlap_2.getSlice<float>(sliceImg_2, plane.first, slice_id, false);
 
-        cv::Mat_<float> slice_1(size_1.x, size_1.y, sliceImg_1.getData());
-        cv::Mat_<float> slice_2(size_2.x, size_2.y, sliceImg_2.getData());
+        cv::Mat_<float> slice_1(sliceImg_1.getHeight(), sliceImg_1.getWidth(), sliceImg_1.getData());
+        cv::Mat_<float> slice_2(sliceImg_2.getHeight(), sliceImg_2.getWidth(), sliceImg_2.getData());
 
         DoG_1.clear();
         DoG_2.clear();
@@ -149,14 +156,14 @@ void SIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
         descriptors_2.release();
         matches.clear();
 
-        buildDoG(slice_1, gaussians_1, DoG_1);
-        buildDoG(slice_2, gaussians_2, DoG_2);
+        buildDoG(slice_1, octaves_num, sigma, gaussians_1, DoG_1);
+        buildDoG(slice_2, octaves_num, sigma, gaussians_2, DoG_2);
 
         detect(DoG_1, keypoints_1);
         detect(DoG_2, keypoints_2);
 
-        localize(DoG_1, keypoints_1);
-        localize(DoG_2, keypoints_2);
+        localize(DoG_1, sigma, keypoints_1);
+        localize(DoG_2, sigma, keypoints_2);
 
         orient(gaussians_1, DoG_1, keypoints_1);
         orient(gaussians_2, DoG_2, keypoints_2);
@@ -177,8 +184,8 @@ void SIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
     }
 
     // Get optimal offset
-    int offsetX = getMedian(offsetsX);
-    int offsetY = getMedian(offsetsY);
+    float offsetX = getMedian(offsetsX);
+    float offsetY = getMedian(offsetsY);
 
     const int maxOX = size_1.x / 2;
     const int maxOY = size_1.y / 2;
@@ -191,11 +198,30 @@ void SIFT2DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
         offsetY = 0;
     }
 
-    scan_2.setEstStitchParams({offsetX, offsetY, static_cast<int>(size_1.z) - offsetZ});
+    scan_2.setEstStitchParams(VoxelContainer::StitchParams::fromOffsets(offsetX, offsetY, size_1.z - overlapZ));
 
     auto refParams_1 = scan_1.getRefStitchParams();
     auto refParams_2 = scan_2.getRefStitchParams();
-    printf("Offsets are %i %i %i. Should be %i %i %i\n", offsetX, offsetY, static_cast<int>(size_1.z) - offsetZ, refParams_2.offsetX - refParams_1.offsetX, refParams_2.offsetY - refParams_1.offsetY, refParams_2.offsetZ - refParams_1.offsetZ);
+    printf("Offsets are %.2f %.2f %.2f. Should be %i %i %i\n", offsetX, offsetY, size_1.z - overlapZ, refParams_2.offsetX - refParams_1.offsetX, refParams_2.offsetY - refParams_1.offsetY, refParams_2.offsetZ - refParams_1.offsetZ);
+}
+
+
+size_t SIFT2DStitcher::getEstimationMemory(const VoxelContainer::Vector3& bandSize) const {
+    // Vertical slices are at most as wide as the diagonal, horizontal ones are taken from the found overlap
+    const size_t sliceSpace = std::max((bandSize.x + bandSize.y) * bandSize.z, bandSize.x * bandSize.y);
+
+    // Slice and pyramid of gaussians and DoGs of each scan, octaves add a third
+    return 2 * sliceSpace * sizeof(float) * (1 + (2 * blur_levels_num - 1) * 4 / 3);
+}
+
+
+void SIFT2DStitcher::getScaleParams(const int size, int& octaves_num, double& sigma) const {
+    octaves_num = std::log2(size / 16);
+    sigma = 1.6;
+
+    if (size < 512) {
+        sigma = 1.4 * size / 512 + 0.2;
+    }
 }
 
 
@@ -212,11 +238,9 @@ void SIFT2DStitcher::testDetection(const char* img_path_1, const char* img_path_
 
     // Calculate optimal params
     int size = std::max(img_1.rows, img_1.cols);
-    octaves_num = std::log2(size / 16);
-
-    if (size < 512) {
-        sigma = 1.4 * size / 512 + 0.2;
-    }
+    int octaves_num;
+    double sigma;
+    getScaleParams(size, octaves_num, sigma);
 
     std::vector<std::vector<cv::Mat>> gaussians_1;
     std::vector<std::vector<cv::Mat>> gaussians_2;
@@ -229,8 +253,8 @@ void SIFT2DStitcher::testDetection(const char* img_path_1, const char* img_path_
     std::vector<cv::DMatch> matches;
     cv::BFMatcher matcher;
 
-    buildDoG(img_1, gaussians_1, DoG_1);
-    buildDoG(img_2, gaussians_2, DoG_2);
+    buildDoG(img_1, octaves_num, sigma, gaussians_1, DoG_1);
+    buildDoG(img_2, octaves_num, sigma, gaussians_2, DoG_2);
 
     detect(DoG_1, keypoints_1);
     detect(DoG_2, keypoints_2);
@@ -244,8 +268,8 @@ void SIFT2DStitcher::testDetection(const char* img_path_1, const char* img_path_
     // cv::drawKeypoints(rgbSlice, keypoints_2, rgbSlice, cv::Scalar(255, 255, 0));
     // cv::imwrite(std::to_string(octaves_num) + "_" + std::to_string(scale_levels_num) + "_" + std::to_string(sigma).substr(0, 3) + "_2_kps_" + std::to_string(keypoints_2.size()) + "_detected.png", rgbSlice);
 
-    localize(DoG_1, keypoints_1);
-    localize(DoG_2, keypoints_2);
+    localize(DoG_1, sigma, keypoints_1);
+    localize(DoG_2, sigma, keypoints_2);
     
     printf("Finded %lu + %lu keypoints\n", keypoints_1.size(), keypoints_2.size());
 
@@ -296,7 +320,7 @@ void SIFT2DStitcher::displayKeypoints(const cv::Mat& slice, const std::vector<cv
     cv::drawKeypoints(rgbSlice, keypoints, rgbSlice, cv::Scalar::all(-1), cv::DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
     // cv::namedWindow("Display Keypoints", cv::WINDOW_AUTOSIZE);
     // cv::imshow("Display Keypoints", rgbSlice);
-    static int unique_image_id = 27634;
+    static std::atomic<int> unique_image_id(27634);
     cv::imwrite("oriented_keypoints_" + std::to_string(unique_image_id++) + ".png", rgbSlice);
     // cv::waitKey(0);
     // cv::destroyAllWindows();
@@ -333,7 +357,7 @@ void displayImg(cv::Mat img) {
 }
 
 
-void SIFT2DStitcher::buildDoG(cv::Mat img, std::vector<std::vector<cv::Mat>>& gaussians, std::vector<std::vector<cv::Mat>>& DoG) {
+void SIFT2DStitcher::buildDoG(cv::Mat img, const int octaves_num, const double sigma, std::vector<std::vector<cv::Mat>>& gaussians, std::vector<std::vector<cv::Mat>>& DoG) {
     const double k = std::pow(2, 1 / static_cast<double>(scale_levels_num));
     
     gaussians.resize(octaves_num);
@@ -373,7 +397,7 @@ void SIFT2DStitcher::buildDoG(cv::Mat img, std::vector<std::vector<cv::Mat>>& ga
 void SIFT2DStitcher::detect(const std::vector<std::vector<cv::Mat>>& DoG, std::vector<cv::KeyPoint>& keypoints) {
     int scale = 1;
 
-    for (int octave = 0; octave < octaves_num; ++ octave) {
+    for (int octave = 0; octave < DoG.size(); ++ octave) {
         for (int scale_level = 1; scale_level < blur_levels_num - 2; ++scale_level) {
             cv::Mat img_0 = DoG[octave][scale_level - 1];
             cv::Mat img_1 = DoG[octave][scale_level];
@@ -497,7 +521,7 @@ void SIFT2DStitcher::hessian(const std::vector<std::vector<cv::Mat>>& DoG, const
 }
 
 
-void SIFT2DStitcher::localize(const std::vector<std::vector<cv::Mat>>& DoG, std::vector<cv::KeyPoint>& keypoints) {
+void SIFT2DStitcher::localize(const std::vector<std::vector<cv::Mat>>& DoG, const double sigma, std::vector<cv::KeyPoint>& keypoints) {
     const float min_shift = 0.5;
     const float min_contrast = 0.03;
     const float eigen_ratio = 10;
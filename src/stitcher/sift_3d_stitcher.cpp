@@ -42,7 +42,7 @@ void SIFT3DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
         sigma = 0.7;
     }
 
-    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ;
+    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ - scan_1.getRefStitchParams().offsetZ;
     int maxOverlap = size_2.z / 2;
 
     if (refOffsetZ > 0) {
@@ -51,8 +51,6 @@ void SIFT3DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
         maxOverlap += maxDeviation;
     }
 
-    std::vector<std::vector<VoxelContainer>> scanGaussians_1, scanGaussians_2;
-    std::vector<std::vector<VoxelContainer>> scanDoGs_1, scanDoGs_2;
     std::vector<std::vector<cv::Mat>> gaussians_1, gaussians_2;
     std::vector<std::vector<cv::Mat>> DoG_1, DoG_2;
     std::vector<cv::KeyPoint> keypoints_1, keypoints_2;
@@ -65,8 +63,9 @@ void SIFT3DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
     const int start_2 = 0;
     const int end_2 = maxOverlap;
 
-    buildDoG(scan_1, scanGaussians_1, scanDoGs_1, start_1, end_1);
-    buildDoG(scan_2, scanGaussians_2, scanDoGs_2, start_2, end_2);
+    // Pyramids are built only for the bands which may overlap
+    buildDoG(VoxelView(scan_1).band(start_1, end_1), scanGaussians_1, scanDoGs_1);
+    buildDoG(VoxelView(scan_2).band(start_2, end_2), scanGaussians_2, scanDoGs_2);
 
     TiffImage<float> sliceImg;
 
@@ -157,8 +156,9 @@ void SIFT3DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
         }
     }
     
-    // Get optimal offset
-    int offsetZ = getMedian(offsetsZ);
+    // Get optimal offset, bands below are taken by whole layers of it
+    const float overlapZ = getMedian(offsetsZ);
+    int offsetZ = std::lround(overlapZ);
 
     std::vector<std::pair<int, float>> h_planes = {{2, 0.3}, {2, 0.4}, {2, 0.5}, {2, 0.6}, {2, 0.7}};
 
@@ -256,14 +256,20 @@ void SIFT3DStitcher::estimateStitchParams(const VoxelContainer& scan_1, VoxelCon
     }
 
     // Get optimal offsets
-    int offsetX = getMedian(offsetsX);
-    int offsetY = getMedian(offsetsY);
+    float offsetX = getMedian(offsetsX);
+    float offsetY = getMedian(offsetsY);
 
-    scan_2.setEstStitchParams({offsetX, offsetY, static_cast<int>(size_1.z) - offsetZ});
+    scan_2.setEstStitchParams(VoxelContainer::StitchParams::fromOffsets(offsetX, offsetY, size_1.z - overlapZ));
 
     auto refParams_1 = scan_1.getRefStitchParams();
     auto refParams_2 = scan_2.getRefStitchParams();
-    printf("Offsets are %i %i %i. Should be %i %i %i\n", offsetX, offsetY, static_cast<int>(size_1.z) - offsetZ, refParams_2.offsetX - refParams_1.offsetX, refParams_2.offsetY - refParams_1.offsetY, refParams_2.offsetZ - refParams_1.offsetZ);
+    printf("Offsets are %.2f %.2f %.2f. Should be %i %i %i\n", offsetX, offsetY, size_1.z - overlapZ, refParams_2.offsetX - refParams_1.offsetX, refParams_2.offsetY - refParams_1.offsetY, refParams_2.offsetZ - refParams_1.offsetZ);
+}
+
+
+bool SIFT3DStitcher::isReentrant() const {
+    // Pyramids are kept in members between estimations
+    return false;
 }
 
 
@@ -307,7 +313,7 @@ void SIFT3DStitcher::displayMatches(TiffImage<unsigned char>& sliceImg_1, TiffIm
 }
 
 
-void SIFT3DStitcher::displaySlice(const VoxelContainer& src) {
+void SIFT3DStitcher::displaySlice(const VoxelView& src) {
     TiffImage<float> sliceImg;
     src.getSlice<float>(sliceImg, 0, src.getSize().x / 2, false);
     cv::Mat_<float> slice(sliceImg.getHeight(), sliceImg.getWidth(), sliceImg.getData());
@@ -321,7 +327,7 @@ void SIFT3DStitcher::displaySlice(const VoxelContainer& src) {
 }
 
 
-void SIFT3DStitcher::gaussianBlur(const VoxelContainer& src, VoxelContainer& dst, const double sigma, const int start, const int end) {
+void SIFT3DStitcher::gaussianBlur(const VoxelView& src, VoxelContainer& dst, const double sigma) {
     int radius = 2 * sigma;
     size_t gSize = 2 * radius + 1;
 
@@ -339,11 +345,11 @@ void SIFT3DStitcher::gaussianBlur(const VoxelContainer& src, VoxelContainer& dst
     }
 
     VoxelContainer::Vector3 size = src.getSize();
-    if (end > 0) {
-        size.z = end - start;
-    }
 
-    dst.create(size, src.getRange());
+    // Every voxel is overwritten below, so the buffer needs no zeroing
+    if (!dst.reshape(size, src.getRange())) {
+        return;
+    }
 
     // displaySlice(gaussian);
 
@@ -351,9 +357,11 @@ void SIFT3DStitcher::gaussianBlur(const VoxelContainer& src, VoxelContainer& dst
         std::cout << sz << " of " << size.z << std::endl;
         for (int sy = 0; sy < size.y; ++sy) {
             for (int sx = 0; sx < size.x; ++sx) {
+                float val = 0;
+
                 for (int z = -radius; z <= radius; ++z) {
-                    int lz = sz + z + start;
-                    if (lz < start || lz >= size.z + start) {
+                    int lz = sz + z;
+                    if (lz < 0 || lz >= size.z) {
                         continue;
                     }
                     for (int y = -radius; y <= radius; ++y) {
@@ -368,10 +376,12 @@ void SIFT3DStitcher::gaussianBlur(const VoxelContainer& src, VoxelContainer& dst
                                 continue;
                             }
 
-                            dst.at(sx, sy, sz) += src.at(lx, ly, lz) * gaussian.at(x + radius, y + radius, z + radius) / (sum * radius * radius);
+                            val += src.get(lx, ly, lz) * gaussian.at(x + radius, y + radius, z + radius) / (sum * radius * radius);
                         }
                     }
                 }
+
+                dst.at(sx, sy, sz) = val;
             }
         }
     }
@@ -383,7 +393,10 @@ void SIFT3DStitcher::gaussianBlur(const VoxelContainer& src, VoxelContainer& dst
 void SIFT3DStitcher::compressTwice(const VoxelContainer& src, VoxelContainer& dst) {
     VoxelContainer::Vector3 srcSize = src.getSize();
     VoxelContainer::Vector3 dstSize = {(srcSize.x + 1) / 2, (srcSize.y + 1) / 2, (srcSize.z + 1) / 2};
-    dst.create(dstSize, src.getRange());
+
+    if (!dst.reshape(dstSize, src.getRange())) {
+        return;
+    }
 
     for (int z = 0; z < dstSize.z; ++z) {
         for (int y = 0; y < dstSize.y; ++y) {
@@ -395,18 +408,21 @@ void SIFT3DStitcher::compressTwice(const VoxelContainer& src, VoxelContainer& ds
 }
 
 
-void SIFT3DStitcher::buildDoG(const VoxelContainer& vol, std::vector<std::vector<VoxelContainer>>& gaussians, std::vector<std::vector<VoxelContainer>>& DoG, const int start, const int end) {
+void SIFT3DStitcher::buildDoG(const VoxelView& vol, std::vector<std::vector<VoxelContainer>>& gaussians, std::vector<std::vector<VoxelContainer>>& DoG) {
     const double k = std::pow(2, 1 / static_cast<double>(scaleLevelsNum));
     
-    gaussians.resize(octavesNum);
-    DoG.resize(octavesNum);
+    // Pyramid only grows, so levels keep their memory between calls
+    if (static_cast<int>(gaussians.size()) < octavesNum) {
+        gaussians.resize(octavesNum);
+        DoG.resize(octavesNum);
+    }
 
     for (int i = 0; i < octavesNum; ++i) {
         gaussians[i].resize(blurLevelsNum);
         DoG[i].resize(blurLevelsNum - 1);
     }
 
-    gaussianBlur(vol, gaussians[0][0], sigma, start, end);
+    gaussianBlur(vol, gaussians[0][0], sigma);
 
     for (int octave = 0; octave < octavesNum; ++octave) {
         for (int scale_level = 1; scale_level < blurLevelsNum; ++scale_level) {
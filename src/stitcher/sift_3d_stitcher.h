@@ -5,6 +5,7 @@
 #include <vector>
 #include <opencv2/opencv.hpp>
 #include "voxel_container.h"
+#include "voxel_view.h"
 #include "stitcher.h"
 
 /**
@@ -28,12 +29,13 @@ private:
 
     float getMedian(std::vector<float>& array);
     void estimateStitchParams(const VoxelContainer& scan_1, VoxelContainer& scan_2);
+    bool isReentrant() const;
     void displayKeypoints(TiffImage<unsigned char>& sliceImg, const std::vector<cv::KeyPoint>& keypoints, const int start, const int end);
     void displayMatches(TiffImage<unsigned char>& sliceImg_1, TiffImage<unsigned char>& sliceImg_2, const std::vector<cv::KeyPoint>& keypoints_1, const std::vector<cv::KeyPoint>& keypoints_2, const std::vector<cv::DMatch>& matches, const int maxOverlap);
-    void displaySlice(const VoxelContainer& src);
-    void gaussianBlur(const VoxelContainer& src, VoxelContainer& dst, const double sigma, const int start = 0, const int end = 0);
+    void displaySlice(const VoxelView& src);
+    void gaussianBlur(const VoxelView& src, VoxelContainer& dst, const double sigma);
     void compressTwice(const VoxelContainer& src, VoxelContainer& dst);
-    void buildDoG(const VoxelContainer& vol, std::vector<std::vector<VoxelContainer>>& gaussians, std::vector<std::vector<VoxelContainer>>& DoG, const int start, const int end);
+    void buildDoG(const VoxelView& vol, std::vector<std::vector<VoxelContainer>>& gaussians, std::vector<std::vector<VoxelContainer>>& DoG);
     void detect(const std::vector<std::vector<cv::Mat>>& DoG, std::vector<cv::KeyPoint>& keypoints);
     void gradient(const std::vector<std::vector<cv::Mat>>& DoG, const cv::KeyPoint& kp, cv::Mat1f& result);
     void hessian(const std::vector<std::vector<cv::Mat>>& DoG, const cv::KeyPoint& kp, cv::Mat1f& result);
@@ -47,6 +49,10 @@ private:
     const int blurLevelsNum = scaleLevelsNum + 3;
     double sigma = 0.9;
     std::vector<std::pair<int, float>> planes = {{0, 0.4}, {0, 0.5}, {0, 0.6}, {1, 0.4}, {1, 0.5}, {1, 0.6}, {3, 0}, {4, 0}};
+
+    // Pyramids of both scans are kept between calls to reuse their memory
+    std::vector<std::vector<VoxelContainer>> scanGaussians_1, scanGaussians_2;
+    std::vector<std::vector<VoxelContainer>> scanDoGs_1, scanDoGs_2;
 };
 
 #endif // SIFT_3D_STITCHER
\ No newline at end of file
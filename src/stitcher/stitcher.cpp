@@ -1,6 +1,10 @@
+#include <algorithm>
 #include <iostream>
+#include <condition_variable>
 #include <cstring>
+#include <future>
 #include <limits>
+#include <mutex>
 #include <opencv2/opencv.hpp>
 #include "stitcher.h"
 
@@ -19,52 +23,502 @@ std::shared_ptr<VoxelContainer> StitcherImpl::stitch(const VoxelContainer& scan_
     int overlap = size_1.z - params_2.offsetZ;
 
     VoxelContainer::Vector3 stitchedSize = {size_1.x, size_1.y, size_1.z + size_2.z - overlap};
+    auto stitchedRange = getStitchedRange(scan_1, scan_2);
 
-    float* stitchedData = new float[stitchedSize.volume()];
+    // Keep native values if both scans have the same sample type
+    VoxelContainer::SampleType stitchedType = scan_1.getSampleType();
 
-    int offsetVolume = overlap * size_2.x * size_2.y;
-    int scanVolume = size_2.x * size_2.y * (size_2.z - overlap);
-    int layerSpace = size_1.x * size_1.y;
+    if (scan_2.getSampleType() != stitchedType) {
+        stitchedType = VoxelContainer::SampleType::Float32;
+    }
 
-    float* data_2 = scan_2.getData();
+    auto stitched = std::make_shared<VoxelContainer>();
+    stitched->setSampleType(stitchedType);
 
-    auto stitchedRange = getStitchedRange(scan_1, scan_2);
+    // Every layer is written by the pass below, so the memory isn't cleared first
+    if (!stitched->reshape(stitchedSize, stitchedRange)) {
+        return nullptr;
+    }
+
+    stitched->setRefStitchParams(scan_1.getRefStitchParams());
 
-    memcpy(stitchedData, scan_1.getData(), size_1.volume() * sizeof(float));
-    // memcpy(stitchedData + size_1.volume(), data_2 + offsetVolume, scanVolume * sizeof(float));
-
-    for (int z = 0; z < size_2.z - overlap; ++z) {
-        for (int y = 0; y < size_2.y; ++y) {
-            for (int x = 0; x < size_2.x; ++x) {
-                int x2 = x + params_2.offsetX;
-                int y2 = y + params_2.offsetY;
-                if (x2 >= 0 || x2 < size_2.x || y2 >= 0 || y2 < size_2.y) {
-                    stitchedData[(z + size_1.z) * layerSpace + y * size_1.x + x] = data_2[(z + overlap) * layerSpace + y2 * size_1.x + x2];
-                }
-                else {
-                    stitchedData[(z + size_1.z) * layerSpace + y * size_1.x + x] = stitchedRange.min;
-                }
+    unsigned char* dst = static_cast<unsigned char*>(stitched->getRawData());
+    const size_t layerBytes = size_1.x * size_1.y * VoxelContainer::getSampleSize(stitchedType);
+
+    // Overlap is blended in the same pass, each of its layers is read once from both scans
+    const int overlapBegin = std::max(0, params_2.offsetZ);
+    const int overlapEnd = blendMode == BlendMode::None ? overlapBegin : std::min<int>(size_1.z, params_2.offsetZ + size_2.z);
+
+    // Layers of the first scan are copied as they are, the second scan is placed by row spans
+    ThreadPool::getDefault().parallelFor(0, stitchedSize.z, 1, [&](const int zBegin, const int zEnd) {
+        for (int z = zBegin; z < zEnd; ++z) {
+            if (z >= overlapBegin && z < overlapEnd) {
+                CompositeVolume::blendLayer(scan_1, {0, 0, 0}, scan_2, params_2, z, blendMode, dst + z * layerBytes, stitchedType, stitchedRange.min);
+            }
+            else if (z < size_1.z) {
+                scan_1.copyLayers(dst + z * layerBytes, z, z + 1, stitchedType);
+            }
+            else {
+                CompositeVolume::placeLayer(scan_2, z - size_1.z + overlap, params_2, dst + z * layerBytes, stitchedType, stitchedRange.min);
             }
         }
-    }
+    });
 
-    return std::make_shared<VoxelContainer>(stitchedData, stitchedSize, stitchedRange, scan_1.getRefStitchParams());
+    return stitched;
 }
 
 
 std::shared_ptr<VoxelContainer> StitcherImpl::stitch(std::vector<std::shared_ptr<VoxelContainer>>& partialScans) {
-    std::shared_ptr<VoxelContainer> result = partialScans[0];
-    result->setEstStitchParams({0, 0, 0});
+    if (partialScans.size() == 1) {
+        partialScans[0]->setEstStitchParams({0, 0, 0});
+        return partialScans[0];
+    }
+
+    // Placements of all parts are found first, so every voxel is copied once
+    auto composite = compose(partialScans);
+
+    if (composite == nullptr) {
+        return nullptr;
+    }
+
+    composite->setBlendMode(blendMode);
+
+    return composite->materialize();
+}
+
+
+std::shared_ptr<CompositeVolume> StitcherImpl::compose(std::vector<std::shared_ptr<VoxelContainer>>& partialScans) {
+    if (partialScans.empty()) {
+        return nullptr;
+    }
+
+    VoxelContainer::Vector3 size_0 = partialScans[0]->getSize();
+    VoxelContainer::StitchParams offset = {0, 0, 0};
+    partialScans[0]->setEstStitchParams(offset);
+    std::vector<size_t> pairsMemory;
 
     for (int scan_id = 1; scan_id < partialScans.size(); ++scan_id) {
-        result = stitch(*result, *partialScans[scan_id]);
-        
-        if (result == nullptr) {
+        VoxelContainer::Vector3 size = partialScans[scan_id]->getSize();
+
+        if (size.x != size_0.x || size.y != size_0.y) {
+            // QMessageBox::information(0, "Stitching error", "Failed to stitch scans due to different sizes.");
             return nullptr;
         }
+
+        const int window = getOverlapWindow(*partialScans[scan_id - 1], *partialScans[scan_id]);
+        pairsMemory.push_back(getEstimationMemory({size.x, size.y, static_cast<size_t>(window)}));
+    }
+
+    estimatePairs(pairsMemory, memoryBudget, [&](const int pair_id) {
+        estimateStitchParams(*partialScans[pair_id], *partialScans[pair_id + 1]);
+        return true;
+    });
+
+    for (int scan_id = 1; scan_id < partialScans.size(); ++scan_id) {
+        // Estimated params are relative to the previous scan, accumulate them
+        auto params = partialScans[scan_id]->getEstStitchParams();
+        offset = offset + params;
+        partialScans[scan_id]->setEstStitchParams(offset);
+    }
+
+    return std::make_shared<CompositeVolume>(partialScans);
+}
+
+
+std::shared_ptr<CompositeVolume> StitcherImpl::composeFromJson(const std::vector<std::string>& infoFileNames, std::vector<std::shared_ptr<VoxelContainer>>& partialScans) {
+    const int partsNum = infoFileNames.size();
+
+    if (partsNum == 0 || partialScans.size() != infoFileNames.size()) {
+        return nullptr;
+    }
+
+    std::vector<VoxelContainer> infos(partsNum);
+
+    for (int part_id = 0; part_id < partsNum; ++part_id) {
+        if (!infos[part_id].loadInfoFromJson(infoFileNames[part_id])) {
+            return nullptr;
+        }
+
+        const VoxelContainer::Vector3& size = infos[part_id].getSize();
+
+        if (size.x != infos[0].getSize().x || size.y != infos[0].getSize().y) {
+            printf("Error: Failed to stitch scans due to different sizes.\n");
+            return nullptr;
+        }
+    }
+
+    // Overlap bands of all pairs are read concurrently before anything else
+    std::vector<VoxelContainer> bands_1(partsNum);
+    std::vector<VoxelContainer> bands_2(partsNum);
+    std::vector<int> bandBegins_1(partsNum, 0);
+    std::vector<std::future<bool>> bandLoads;
+
+    for (int part_id = 1; part_id < partsNum; ++part_id) {
+        const int height_1 = infos[part_id - 1].getSize().z;
+        const int height_2 = infos[part_id].getSize().z;
+        const int window = getOverlapWindow(infos[part_id - 1], infos[part_id]);
+        const int zBegin_1 = height_1 - std::min(window, height_1);
+        const int zEnd_2 = std::min(window, height_2);
+        bandBegins_1[part_id] = zBegin_1;
+
+        bandLoads.push_back(std::async(std::launch::async, [&, part_id, zBegin_1, height_1]() {
+            return bands_1[part_id].loadFromJson(infoFileNames[part_id - 1], zBegin_1, height_1);
+        }));
+
+        bandLoads.push_back(std::async(std::launch::async, [&, part_id, zEnd_2]() {
+            return bands_2[part_id].loadFromJson(infoFileNames[part_id], 0, zEnd_2);
+        }));
+    }
+
+    bool loaded = true;
+
+    for (auto& bandLoad : bandLoads) {
+        loaded = bandLoad.get() && loaded;
+    }
+
+    if (!loaded) {
+        return nullptr;
+    }
+
+    // Every part is loaded by its own task while the bands are estimated, layers of the bands are copied instead of read again
+    std::vector<std::future<bool>> partLoads;
+
+    for (int part_id = 0; part_id < partsNum; ++part_id) {
+        std::vector<const VoxelContainer*> partBands;
+
+        if (part_id > 0) {
+            partBands.push_back(&bands_2[part_id]);
+        }
+
+        if (part_id < partsNum - 1) {
+            partBands.push_back(&bands_1[part_id + 1]);
+        }
+
+        partLoads.push_back(std::async(std::launch::async, [&, part_id, partBands]() {
+            return partialScans[part_id]->loadFromJson(infoFileNames[part_id], partBands);
+        }));
+    }
+
+    std::vector<VoxelContainer::StitchParams> offsets(partsNum, {0, 0, 0});
+    std::vector<VoxelContainer::StitchParams> pairsParams(partsNum, {0, 0, 0});
+    std::vector<size_t> pairsMemory;
+
+    for (int part_id = 1; part_id < partsNum; ++part_id) {
+        const VoxelContainer::Vector3& bandSize = bands_1[part_id].getSize();
+        pairsMemory.push_back(getEstimationMemory({bandSize.x, bandSize.y, std::max(bandSize.z, bands_2[part_id].getSize().z)}));
+    }
+
+    estimatePairs(pairsMemory, memoryBudget, [&](const int pair_id) {
+        const int part_id = pair_id + 1;
+        estimateStitchParams(bands_1[part_id], bands_2[part_id]);
+        pairsParams[part_id] = bands_2[part_id].getEstStitchParams();
+
+        return true;
+    });
+
+    for (int part_id = 1; part_id < partsNum; ++part_id) {
+        // Estimated offset is relative to the band of the previous part
+        VoxelContainer::StitchParams params = pairsParams[part_id];
+        params.offsetZ += bandBegins_1[part_id];
+        offsets[part_id] = offsets[part_id - 1] + params;
+    }
+
+    // Bands are read by the part loads, so all of them are finished before the bands are released
+    for (auto& partLoad : partLoads) {
+        loaded = partLoad.get() && loaded;
+    }
+
+    if (!loaded) {
+        return nullptr;
+    }
+
+    for (int part_id = 0; part_id < partsNum; ++part_id) {
+        partialScans[part_id]->setEstStitchParams(offsets[part_id]);
+    }
+
+    return std::make_shared<CompositeVolume>(partialScans);
+}
+
+
+bool StitcherImpl::estimateFromJson(const std::vector<std::string>& infoFileNames, std::vector<VoxelContainer::StitchParams>& offsets) {
+    const int partsNum = infoFileNames.size();
+
+    if (partsNum == 0) {
+        return false;
+    }
+
+    // Voxels are read only by the bands below
+    std::vector<VoxelContainer> infos(partsNum);
+
+    for (int part_id = 0; part_id < partsNum; ++part_id) {
+        if (!infos[part_id].loadInfoFromJson(infoFileNames[part_id])) {
+            return false;
+        }
+
+        const VoxelContainer::Vector3& size = infos[part_id].getSize();
+
+        if (size.x != infos[0].getSize().x || size.y != infos[0].getSize().y) {
+            printf("Error: Failed to stitch scans due to different sizes.\n");
+            return false;
+        }
+    }
+
+    offsets.assign(partsNum, {0, 0, 0});
+    std::vector<VoxelContainer::StitchParams> pairsParams(partsNum, {0, 0, 0});
+    std::vector<int> bandBegins_1(partsNum, 0);
+    std::vector<size_t> pairsMemory;
+
+    for (int part_id = 1; part_id < partsNum; ++part_id) {
+        const VoxelContainer::Vector3& size_1 = infos[part_id - 1].getSize();
+        const VoxelContainer::Vector3& size_2 = infos[part_id].getSize();
+        const int window = getOverlapWindow(infos[part_id - 1], infos[part_id]);
+        const size_t bandHeight = std::min<size_t>(window, std::max(size_1.z, size_2.z));
+        bandBegins_1[part_id] = size_1.z - std::min<size_t>(window, size_1.z);
+
+        // Bands are held by the pair together with the estimation structures
+        const size_t bandsBytes = size_1.x * size_1.y * (std::min<size_t>(window, size_1.z) * VoxelContainer::getSampleSize(infos[part_id - 1].getSampleType()) + std::min<size_t>(window, size_2.z) * VoxelContainer::getSampleSize(infos[part_id].getSampleType()));
+        pairsMemory.push_back(bandsBytes + getEstimationMemory({size_1.x, size_1.y, bandHeight}));
+    }
+
+    // Bands are read by the pairs, so without a budget they run one by one to hold two bands only
+    const size_t budget = memoryBudget == 0 ? 1 : memoryBudget;
+
+    bool estimated = estimatePairs(pairsMemory, budget, [&](const int pair_id) {
+        const int part_id = pair_id + 1;
+        const int height_1 = infos[part_id - 1].getSize().z;
+        const int height_2 = infos[part_id].getSize().z;
+        const int window = getOverlapWindow(infos[part_id - 1], infos[part_id]);
+
+        // Only the bands are read, and they are released as soon as the pair is estimated
+        VoxelContainer band_1;
+        VoxelContainer band_2;
+
+        if (!band_1.loadFromJson(infoFileNames[part_id - 1], bandBegins_1[part_id], height_1) ||
+            !band_2.loadFromJson(infoFileNames[part_id], 0, std::min(window, height_2))) {
+            return false;
+        }
+
+        estimateStitchParams(band_1, band_2);
+        pairsParams[part_id] = band_2.getEstStitchParams();
+
+        return true;
+    });
+
+    if (!estimated) {
+        return false;
+    }
+
+    for (int part_id = 1; part_id < partsNum; ++part_id) {
+        // Estimated offset is relative to the band of the previous part
+        VoxelContainer::StitchParams params = pairsParams[part_id];
+        params.offsetZ += bandBegins_1[part_id];
+        offsets[part_id] = offsets[part_id - 1] + params;
+    }
+
+    return true;
+}
+
+
+bool StitcherImpl::stitchToJson(const std::vector<std::string>& infoFileNames, const std::string& dirName, std::vector<VoxelContainer::StitchParams>* placements) {
+    const int partsNum = infoFileNames.size();
+    std::vector<VoxelContainer::StitchParams> offsets;
+
+    if (!estimateFromJson(infoFileNames, offsets)) {
+        return false;
+    }
+
+    // Only parameters of the parts are kept for the whole stitch
+    std::vector<VoxelContainer> infos(partsNum);
+
+    for (int part_id = 0; part_id < partsNum; ++part_id) {
+        if (!infos[part_id].loadInfoFromJson(infoFileNames[part_id])) {
+            return false;
+        }
+    }
+
+    if (placements != nullptr) {
+        *placements = offsets;
+    }
+
+    // Parts are placed the same way as in CompositeVolume
+    VoxelContainer::Vector3 size = {infos[0].getSize().x, infos[0].getSize().y, 0};
+    VoxelContainer::Range range = infos[0].getRange();
+    VoxelContainer::SampleType type = infos[0].getSampleType();
+    std::vector<int> partEnds;
+
+    for (int part_id = 0; part_id < partsNum; ++part_id) {
+        const int partEnd = offsets[part_id].offsetZ + static_cast<int>(infos[part_id].getSize().z);
+        size.z = std::max(static_cast<int>(size.z), partEnd);
+        partEnds.push_back(size.z);
+        range.min = std::min(range.min, infos[part_id].getRange().min);
+        range.max = std::max(range.max, infos[part_id].getRange().max);
+
+        if (infos[part_id].getSampleType() != type) {
+            type = VoxelContainer::SampleType::Float32;
+        }
+    }
+
+    // Layers are requested in z order, so parts are read sequentially in chunks
+    VoxelContainer chunk;
+    int chunkPart = -1;
+    int chunkBegin = 0;
+    int part_id = 0;
+    bool loaded = true;
+
+    bool saved = VoxelContainer::saveToJson(dirName, size, range, type, [&](void* dst, const int z, const VoxelContainer::SampleType dstType) {
+        while (part_id < partsNum - 1 && z >= partEnds[part_id]) {
+            ++part_id;
+        }
+
+        const VoxelContainer::StitchParams& params = offsets[part_id];
+        const int height = infos[part_id].getSize().z;
+        const int z2 = z - params.offsetZ;
+
+        if (z2 < 0 || z2 >= height || !loaded) {
+            CompositeVolume::placeLayer(infos[part_id], -1, {0, 0, 0}, dst, dstType, range.min);
+            return;
+        }
+
+        // Sub-voxel shift along z interpolates with the neighbouring layers, so they are kept in the chunk
+        const int margin = params.fractionZ != 0 ? 1 : 0;
+        const int zBegin = std::max(0, z2 - margin);
+        const int zEnd = std::min(height, z2 + margin + 1);
+
+        if (chunkPart != part_id || zBegin < chunkBegin || zEnd > chunkBegin + static_cast<int>(chunk.getSize().z)) {
+            chunkPart = part_id;
+            chunkBegin = zBegin;
+            loaded = chunk.loadFromJson(infoFileNames[part_id], zBegin, std::min(zBegin + streamChunkLayers, height));
+
+            if (!loaded) {
+                CompositeVolume::placeLayer(infos[part_id], -1, {0, 0, 0}, dst, dstType, range.min);
+                return;
+            }
+        }
+
+        CompositeVolume::placeLayer(chunk, z2 - chunkBegin, params, dst, dstType, range.min);
+    });
+
+    return saved && loaded;
+}
+
+
+void StitcherImpl::setBlendMode(const BlendMode mode) {
+    blendMode = mode;
+}
+
+
+StitcherImpl::BlendMode StitcherImpl::getBlendMode() const {
+    return blendMode;
+}
+
+
+void StitcherImpl::setMemoryBudget(const size_t bytes) {
+    memoryBudget = bytes;
+}
+
+
+size_t StitcherImpl::getMemoryBudget() const {
+    return memoryBudget;
+}
+
+
+bool StitcherImpl::isReentrant() const {
+    return true;
+}
+
+
+size_t StitcherImpl::getEstimationMemory(const VoxelContainer::Vector3& bandSize) const {
+    return 2 * bandSize.volume() * sizeof(float);
+}
+
+
+bool StitcherImpl::estimatePairs(const std::vector<size_t>& pairsMemory, const size_t budget, const std::function<bool(int)>& estimatePair) {
+    const int pairsNum = pairsMemory.size();
+
+    if (!isReentrant()) {
+        for (int pair_id = 0; pair_id < pairsNum; ++pair_id) {
+            if (!estimatePair(pair_id)) {
+                return false;
+            }
+        }
+
+        return true;
     }
-    
-    return result;
+
+    std::mutex mutex;
+    std::condition_variable released;
+    size_t usedMemory = 0;
+    int runningNum = 0;
+    std::vector<char> results(pairsNum, false);
+    std::vector<std::future<void>> estimations;
+
+    auto release = [&](const size_t memory) {
+        std::lock_guard<std::mutex> lock(mutex);
+        usedMemory -= memory;
+        --runningNum;
+        released.notify_all();
+    };
+
+    for (int pair_id = 0; pair_id < pairsNum; ++pair_id) {
+        const size_t memory = pairsMemory[pair_id];
+
+        // Pairs are admitted in z order, a pair larger than the budget waits until it is alone
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            released.wait(lock, [&]() {
+                return budget == 0 || runningNum == 0 || usedMemory + memory <= budget;
+            });
+
+            usedMemory += memory;
+            ++runningNum;
+        }
+
+        estimations.push_back(ThreadPool::getDefault().submit([&, pair_id, memory]() {
+            try {
+                results[pair_id] = estimatePair(pair_id);
+            }
+            catch (...) {
+                release(memory);
+                throw;
+            }
+
+            release(memory);
+        }));
+    }
+
+    // All pairs are finished before any exception is passed on, they refer to the locals
+    for (auto& estimation : estimations) {
+        estimation.wait();
+    }
+
+    bool estimated = true;
+
+    for (int pair_id = 0; pair_id < pairsNum; ++pair_id) {
+        estimations[pair_id].get();
+        estimated = estimated && results[pair_id];
+    }
+
+    return estimated;
+}
+
+
+int StitcherImpl::getOverlapWindow(const VoxelContainer& scan_1, const VoxelContainer& scan_2) const {
+    const int height_1 = scan_1.getSize().z;
+    const int height_2 = scan_2.getSize().z;
+    const int refOffsetZ = scan_2.getRefStitchParams().offsetZ - scan_1.getRefStitchParams().offsetZ;
+
+    // Without reference the overlap is searched over the whole parts
+    if (refOffsetZ <= 0) {
+        return std::max(height_1, height_2);
+    }
+
+    // Estimators search the reference overlap plus maximum deviation of max(5, overlap / 5)
+    const int refOverlap = height_1 - refOffsetZ;
+
+    // Parts placed apart by the reference get a band of the deviation only
+    const int window = std::max(refOverlap, 0) + std::max(5, refOverlap / 5) + 1;
+
+    return std::min(window, std::max(height_1, height_2));
 }
 
 
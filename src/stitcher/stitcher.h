@@ -1,17 +1,27 @@
 #ifndef STITCHER_H
 #define STITCHER_H
 
+#include <functional>
 #include <memory>
+#include <string>
 #include <vector>
+#include "composite_volume.h"
 #include "voxel_container.h"
 
 
 /// Abstract base stitcher class.
 class StitcherImpl {
 public:
+    /// Mixing of the layers covered by both scans, see CompositeVolume::BlendMode.
+    using BlendMode = CompositeVolume::BlendMode;
+
     /**
      * \brief Stitches two reconstructions into one.
      * 
+     * Voxels of the overlap are mixed according to the blend mode in the
+     * same pass that assembles the other layers. Voxels of the first scan
+     * not covered by the shifted second one are kept as they are.
+     * 
      * \param[in] scan_1 First reconstruction
      * \param[in] scan_1 Second reconstruction
      * \return Shared pointer to the new stitched reconstruction.
@@ -21,11 +31,131 @@ public:
     /**
      * \brief Stitches several reconstructions into one.
      * 
+     * Placements of all parts are estimated by compose() first, then the
+     * stitched volume is allocated once and every layer of it is filled in
+     * a single parallel pass, overlaps mixed according to the blend mode.
+     * So no intermediate volumes are built and voxels of the first parts are
+     * not copied again for every next one. Estimated stitch parameters of the
+     * scans are set to their absolute offsets.
+     * 
      * \param[in] partialScans Vector of shared pointers to reconstructions to be stitched
      * \return Shared pointer to the new stitched reconstruction.
      */
     std::shared_ptr<VoxelContainer> stitch(std::vector<std::shared_ptr<VoxelContainer>>& partialScans);
 
+    /**
+     * \brief Places several reconstructions without copying them.
+     * 
+     * Estimates stitch parameters of each pair of neighbouring scans, pairs
+     * running concurrently within the memory budget, and converts them to
+     * absolute offsets in the stitched volume, which are stored into the
+     * estimated stitch parameters of every scan. Voxels of the result are
+     * taken from the scans on demand.
+     * 
+     * \param[in] partialScans Vector of shared pointers to reconstructions to be stitched
+     * \return Shared pointer to the composite of reconstructions or nullptr if failed.
+     */
+    std::shared_ptr<CompositeVolume> compose(std::vector<std::shared_ptr<VoxelContainer>>& partialScans);
+
+    /**
+     * \brief Loads reconstructions and places them, estimating on overlaps first.
+     * 
+     * Bands around the reference overlap of each pair of neighbouring parts
+     * are read first (whole parts are read if reference parameters are
+     * absent). Then every part is loaded by its own background task while
+     * stitch parameters are estimated on the bands, pairs running
+     * concurrently within the memory budget, so estimation waits for the
+     * bands only. Layers of the bands are copied into the parts instead of
+     * being read again, so the bands are kept until all parts are loaded.
+     * Placement is the same as by compose().
+     * 
+     * \param[in] infoFileNames Paths to the parameters files of the parts in z order
+     * \param[in,out] partialScans Reconstructions to be loaded, one per parameters file, configured by the caller
+     * \return Shared pointer to the composite of reconstructions or nullptr if failed.
+     */
+    std::shared_ptr<CompositeVolume> composeFromJson(const std::vector<std::string>& infoFileNames, std::vector<std::shared_ptr<VoxelContainer>>& partialScans);
+
+    /**
+     * \brief Estimates placement of reconstructions stored on disk.
+     * 
+     * Only the bands around the reference overlap of each pair of
+     * neighbouring parts are read (whole parts are read if reference
+     * parameters are absent). Pairs are read and estimated one at a time,
+     * holding two bands only, unless a memory budget is set by
+     * setMemoryBudget(). Then they run concurrently, holding as many bands
+     * as the budget allows. No volume is assembled.
+     * 
+     * \param[in] infoFileNames Paths to the parameters files of the parts in z order
+     * \param[out] offsets Absolute offsets of the parts in the stitched volume
+     * \return True - if success, false - if failed.
+     */
+    bool estimateFromJson(const std::vector<std::string>& infoFileNames, std::vector<VoxelContainer::StitchParams>& offsets);
+
+    /**
+     * \brief Stitches reconstructions stored on disk without loading them whole.
+     * 
+     * Stitch parameters of each pair of neighbouring parts are estimated on
+     * the bands around their reference overlap only (whole parts are read if
+     * reference parameters are absent). Then the stitched volume is written
+     * layer by layer in z order, reading parts in chunks of streamChunkLayers
+     * layers. So without a memory budget set by setMemoryBudget() memory
+     * usage is bounded by two overlap bands regardless of the number and
+     * size of parts, and by the budget otherwise. Overlaps are not blended,
+     * the blend mode is ignored and voxels of the upper part are kept as
+     * with BlendMode::None.
+     * 
+     * \param[in] infoFileNames Paths to the parameters files of the parts in z order
+     * \param[in] dirName Path to the output directory
+     * \param[out] placements Absolute offsets of the parts in the stitched volume, might be nullptr
+     * \return True - if success, false - if failed.
+     */
+    bool stitchToJson(const std::vector<std::string>& infoFileNames, const std::string& dirName, std::vector<VoxelContainer::StitchParams>* placements = nullptr);
+
+    /**
+     * \brief Selects mixing of overlaps by both stitch() methods.
+     *
+     * stitchToJson() reads one part at a time and doesn't blend overlaps.
+     *
+     * \param[in] mode Blend mode, BlendMode::None by default
+     */
+    void setBlendMode(const BlendMode mode);
+
+    /**
+     * \brief Gives mixing of overlaps by both stitch() methods.
+     *
+     * It is not applied by stitchToJson().
+     *
+     * \return Blend mode.
+     */
+    BlendMode getBlendMode() const;
+
+    /**
+     * \brief Limits memory of pairs of scans estimated at the same time.
+     * 
+     * Pairs of neighbouring scans are independent, so compose(),
+     * composeFromJson() and estimateFromJson() run their estimation on the
+     * default thread pool. A pair is started in z order once the memory of
+     * the pairs in flight plus its own, given by getEstimationMemory(), fits
+     * into the budget. A pair exceeding the budget alone is run alone.
+     * Without a budget compose() and composeFromJson(), working on scans
+     * already in memory, run all pairs at once, while estimateFromJson()
+     * and stitchToJson(), which read the bands themselves, run pairs one
+     * by one.
+     *
+     * \param[in] bytes Memory budget in bytes, 0 means no budget
+     */
+    void setMemoryBudget(const size_t bytes);
+
+    /**
+     * \brief Gives memory limit of pairs estimated at the same time.
+     *
+     * \return Memory budget in bytes, 0 means no budget.
+     */
+    size_t getMemoryBudget() const;
+
+    /// Number of layers read at once by stitchToJson().
+    static const int streamChunkLayers = 32;
+
 protected:
     /**
      * \brief Gives estimated stitch params.
@@ -40,6 +170,40 @@ protected:
      */
     virtual void estimateStitchParams(const VoxelContainer& scan_1, VoxelContainer& scan_2) = 0;
 
+    /**
+     * \brief Tells if estimateStitchParams() may run for several pairs at once.
+     * 
+     * Must be overrided to return false by inheritors keeping state of an
+     * estimation in members, then pairs are estimated one by one.
+     * 
+     * \return True by default.
+     */
+    virtual bool isReentrant() const;
+
+    /**
+     * \brief Gives memory needed to estimate stitch params of a pair.
+     * 
+     * Default is a float copy of both bands, inheritors building larger
+     * structures like scale-space pyramids should override it.
+     * 
+     * \param[in] bandSize Size of the band of each scan searched for the overlap
+     * \return Number of bytes.
+     */
+    virtual size_t getEstimationMemory(const VoxelContainer::Vector3& bandSize) const;
+
+    /**
+     * \brief Gives height of the bands needed to estimate stitch params.
+     * 
+     * The window is at least one layer and at most the height of the larger
+     * scan. Scans placed apart by the reference get a band of the maximum
+     * deviation searched by the estimators.
+     * 
+     * \param[in] scan_1 First reconstruction, might be empty
+     * \param[in] scan_2 Second reconstruction, might be empty
+     * \return Number of layers at the bottom of scan_1 and at the top of scan_2.
+     */
+    int getOverlapWindow(const VoxelContainer& scan_1, const VoxelContainer& scan_2) const;
+
     /**
      * \brief Gives the common range of two different reconstruction.
      * 
@@ -48,6 +212,12 @@ protected:
      * \return Common range.
      */
     VoxelContainer::Range getStitchedRange(const VoxelContainer& scan_1, const VoxelContainer& scan_2);
+
+private:
+    bool estimatePairs(const std::vector<size_t>& pairsMemory, const size_t budget, const std::function<bool(int)>& estimatePair);
+
+    BlendMode blendMode = BlendMode::None;
+    size_t memoryBudget = 0;
 };
 
 
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include "thread_pool.h"
+
+
+ThreadPool::ThreadPool(const size_t threadsNum) {
+    size_t workersNum = threadsNum;
+
+    if (workersNum == 0) {
+        workersNum = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (size_t i = 0; i < workersNum; ++i) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    condition.notify_all();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+
+size_t ThreadPool::getThreadsNum() const {
+    return workers.size();
+}
+
+
+std::future<void> ThreadPool::submit(std::function<void()> task) {
+    std::packaged_task<void()> packagedTask(std::move(task));
+    std::future<void> result = packagedTask.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(packagedTask));
+    }
+
+    condition.notify_one();
+
+    return result;
+}
+
+
+void ThreadPool::parallelFor(const int begin, const int end, const int step, const std::function<void(int, int)>& body) {
+    if (begin >= end) {
+        return;
+    }
+
+    struct Loop {
+        std::atomic<int> next;
+        int finished;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+
+    auto loop = std::make_shared<Loop>();
+    loop->next = 0;
+    loop->finished = 0;
+    const int chunksNum = (end - begin + step - 1) / step;
+
+    // Helpers started after all chunks are claimed exit without touching body
+    auto run = [loop, begin, end, step, chunksNum, &body]() {
+        int chunk;
+
+        while ((chunk = loop->next++) < chunksNum) {
+            const int chunkBegin = begin + chunk * step;
+            std::exception_ptr error;
+
+            // Chunk is finished even if body throws, so the caller never waits forever
+            try {
+                body(chunkBegin, std::min(end, chunkBegin + step));
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(loop->mutex);
+
+            if (error && !loop->error) {
+                // Chunks not claimed yet are finished without running body
+                loop->error = error;
+                loop->finished += chunksNum - std::min(loop->next.exchange(chunksNum), chunksNum);
+            }
+
+            if (++loop->finished == chunksNum) {
+                loop->condition.notify_all();
+            }
+        }
+    };
+
+    const int helpersNum = std::min(static_cast<int>(workers.size()), chunksNum - 1);
+
+    for (int i = 0; i < helpersNum; ++i) {
+        submit(run);
+    }
+
+    // Calling thread takes part, so nested loops never wait for idle workers
+    run();
+
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->condition.wait(lock, [&loop, chunksNum]() { return loop->finished == chunksNum; });
+
+    // First exception of body is passed to the caller once no helper refers to it
+    if (loop->error) {
+        std::rethrow_exception(loop->error);
+    }
+}
+
+
+ThreadPool& ThreadPool::getDefault() {
+    static ThreadPool pool;
+    return pool;
+}
+
+
+void ThreadPool::work() {
+    while (true) {
+        std::packaged_task<void()> task;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+
+            if (tasks.empty()) {
+                return;
+            }
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * \brief Fixed set of worker threads running submitted tasks.
+ *
+ * Tasks are run in the order of submission. parallelFor() splits a range
+ * into chunks processed by the workers together with the calling thread, so
+ * it may be safely called from a task of the same pool.
+ */
+class ThreadPool {
+public:
+    /**
+     * \brief Starts worker threads.
+     *
+     * \param[in] threadsNum Number of workers, 0 means the number of hardware threads
+     */
+    explicit ThreadPool(const size_t threadsNum = 0);
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Destructor. Finishes queued tasks and joins workers.
+    ~ThreadPool();
+
+    /**
+     * \brief Gives number of worker threads.
+     *
+     * \return Number of workers.
+     */
+    size_t getThreadsNum() const;
+
+    /**
+     * \brief Queues task to be run by a worker.
+     *
+     * \param[in] task Function to run
+     * \return Future becoming ready when the task is finished.
+     */
+    std::future<void> submit(std::function<void()> task);
+
+    /**
+     * \brief Runs body over the range split into chunks in parallel.
+     *
+     * Chunks are claimed one by one by the workers and the calling thread,
+     * which returns when all of them are finished. If body throws, chunks
+     * not claimed yet are skipped and the first exception is rethrown to
+     * the caller after the running ones are finished.
+     *
+     * \param[in] begin First index of the range
+     * \param[in] end Index after the last one of the range
+     * \param[in] step Size of a chunk
+     * \param[in] body Function processing indices [chunkBegin, chunkEnd)
+     */
+    void parallelFor(const int begin, const int end, const int step, const std::function<void(int, int)>& body);
+
+    /**
+     * \brief Gives pool shared by default, with a worker per hardware thread.
+     *
+     * \return Default pool.
+     */
+    static ThreadPool& getDefault();
+
+private:
+    void work();
+
+    std::vector<std::thread> workers;
+    std::deque<std::packaged_task<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+};
+
+
+#endif // THREAD_POOL_H
@@ -2,10 +2,14 @@
 #define TIFFIMAGE_H
 
 
+#include <cstring>
+#include <utility>
 #include <tinytiffreader.hxx>
 #include <tinytiffwriter.h>
 #include <tinytiff_tools.hxx>
 #include <opencv2/opencv.hpp>
+#include "aligned_memory.h"
+#include "io_stats.h"
 
 
 /**
@@ -39,9 +43,32 @@ public:
      */
     TiffImage(const TiffImage& other);
 
+    /**
+     * \brief Move constructor. Takes the data buffer leaving other empty.
+     * 
+     * \param[in] other Image to move from
+     */
+    TiffImage(TiffImage&& other) noexcept;
+
     /// Destructor.
     ~TiffImage();
 
+    /**
+     * \brief Copy assignment.
+     * 
+     * \param[in] other Image to copy from
+     * \return Reference to this image.
+     */
+    TiffImage& operator=(const TiffImage& other);
+
+    /**
+     * \brief Move assignment. Takes the data buffer leaving other empty.
+     * 
+     * \param[in] other Image to move from
+     * \return Reference to this image.
+     */
+    TiffImage& operator=(TiffImage&& other) noexcept;
+
     /**
      * \brief Gives image size by specified file name.
      * 
@@ -52,6 +79,16 @@ public:
      */
     static bool getSizeFromFile(const char* fileName, size_t& img_width, size_t& img_height);
 
+    /**
+     * \brief Gives image sample format by specified file name.
+     * 
+     * \param[in] fileName Iamge path
+     * \param[in] sampleFormat Destination variable for TinyTIFF sample format
+     * \param[in] bitsPerSample Destination variable for sample bits number
+     * \return True - if success, false - if failed.
+     */
+    static bool getFormatFromFile(const char* fileName, uint16_t& sampleFormat, uint16_t& bitsPerSample);
+
     /**
      * \brief Reads image from file.
      * 
@@ -101,7 +138,7 @@ public:
      * \param[in] height Image height
      * \return True - if success, false - if failed.
      */
-    static bool save(const char* fileName, T* data, const size_t width, const size_t height);
+    static bool save(const char* fileName, const T* data, const size_t width, const size_t height);
 
     /**
      * \brief Gives access to the image data buffer.
@@ -140,30 +177,64 @@ private:
 
 template<typename T>
 TiffImage<T>::TiffImage(const size_t width_, const size_t height_) :
-    data(new T[width_ * height_]),
+    data(alignedAlloc<T>(width_ * height_)),
     width(width_),
     height(height_) {}
 
 
 template<typename T>
 TiffImage<T>::TiffImage(const TiffImage& other) {
+    *this = other;
+}
+
+
+template<typename T>
+TiffImage<T>::TiffImage(TiffImage&& other) noexcept {
+    *this = std::move(other);
+}
+
+
+template<typename T>
+TiffImage<T>::~TiffImage() {
+    clear();
+}
+
+
+template<typename T>
+TiffImage<T>& TiffImage<T>::operator=(const TiffImage& other) {
+    if (this == &other) {
+        return *this;
+    }
+
+    clear();
+
     if (other.data != nullptr) {
-        width = other.width;
-        height = other.height;
-        data = new T[width * height];
-        memcpy(data, other.data, width * height);
+        resize(other.width, other.height);
+        memcpy(data, other.data, width * height * sizeof(T));
     }
+
+    return *this;
 }
 
 
 template<typename T>
-TiffImage<T>::~TiffImage() {
+TiffImage<T>& TiffImage<T>::operator=(TiffImage&& other) noexcept {
+    if (this == &other) {
+        return *this;
+    }
+
     clear();
+    std::swap(data, other.data);
+    std::swap(width, other.width);
+    std::swap(height, other.height);
+
+    return *this;
 }
 
 
 template<typename T>
 bool TiffImage<T>::getSizeFromFile(const char* fileName, size_t& img_width, size_t& img_height) {
+    IoStats::Timer timer(fileName, IoStats::Stage::Open);
     TinyTIFFReaderFile* tiffr = TinyTIFFReader_open(fileName);
 
     if (!tiffr) {
@@ -178,10 +249,32 @@ bool TiffImage<T>::getSizeFromFile(const char* fileName, size_t& img_width, size
 }
 
 
+template<typename T>
+bool TiffImage<T>::getFormatFromFile(const char* fileName, uint16_t& sampleFormat, uint16_t& bitsPerSample) {
+    IoStats::Timer timer(fileName, IoStats::Stage::Open);
+    TinyTIFFReaderFile* tiffr = TinyTIFFReader_open(fileName);
+
+    if (!tiffr) {
+        return false;
+    }
+
+    sampleFormat = TinyTIFFReader_getSampleFormat(tiffr);
+    bitsPerSample = TinyTIFFReader_getBitsPerSample(tiffr, 0);
+
+    TinyTIFFReader_close(tiffr);
+    return true;
+}
+
+
 template<typename T>
 bool TiffImage<T>::readFromFile(const char* fileName, T* data, size_t& width, size_t& height) {
     // Open image
-    TinyTIFFReaderFile* tiffr = TinyTIFFReader_open(fileName);
+    TinyTIFFReaderFile* tiffr = nullptr;
+
+    {
+        IoStats::Timer openTimer(fileName, IoStats::Stage::Open);
+        tiffr = TinyTIFFReader_open(fileName);
+    }
 
     if (!tiffr) {
         return false;
@@ -191,6 +284,7 @@ bool TiffImage<T>::readFromFile(const char* fileName, T* data, size_t& width, si
     height = TinyTIFFReader_getHeight(tiffr);
     uint16_t sformat = TinyTIFFReader_getSampleFormat(tiffr);
     uint16_t bits = TinyTIFFReader_getBitsPerSample(tiffr, 0);
+    IoStats::Timer readTimer(fileName, IoStats::Stage::Read, width * height * bits / 8);
 
     // Determine the image data type, read it to float type and convert to common range
     switch(sformat) {
@@ -259,10 +353,7 @@ bool TiffImage<T>::readFromFile(const char* fileName, T* data, size_t& width, si
 
 template<typename T>
 void TiffImage<T>::clear() {
-    if (data != nullptr) {
-        delete[] data;
-    }
-
+    alignedFree(data);
     data = nullptr;
     width = 0;
     height = 0;
@@ -274,7 +365,7 @@ void TiffImage<T>::resize(const size_t new_width, const size_t new_height) {
     clear();
     width = new_width;
     height = new_height;
-    data = new T[width * height];
+    data = alignedAlloc<T>(width * height);
 }
 
 
@@ -292,13 +383,20 @@ bool TiffImage<T>::save(const char *fileName) const {
 
 
 template<typename T>
-bool TiffImage<T>::save(const char* fileName, T* data, const size_t width, const size_t height) {
-    TinyTIFFWriterFile* tiff = TinyTIFFWriter_open(fileName, sizeof(T) * 8, TinyTIFF_SampleFormatFromType<T>().format, 1, width, height, TinyTIFFWriter_Greyscale);
+bool TiffImage<T>::save(const char* fileName, const T* data, const size_t width, const size_t height) {
+    TinyTIFFWriterFile* tiff = nullptr;
+
+    {
+        IoStats::Timer openTimer(fileName, IoStats::Stage::Open);
+        tiff = TinyTIFFWriter_open(fileName, sizeof(T) * 8, TinyTIFF_SampleFormatFromType<T>().format, 1, width, height, TinyTIFFWriter_Greyscale);
+    }
 
     if (!tiff) {
         return false;
     }
 
+    IoStats::Timer writeTimer(fileName, IoStats::Stage::Write, width * height * sizeof(T));
+
     TinyTIFFWriter_writeImage(tiff, data);
 
     TinyTIFFWriter_close(tiff);
@@ -0,0 +1,581 @@
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include "io_stats.h"
+#include "raw_file.h"
+#include "tiff_stack.h"
+
+
+const uint16_t TiffStack::formatUInt;
+const uint16_t TiffStack::formatInt;
+const uint16_t TiffStack::formatFloat;
+
+
+/// TIFF tags used by stacks.
+enum Tag : uint16_t {
+    ImageWidth = 256,
+    ImageLength = 257,
+    BitsPerSample = 258,
+    Compression = 259,
+    Photometric = 262,
+    StripOffsets = 273,
+    SamplesPerPixel = 277,
+    RowsPerStrip = 278,
+    StripByteCounts = 279,
+    PlanarConfig = 284,
+    TileWidth = 322,
+    SampleFormat = 339
+};
+
+
+/// TIFF field types used by stacks.
+enum FieldType : uint16_t {
+    Short = 3,
+    Long = 4,
+    Long8 = 16
+};
+
+
+/// Offset of the first directory written by create().
+static const uint64_t firstDirectoryOffset = 16;
+
+/// Alignment of directories and pixel data written by create().
+static const uint64_t blockAlignment = 16;
+
+/// Number of directory entries written by create().
+static const size_t writtenEntriesNum = 11;
+
+
+template<typename T>
+static T readField(const uint8_t* src, const bool swap) {
+    uint8_t bytes[sizeof(T)];
+    memcpy(bytes, src, sizeof(T));
+
+    if (swap) {
+        std::reverse(bytes, bytes + sizeof(T));
+    }
+
+    T value;
+    memcpy(&value, bytes, sizeof(T));
+
+    return value;
+}
+
+
+static uint64_t alignUp(const uint64_t value, const uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+
+static size_t getFieldTypeSize(const uint16_t type) {
+    switch (type) {
+        case 1: case 2: case 6: case 7:
+            return 1;
+        case 3: case 8:
+            return 2;
+        case 4: case 9: case 11: case 13:
+            return 4;
+        case 5: case 10: case 12: case 16: case 17: case 18:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+
+TiffStack::~TiffStack() {
+    close();
+}
+
+
+bool TiffStack::open(const std::string& _fileName) {
+    close();
+    fileName = _fileName;
+    IoStats::Timer timer(fileName.c_str(), IoStats::Stage::Open);
+    fd = ::open(fileName.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        printf("Error: Unable to open stack %s\n", fileName.data());
+        return false;
+    }
+
+    uint8_t header[16];
+
+    if (!readAt(0, header, 8)) {
+        close();
+        return false;
+    }
+
+    if (header[0] != header[1] || (header[0] != 'I' && header[0] != 'M')) {
+        printf("Error: %s is not a TIFF file\n", fileName.data());
+        close();
+        return false;
+    }
+
+    swapBytes = (header[0] == 'I') != RawFile::isHostLittleEndian();
+
+    const uint16_t version = readField<uint16_t>(header + 2, swapBytes);
+    uint64_t offset = 0;
+
+    if (version == 42) {
+        offset = readField<uint32_t>(header + 4, swapBytes);
+        bigTiff = false;
+    }
+    else if (version == 43 && readAt(8, header + 8, 8)) {
+        offset = readField<uint64_t>(header + 8, swapBytes);
+        bigTiff = true;
+    }
+    else {
+        printf("Error: %s is not a TIFF file\n", fileName.data());
+        close();
+        return false;
+    }
+
+    // Directories are walked once, cycles of broken files are cut off
+    std::unordered_set<uint64_t> visited;
+
+    while (offset != 0) {
+        if (!visited.insert(offset).second) {
+            printf("Error: Directories of %s form a cycle\n", fileName.data());
+            close();
+            return false;
+        }
+
+        if (!readDirectory(offset, offset)) {
+            close();
+            return false;
+        }
+    }
+
+    if (pages.empty()) {
+        printf("Error: %s has no pages\n", fileName.data());
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+
+bool TiffStack::create(const std::string& _fileName, const size_t _width, const size_t _height, const size_t pagesNum, const uint16_t _bitsPerSample, const uint16_t _sampleFormat) {
+    close();
+    fileName = _fileName;
+    IoStats::Timer timer(fileName.c_str(), IoStats::Stage::Open);
+    width = _width;
+    height = _height;
+    bitsPerSample = _bitsPerSample;
+    sampleFormat = _sampleFormat;
+    swapBytes = false;
+
+    // Every page is a directory followed by a single strip of samples
+    const uint64_t pageBytes = static_cast<uint64_t>(width) * height * bitsPerSample / 8;
+    const uint64_t classicDirectoryBytes = alignUp(2 + writtenEntriesNum * 12 + 4, blockAlignment);
+    const uint64_t classicFileBytes = firstDirectoryOffset + pagesNum * (classicDirectoryBytes + alignUp(pageBytes, blockAlignment));
+
+    bigTiff = classicFileBytes > UINT32_MAX;
+    directoryBytes = bigTiff ? alignUp(8 + writtenEntriesNum * 20 + 8, blockAlignment) : classicDirectoryBytes;
+    pageStride = directoryBytes + alignUp(pageBytes, blockAlignment);
+    pages.assign(pagesNum, Page());
+
+    for (size_t i = 0; i < pagesNum; ++i) {
+        pages[i].stripOffsets.assign(1, firstDirectoryOffset + i * pageStride + directoryBytes);
+        pages[i].stripBytes.assign(1, pageBytes);
+    }
+
+    fd = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        printf("Error: Unable to create stack %s\n", fileName.data());
+        return false;
+    }
+
+    if (ftruncate(fd, firstDirectoryOffset + pagesNum * pageStride) != 0) {
+        printf("Error: Unable to resize stack %s\n", fileName.data());
+        close();
+        return false;
+    }
+
+    // Values are written in the host byte order, which is marked in the header
+    uint8_t header[firstDirectoryOffset] = {0};
+    header[0] = header[1] = RawFile::isHostLittleEndian() ? 'I' : 'M';
+
+    if (bigTiff) {
+        const uint16_t fields[3] = {43, 8, 0};
+        memcpy(header + 2, fields, sizeof(fields));
+        memcpy(header + 8, &firstDirectoryOffset, 8);
+    }
+    else {
+        const uint16_t version = 42;
+        const uint32_t offset = firstDirectoryOffset;
+        memcpy(header + 2, &version, 2);
+        memcpy(header + 4, &offset, 4);
+    }
+
+    if (!writeAt(0, header, sizeof(header))) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+
+void TiffStack::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+
+    pages.clear();
+    width = 0;
+    height = 0;
+    bitsPerSample = 0;
+    sampleFormat = formatUInt;
+}
+
+
+size_t TiffStack::getPagesNum() const {
+    return pages.size();
+}
+
+
+size_t TiffStack::getWidth() const {
+    return width;
+}
+
+
+size_t TiffStack::getHeight() const {
+    return height;
+}
+
+
+uint16_t TiffStack::getBitsPerSample() const {
+    return bitsPerSample;
+}
+
+
+uint16_t TiffStack::getSampleFormat() const {
+    return sampleFormat;
+}
+
+
+bool TiffStack::isBigTiff() const {
+    return bigTiff;
+}
+
+
+bool TiffStack::writePage(const size_t page, const void* src) const {
+    if (page >= pages.size()) {
+        printf("Error: Page %zu out of stack %s of %zu pages\n", page, fileName.data(), pages.size());
+        return false;
+    }
+
+    IoStats::Timer timer(fileName.c_str(), IoStats::Stage::Write, directoryBytes + pages[page].stripBytes.front());
+    const uint64_t directoryOffset = firstDirectoryOffset + page * pageStride;
+    const uint64_t nextOffset = page + 1 < pages.size() ? directoryOffset + pageStride : 0;
+    const uint64_t values[writtenEntriesNum][2] = {
+        {ImageWidth, width},
+        {ImageLength, height},
+        {BitsPerSample, bitsPerSample},
+        {Compression, 1},
+        {Photometric, 1},
+        {StripOffsets, pages[page].stripOffsets.front()},
+        {SamplesPerPixel, 1},
+        {RowsPerStrip, height},
+        {StripByteCounts, pages[page].stripBytes.front()},
+        {PlanarConfig, 1},
+        {SampleFormat, sampleFormat}
+    };
+
+    std::vector<uint8_t> directory(directoryBytes, 0);
+    const size_t countBytes = bigTiff ? 8 : 2;
+    const size_t entryBytes = bigTiff ? 20 : 12;
+
+    if (bigTiff) {
+        const uint64_t entriesNum = writtenEntriesNum;
+        memcpy(directory.data(), &entriesNum, 8);
+    }
+    else {
+        const uint16_t entriesNum = writtenEntriesNum;
+        memcpy(directory.data(), &entriesNum, 2);
+    }
+
+    for (size_t i = 0; i < writtenEntriesNum; ++i) {
+        uint8_t* entry = directory.data() + countBytes + i * entryBytes;
+        const uint16_t tag = values[i][0];
+        const bool offsetTag = tag == StripOffsets || tag == StripByteCounts;
+        const bool shortTag = tag == BitsPerSample || tag == Compression || tag == Photometric || tag == SamplesPerPixel || tag == PlanarConfig || tag == SampleFormat;
+        const uint16_t type = shortTag ? Short : (offsetTag && bigTiff ? Long8 : Long);
+        memcpy(entry, &tag, 2);
+        memcpy(entry + 2, &type, 2);
+
+        // Values are left-justified in the value field
+        uint8_t* valueField = entry + (bigTiff ? 12 : 8);
+
+        if (bigTiff) {
+            const uint64_t count = 1;
+            memcpy(entry + 4, &count, 8);
+        }
+        else {
+            const uint32_t count = 1;
+            memcpy(entry + 4, &count, 4);
+        }
+
+        if (type == Short) {
+            const uint16_t value = values[i][1];
+            memcpy(valueField, &value, 2);
+        }
+        else if (type == Long) {
+            const uint32_t value = values[i][1];
+            memcpy(valueField, &value, 4);
+        }
+        else {
+            memcpy(valueField, &values[i][1], 8);
+        }
+    }
+
+    uint8_t* nextField = directory.data() + countBytes + writtenEntriesNum * entryBytes;
+
+    if (bigTiff) {
+        memcpy(nextField, &nextOffset, 8);
+    }
+    else {
+        const uint32_t next = nextOffset;
+        memcpy(nextField, &next, 4);
+    }
+
+    return writeAt(directoryOffset, directory.data(), directory.size()) &&
+           writeAt(pages[page].stripOffsets.front(), src, pages[page].stripBytes.front());
+}
+
+
+bool TiffStack::readPageSamples(const size_t page, void* dst) const {
+    if (page >= pages.size()) {
+        printf("Error: Page %zu out of stack %s of %zu pages\n", page, fileName.data(), pages.size());
+        return false;
+    }
+
+    const size_t sampleBytes = bitsPerSample / 8;
+    const size_t bytes = width * height * sampleBytes;
+    const Page& info = pages[page];
+    IoStats::Timer timer(fileName.c_str(), IoStats::Stage::Read, bytes);
+    size_t pos = 0;
+
+    // Strips follow each other in the page, the last one might be padded
+    for (size_t i = 0; i < info.stripOffsets.size() && pos < bytes; ++i) {
+        const size_t stripBytes = std::min<uint64_t>(info.stripBytes[i], bytes - pos);
+
+        if (!readAt(info.stripOffsets[i], static_cast<uint8_t*>(dst) + pos, stripBytes)) {
+            return false;
+        }
+
+        pos += stripBytes;
+    }
+
+    if (pos < bytes) {
+        printf("Error: Page %zu of stack %s is truncated\n", page, fileName.data());
+        return false;
+    }
+
+    if (swapBytes && sampleBytes > 1) {
+        RawFile::swapBytes(dst, width * height, sampleBytes);
+    }
+
+    return true;
+}
+
+
+bool TiffStack::readDirectory(const uint64_t offset, uint64_t& nextOffset) {
+    const size_t countBytes = bigTiff ? 8 : 2;
+    const size_t entryBytes = bigTiff ? 20 : 12;
+    const size_t offsetBytes = bigTiff ? 8 : 4;
+    uint8_t countField[8];
+
+    if (!readAt(offset, countField, countBytes)) {
+        return false;
+    }
+
+    const uint64_t entriesNum = bigTiff ? readField<uint64_t>(countField, swapBytes) : readField<uint16_t>(countField, swapBytes);
+
+    // Entries and the next directory offset are read at once
+    std::vector<uint8_t> entries(entriesNum * entryBytes + offsetBytes);
+
+    if (!readAt(offset + countBytes, entries.data(), entries.size())) {
+        return false;
+    }
+
+    size_t pageWidth = 0;
+    size_t pageHeight = 0;
+    uint16_t pageBits = 1;
+    uint16_t pageFormat = formatUInt;
+    uint64_t compression = 1;
+    uint64_t samplesPerPixel = 1;
+    bool tiled = false;
+    Page page;
+    std::vector<uint64_t> values;
+
+    for (size_t i = 0; i < entriesNum; ++i) {
+        const uint8_t* entry = entries.data() + i * entryBytes;
+        const uint16_t tag = readField<uint16_t>(entry, swapBytes);
+
+        if (tag != ImageWidth && tag != ImageLength && tag != BitsPerSample && tag != Compression &&
+            tag != StripOffsets && tag != SamplesPerPixel && tag != StripByteCounts && tag != TileWidth && tag != SampleFormat) {
+            continue;
+        }
+
+        if (!readTagValues(entry, values)) {
+            return false;
+        }
+
+        switch (tag) {
+            case ImageWidth:
+                pageWidth = values.front();
+                break;
+            case ImageLength:
+                pageHeight = values.front();
+                break;
+            case BitsPerSample:
+                pageBits = values.front();
+                break;
+            case Compression:
+                compression = values.front();
+                break;
+            case StripOffsets:
+                page.stripOffsets = values;
+                break;
+            case SamplesPerPixel:
+                samplesPerPixel = values.front();
+                break;
+            case StripByteCounts:
+                page.stripBytes = values;
+                break;
+            case TileWidth:
+                tiled = true;
+                break;
+            case SampleFormat:
+                pageFormat = values.front();
+                break;
+        }
+    }
+
+    const uint8_t* nextField = entries.data() + entriesNum * entryBytes;
+    nextOffset = bigTiff ? readField<uint64_t>(nextField, swapBytes) : readField<uint32_t>(nextField, swapBytes);
+
+    if (compression != 1 || samplesPerPixel != 1 || tiled) {
+        printf("Error: Page %zu of stack %s is not an uncompressed single-channel image in strips\n", pages.size(), fileName.data());
+        return false;
+    }
+
+    if (page.stripOffsets.empty() || page.stripOffsets.size() != page.stripBytes.size()) {
+        printf("Error: Page %zu of stack %s has broken strips\n", pages.size(), fileName.data());
+        return false;
+    }
+
+    const bool supported = (pageFormat == formatFloat && (pageBits == 32 || pageBits == 64)) ||
+                           ((pageFormat == formatUInt || pageFormat == formatInt) && (pageBits == 8 || pageBits == 16 || pageBits == 32));
+
+    if (!supported) {
+        printf("Error: Unsupported %u-bit samples of format %u in %s\n", pageBits, pageFormat, fileName.data());
+        return false;
+    }
+
+    // Stack pages must share size and format
+    if (pages.empty()) {
+        width = pageWidth;
+        height = pageHeight;
+        bitsPerSample = pageBits;
+        sampleFormat = pageFormat;
+    }
+    else if (pageWidth != width || pageHeight != height || pageBits != bitsPerSample || pageFormat != sampleFormat) {
+        printf("Error: Page %zu of stack %s differs from the first one\n", pages.size(), fileName.data());
+        return false;
+    }
+
+    pages.push_back(std::move(page));
+
+    return true;
+}
+
+
+bool TiffStack::readTagValues(const uint8_t* entry, std::vector<uint64_t>& values) const {
+    const uint16_t type = readField<uint16_t>(entry + 2, swapBytes);
+    const uint64_t count = bigTiff ? readField<uint64_t>(entry + 4, swapBytes) : readField<uint32_t>(entry + 4, swapBytes);
+    const size_t typeSize = getFieldTypeSize(type);
+
+    if ((type != Short && type != Long && type != Long8) || count == 0) {
+        printf("Error: Unexpected field of type %u in stack %s\n", type, fileName.data());
+        return false;
+    }
+
+    // Values fitting into the value field are stored in place
+    const size_t fieldBytes = bigTiff ? 8 : 4;
+    const uint8_t* valueField = entry + (bigTiff ? 12 : 8);
+    std::vector<uint8_t> raw(count * typeSize);
+
+    if (raw.size() <= fieldBytes) {
+        memcpy(raw.data(), valueField, raw.size());
+    }
+    else {
+        const uint64_t offset = bigTiff ? readField<uint64_t>(valueField, swapBytes) : readField<uint32_t>(valueField, swapBytes);
+
+        if (!readAt(offset, raw.data(), raw.size())) {
+            return false;
+        }
+    }
+
+    values.resize(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* value = raw.data() + i * typeSize;
+
+        if (type == Short) {
+            values[i] = readField<uint16_t>(value, swapBytes);
+        }
+        else if (type == Long) {
+            values[i] = readField<uint32_t>(value, swapBytes);
+        }
+        else {
+            values[i] = readField<uint64_t>(value, swapBytes);
+        }
+    }
+
+    return true;
+}
+
+
+bool TiffStack::readAt(const uint64_t offset, void* dst, const size_t bytes) const {
+    size_t done = 0;
+
+    while (done < bytes) {
+        const ssize_t n = pread(fd, static_cast<uint8_t*>(dst) + done, bytes - done, offset + done);
+
+        if (n <= 0) {
+            printf("Error: Unable to read %zu bytes at %llu from %s\n", bytes, static_cast<unsigned long long>(offset), fileName.data());
+            return false;
+        }
+
+        done += n;
+    }
+
+    return true;
+}
+
+
+bool TiffStack::writeAt(const uint64_t offset, const void* src, const size_t bytes) const {
+    size_t done = 0;
+
+    while (done < bytes) {
+        const ssize_t n = pwrite(fd, static_cast<const uint8_t*>(src) + done, bytes - done, offset + done);
+
+        if (n <= 0) {
+            printf("Error: Unable to write %zu bytes at %llu to %s\n", bytes, static_cast<unsigned long long>(offset), fileName.data());
+            return false;
+        }
+
+        done += n;
+    }
+
+    return true;
+}
@@ -0,0 +1,238 @@
+#ifndef TIFF_STACK_H
+#define TIFF_STACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+/**
+ * \brief Volume stored as pages of a single multi-page TIFF file.
+ *
+ * open() walks the chain of image directories once and indexes offsets of
+ * every page, so any page is read later by seeking straight to its strips.
+ * Both classic TIFF and BigTIFF files of any byte order are read, pages must
+ * be uncompressed single-channel images.
+ *
+ * create() lays out pages of fixed size up front and writePage() writes each
+ * of them at its own place, so pages may be written in any order and from
+ * several threads. Files over 4 GB are written as BigTIFF.
+ */
+class TiffStack {
+public:
+    /// SampleFormat tag value of unsigned integers.
+    static const uint16_t formatUInt = 1;
+
+    /// SampleFormat tag value of signed integers.
+    static const uint16_t formatInt = 2;
+
+    /// SampleFormat tag value of floating point numbers.
+    static const uint16_t formatFloat = 3;
+
+    /// Default constructor. Creates an instance without a file.
+    TiffStack() = default;
+
+    TiffStack(const TiffStack&) = delete;
+    TiffStack& operator=(const TiffStack&) = delete;
+
+    /// Destructor. Closes the file.
+    ~TiffStack();
+
+    /**
+     * \brief Opens existing stack and indexes its pages.
+     *
+     * \param[in] fileName Path to the TIFF file
+     * \return True - if success, false - if failed.
+     */
+    bool open(const std::string& fileName);
+
+    /**
+     * \brief Creates stack of pages with the given size and format.
+     *
+     * Pages are zero-filled until written.
+     *
+     * \param[in] fileName Path to the TIFF file
+     * \param[in] _width Page width
+     * \param[in] _height Page height
+     * \param[in] pagesNum Number of pages
+     * \param[in] _bitsPerSample Bits of a sample, 8, 16, 32 or 64
+     * \param[in] _sampleFormat SampleFormat tag value of samples
+     * \return True - if success, false - if failed.
+     */
+    bool create(const std::string& fileName, const size_t _width, const size_t _height, const size_t pagesNum, const uint16_t _bitsPerSample, const uint16_t _sampleFormat);
+
+    /// Closes the file.
+    void close();
+
+    /**
+     * \brief Gives number of pages.
+     *
+     * \return Number of pages.
+     */
+    size_t getPagesNum() const;
+
+    /**
+     * \brief Gives width of pages.
+     *
+     * \return Page width.
+     */
+    size_t getWidth() const;
+
+    /**
+     * \brief Gives height of pages.
+     *
+     * \return Page height.
+     */
+    size_t getHeight() const;
+
+    /**
+     * \brief Gives bits of a sample.
+     *
+     * \return Bits per sample.
+     */
+    uint16_t getBitsPerSample() const;
+
+    /**
+     * \brief Gives format of samples.
+     *
+     * \return SampleFormat tag value.
+     */
+    uint16_t getSampleFormat() const;
+
+    /**
+     * \brief Checks if the file is BigTIFF.
+     *
+     * \return True - if BigTIFF, false - if classic TIFF.
+     */
+    bool isBigTiff() const;
+
+    /**
+     * \brief Reads page converting samples to T.
+     *
+     * Safe to call from several threads at once.
+     *
+     * \param[in] page Index of the page
+     * \param[out] dst Buffer of getWidth() * getHeight() values
+     * \return True - if success, false - if failed.
+     */
+    template<typename T>
+    bool readPage(const size_t page, T* dst) const;
+
+    /**
+     * \brief Writes page of samples in the format given to create().
+     *
+     * Safe to call from several threads at once for different pages.
+     *
+     * \param[in] page Index of the page
+     * \param[in] src Buffer of getWidth() * getHeight() samples
+     * \return True - if success, false - if failed.
+     */
+    bool writePage(const size_t page, const void* src) const;
+
+    /**
+     * \brief Gives SampleFormat tag value of the type.
+     *
+     * \return SampleFormat tag value.
+     */
+    template<typename T>
+    static uint16_t getFormatOf();
+
+private:
+    struct Page {
+        std::vector<uint64_t> stripOffsets;
+        std::vector<uint64_t> stripBytes;
+    };
+
+    bool readPageSamples(const size_t page, void* dst) const;
+    bool readDirectory(const uint64_t offset, uint64_t& nextOffset);
+    bool readTagValues(const uint8_t* entry, std::vector<uint64_t>& values) const;
+    bool readAt(const uint64_t offset, void* dst, const size_t bytes) const;
+    bool writeAt(const uint64_t offset, const void* src, const size_t bytes) const;
+    template<typename S, typename T>
+    static void convertSamples(const S* src, T* dst, const size_t count);
+
+    int fd = -1;
+    std::string fileName;
+    bool bigTiff = false;
+    bool swapBytes = false;
+    size_t width = 0;
+    size_t height = 0;
+    uint16_t bitsPerSample = 0;
+    uint16_t sampleFormat = formatUInt;
+    std::vector<Page> pages;
+    uint64_t pageStride = 0;
+    uint64_t directoryBytes = 0;
+};
+
+
+template<typename T>
+bool TiffStack::readPage(const size_t page, T* dst) const {
+    const size_t count = width * height;
+
+    // Samples already of the requested type are read in place
+    if (bitsPerSample == 8 * sizeof(T) && sampleFormat == getFormatOf<T>()) {
+        return readPageSamples(page, dst);
+    }
+
+    std::vector<uint64_t> samples((count * bitsPerSample / 8 + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+
+    if (!readPageSamples(page, samples.data())) {
+        return false;
+    }
+
+    const void* src = samples.data();
+
+    switch (sampleFormat * 100 + bitsPerSample) {
+        case formatUInt * 100 + 8:
+            convertSamples(static_cast<const uint8_t*>(src), dst, count);
+            return true;
+        case formatUInt * 100 + 16:
+            convertSamples(static_cast<const uint16_t*>(src), dst, count);
+            return true;
+        case formatUInt * 100 + 32:
+            convertSamples(static_cast<const uint32_t*>(src), dst, count);
+            return true;
+        case formatInt * 100 + 8:
+            convertSamples(static_cast<const int8_t*>(src), dst, count);
+            return true;
+        case formatInt * 100 + 16:
+            convertSamples(static_cast<const int16_t*>(src), dst, count);
+            return true;
+        case formatInt * 100 + 32:
+            convertSamples(static_cast<const int32_t*>(src), dst, count);
+            return true;
+        case formatFloat * 100 + 32:
+            convertSamples(static_cast<const float*>(src), dst, count);
+            return true;
+        case formatFloat * 100 + 64:
+            convertSamples(static_cast<const double*>(src), dst, count);
+            return true;
+        default:
+            printf("Error: Unsupported %u-bit samples of format %u in %s\n", bitsPerSample, sampleFormat, fileName.data());
+            return false;
+    }
+}
+
+
+template<typename T>
+uint16_t TiffStack::getFormatOf() {
+    if (std::is_floating_point<T>::value) {
+        return formatFloat;
+    }
+
+    return std::is_signed<T>::value ? formatInt : formatUInt;
+}
+
+
+template<typename S, typename T>
+void TiffStack::convertSamples(const S* src, T* dst, const size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = static_cast<T>(src[i]);
+    }
+}
+
+
+#endif // TIFF_STACK_H
@@ -0,0 +1,125 @@
+#include "volume_stats.h"
+
+
+void VolumeStats::reset(const size_t layersNum) {
+    histogram.clear();
+    layerMeans.assign(layersNum, 0);
+    layerVariances.assign(layersNum, 0);
+    count = 0;
+    min = 0;
+    max = 0;
+    integerBins = false;
+}
+
+
+void VolumeStats::merge(const VolumeStats& other) {
+    if (other.count == 0) {
+        return;
+    }
+
+    // Bins of integer and float values are incompatible, keep only the range
+    if (count > 0 && integerBins != other.integerBins) {
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        return;
+    }
+
+    if (count == 0) {
+        histogram = other.histogram;
+        min = other.min;
+        max = other.max;
+    }
+    else {
+        for (size_t bin = 0; bin < binsNum; ++bin) {
+            histogram[bin] += other.histogram[bin];
+        }
+
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    integerBins = other.integerBins;
+    count += other.count;
+}
+
+
+void VolumeStats::merge(const VolumeStats& other, const int zBegin, const int zEnd) {
+    merge(other);
+
+    for (int z = zBegin; z < zEnd; ++z) {
+        layerMeans[z] = other.layerMeans[z];
+        layerVariances[z] = other.layerVariances[z];
+    }
+}
+
+
+bool VolumeStats::isEmpty() const {
+    return count == 0;
+}
+
+
+float VolumeStats::getMin() const {
+    return min;
+}
+
+
+float VolumeStats::getMax() const {
+    return max;
+}
+
+
+float VolumeStats::getPercentile(const float fraction) const {
+    if (count == 0) {
+        return 0;
+    }
+
+    const uint64_t rank = std::min(static_cast<uint64_t>(std::max(fraction, 0.0f) * count), count - 1);
+    uint64_t passed = 0;
+    size_t bin = 0;
+
+    for (; bin < binsNum; ++bin) {
+        passed += histogram[bin];
+
+        if (passed > rank) {
+            break;
+        }
+    }
+
+    // Float bins are represented by their middle value
+    const float val = integerBins ? bin : keyFloat((static_cast<uint32_t>(bin) << 16) | 0x8000);
+
+    return std::min(std::max(val, min), max);
+}
+
+
+float VolumeStats::getLayerMean(const int z) const {
+    return layerMeans.at(z);
+}
+
+
+float VolumeStats::getLayerVariance(const int z) const {
+    return layerVariances.at(z);
+}
+
+
+const std::vector<uint64_t>& VolumeStats::getHistogram() const {
+    return histogram;
+}
+
+
+uint32_t VolumeStats::floatKey(const float val) {
+    uint32_t bits = 0;
+    memcpy(&bits, &val, sizeof(bits));
+
+    // Flip negative values entirely and positive ones by sign, so keys sort as values
+    return (bits & 0x80000000) ? ~bits : bits | 0x80000000;
+}
+
+
+float VolumeStats::keyFloat(const uint32_t key) {
+    const uint32_t bits = (key & 0x80000000) ? key & 0x7fffffff : ~key;
+    float val = 0;
+    memcpy(&val, &bits, sizeof(val));
+
+    return val;
+}
@@ -0,0 +1,203 @@
+#ifndef VOLUME_STATS_H
+#define VOLUME_STATS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+
+/**
+ * \brief Statistics of voxel values collected layer by layer.
+ *
+ * Keeps the exact minimum and maximum, a histogram of all values and the mean
+ * and variance of every layer. Integer samples (8 and 16 bits) get one bin
+ * per value, so their percentiles are exact. Float values are binned by the
+ * high 16 bits of their order preserving bit pattern, which keeps about 1%
+ * relative precision over the whole float range without knowing it in
+ * advance. Layers are collected independently, so statistics can be gathered
+ * in the same pass that reads them.
+ */
+class VolumeStats {
+public:
+    /// Number of histogram bins.
+    static const size_t binsNum = 1 << 16;
+
+    /**
+     * \brief Clears statistics and prepares them for the given number of layers.
+     *
+     * \param[in] layersNum Number of layers
+     */
+    void reset(const size_t layersNum);
+
+    /**
+     * \brief Adds values of one layer.
+     *
+     * Different layers may be added in any order, but each only once.
+     *
+     * \param[in] z Index of the layer
+     * \param[in] values Layer values
+     * \param[in] valuesNum Number of values
+     */
+    template<typename S>
+    void addLayer(const int z, const S* values, const size_t valuesNum);
+
+    /**
+     * \brief Adds histogram and range of other statistics.
+     *
+     * Per-layer moments are not merged, as layers of different volumes
+     * share indices.
+     *
+     * \param[in] other Statistics of the same sample kind
+     */
+    void merge(const VolumeStats& other);
+
+    /**
+     * \brief Adds statistics of layers collected separately from the same volume.
+     *
+     * Unlike merge() moments of the layers are taken too, so a volume can
+     * be split into bands gathered in parallel.
+     *
+     * \param[in] other Statistics reset to the same number of layers
+     * \param[in] zBegin First layer added to other
+     * \param[in] zEnd Layer after the last one added to other
+     */
+    void merge(const VolumeStats& other, const int zBegin, const int zEnd);
+
+    /**
+     * \brief Checks if no values were added.
+     *
+     * \return True - if empty, false - if not.
+     */
+    bool isEmpty() const;
+
+    /**
+     * \brief Gives the smallest value.
+     *
+     * \return Minimum value.
+     */
+    float getMin() const;
+
+    /**
+     * \brief Gives the largest value.
+     *
+     * \return Maximum value.
+     */
+    float getMax() const;
+
+    /**
+     * \brief Gives value below which the given fraction of values lies.
+     *
+     * Use fractions slightly inside [0, 1] (like 0.001 and 0.999) to get a
+     * display window insensitive to hot pixels.
+     *
+     * \param[in] fraction Fraction of values in [0, 1]
+     * \return Percentile value.
+     */
+    float getPercentile(const float fraction) const;
+
+    /**
+     * \brief Gives mean value of the layer.
+     *
+     * \param[in] z Index of the layer
+     * \return Mean value.
+     */
+    float getLayerMean(const int z) const;
+
+    /**
+     * \brief Gives variance of values of the layer.
+     *
+     * \param[in] z Index of the layer
+     * \return Variance.
+     */
+    float getLayerVariance(const int z) const;
+
+    /**
+     * \brief Gives histogram of all values.
+     *
+     * \return Number of values in each bin.
+     */
+    const std::vector<uint64_t>& getHistogram() const;
+
+private:
+    static uint32_t floatKey(const float val);
+    static float keyFloat(const uint32_t key);
+
+    size_t binOf(const uint8_t val) const { return val; }
+    size_t binOf(const uint16_t val) const { return val; }
+    size_t binOf(const float val) const { return floatKey(val) >> 16; }
+
+    std::vector<uint64_t> histogram;
+    std::vector<float> layerMeans;
+    std::vector<float> layerVariances;
+    uint64_t count = 0;
+    float min = 0;
+    float max = 0;
+    bool integerBins = false;
+};
+
+
+template<typename S>
+void VolumeStats::addLayer(const int z, const S* values, const size_t valuesNum) {
+    if (histogram.empty()) {
+        histogram.assign(binsNum, 0);
+    }
+
+    integerBins = std::is_integral<S>::value;
+
+    double sum = 0;
+    double squares = 0;
+    size_t valid = 0;
+    float layerMin = 0;
+    float layerMax = 0;
+
+    for (size_t i = 0; i < valuesNum; ++i) {
+        const float val = values[i];
+
+        // NaN values are skipped
+        if (val != val) {
+            continue;
+        }
+
+        if (valid == 0) {
+            layerMin = val;
+            layerMax = val;
+        }
+        else if (val < layerMin) {
+            layerMin = val;
+        }
+        else if (val > layerMax) {
+            layerMax = val;
+        }
+
+        ++histogram[binOf(values[i])];
+        sum += val;
+        squares += static_cast<double>(val) * val;
+        ++valid;
+    }
+
+    if (valid == 0) {
+        return;
+    }
+
+    if (z >= 0 && z < static_cast<int>(layerMeans.size())) {
+        const double mean = sum / valid;
+        layerMeans[z] = mean;
+        layerVariances[z] = squares / valid - mean * mean;
+    }
+
+    if (count == 0) {
+        min = layerMin;
+        max = layerMax;
+    }
+    else {
+        min = std::min(min, layerMin);
+        max = std::max(max, layerMax);
+    }
+
+    count += valid;
+}
+
+
+#endif // VOLUME_STATS_H
@@ -1,13 +1,116 @@
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <limits>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <nlohmann/json.hpp>
+#include "io_stats.h"
 #include "voxel_container.h"
 
 using json = nlohmann::json;
 
 
+const size_t VoxelContainer::brickShift;
+const size_t VoxelContainer::brickSize;
+const int VoxelContainer::saveWritersNum;
+const int VoxelContainer::saveQueueLength;
+
+
+/// Number of voxels in a brick.
+static const size_t brickVolume = VoxelContainer::brickSize * VoxelContainer::brickSize * VoxelContainer::brickSize;
+
+/// Approximate size of a single request to raw data files.
+static const size_t rawChunkBytes = 16 << 20;
+
+
+static const char* getSampleTypeName(const VoxelContainer::SampleType type) {
+    switch (type) {
+        case VoxelContainer::SampleType::UInt8:
+            return "uint8";
+        case VoxelContainer::SampleType::UInt16:
+            return "uint16";
+        case VoxelContainer::SampleType::Float16:
+            return "float16";
+        default:
+            return "float32";
+    }
+}
+
+
+static bool getSampleTypeByName(const std::string& name, VoxelContainer::SampleType& type) {
+    for (auto candidate : {VoxelContainer::SampleType::Float32, VoxelContainer::SampleType::UInt8, VoxelContainer::SampleType::UInt16, VoxelContainer::SampleType::Float16}) {
+        if (name == getSampleTypeName(candidate)) {
+            type = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+size_t VoxelContainer::getSampleSize(const SampleType type) {
+    switch (type) {
+        case VoxelContainer::SampleType::UInt8:
+            return sizeof(uint8_t);
+        case VoxelContainer::SampleType::UInt16:
+            return sizeof(uint16_t);
+        case VoxelContainer::SampleType::Float16:
+            return sizeof(half);
+        default:
+            return sizeof(float);
+    }
+}
+
+
+template<typename S>
+static void storeSamples(const S* src, void* dst, const size_t count, const VoxelContainer::SampleType dstType) {
+    switch (dstType) {
+        case VoxelContainer::SampleType::Float32:
+            std::transform(src, src + count, static_cast<float*>(dst), toSample<float>);
+            break;
+        case VoxelContainer::SampleType::UInt8:
+            std::transform(src, src + count, static_cast<uint8_t*>(dst), toSample<uint8_t>);
+            break;
+        case VoxelContainer::SampleType::UInt16:
+            std::transform(src, src + count, static_cast<uint16_t*>(dst), toSample<uint16_t>);
+            break;
+        case VoxelContainer::SampleType::Float16:
+            std::transform(src, src + count, static_cast<half*>(dst), toSample<half>);
+            break;
+    }
+}
+
+
+void VoxelContainer::convertSamples(const void* src, const SampleType srcType, void* dst, const size_t count, const SampleType dstType) {
+    switch (srcType) {
+        case VoxelContainer::SampleType::Float32:
+            storeSamples(static_cast<const float*>(src), dst, count, dstType);
+            break;
+        case VoxelContainer::SampleType::UInt8:
+            storeSamples(static_cast<const uint8_t*>(src), dst, count, dstType);
+            break;
+        case VoxelContainer::SampleType::UInt16:
+            storeSamples(static_cast<const uint16_t*>(src), dst, count, dstType);
+            break;
+        case VoxelContainer::SampleType::Float16:
+            storeSamples(static_cast<const half*>(src), dst, count, dstType);
+            break;
+    }
+}
+
+
 size_t VoxelContainer::Vector3::volume() const {
     return x * y * z;
 }
@@ -18,6 +121,27 @@ float VoxelContainer::Range::fit(float val, const Range nr) const {
 }
 
 
+VoxelContainer::StitchParams VoxelContainer::StitchParams::fromOffsets(const float x, const float y, const float z) {
+    const int wholeX = std::lround(x);
+    const int wholeY = std::lround(y);
+    const int wholeZ = std::lround(z);
+
+    return {wholeX, wholeY, wholeZ, x - wholeX, y - wholeY, z - wholeZ};
+}
+
+
+bool VoxelContainer::StitchParams::isWhole() const {
+    return fractionX == 0 && fractionY == 0 && fractionZ == 0;
+}
+
+
+VoxelContainer::StitchParams VoxelContainer::StitchParams::operator+(const StitchParams& other) const {
+    const StitchParams fractions = fromOffsets(fractionX + other.fractionX, fractionY + other.fractionY, fractionZ + other.fractionZ);
+
+    return {offsetX + other.offsetX + fractions.offsetX, offsetY + other.offsetY + fractions.offsetY, offsetZ + other.offsetZ + fractions.offsetZ, fractions.fractionX, fractions.fractionY, fractions.fractionZ};
+}
+
+
 VoxelContainer::VoxelContainer(const std::vector<std::string>& fileNames) {
     loadFromImages(fileNames);
 }
@@ -31,9 +155,15 @@ VoxelContainer::VoxelContainer(float* _data, const Vector3& _size, const Range&
 
 
 VoxelContainer::VoxelContainer(const Vector3& _size, const Range& _range) :
-    data(new float[_size.volume()]),
     size(_size),
-    range(_range) {}
+    range(_range) {
+    allocate();
+}
+
+
+VoxelContainer::VoxelContainer(VoxelContainer&& other) noexcept {
+    *this = std::move(other);
+}
 
 
 VoxelContainer::~VoxelContainer() {
@@ -41,226 +171,2190 @@ VoxelContainer::~VoxelContainer() {
 }
 
 
+VoxelContainer& VoxelContainer::operator=(VoxelContainer&& other) noexcept {
+    if (this == &other) {
+        return *this;
+    }
+
+    clear();
+
+    data = other.data;
+    bricks = std::move(other.bricks);
+    sampleType = other.sampleType;
+    storage = other.storage;
+    layout = other.layout;
+    threadPool = other.threadPool;
+    directIo = other.directIo;
+    mappedFileName = std::move(other.mappedFileName);
+    sourceName = std::move(other.sourceName);
+    mappedBytes = other.mappedBytes;
+    capacity = other.capacity;
+    size = other.size;
+    fullSize = other.fullSize;
+    origin = other.origin;
+    previewScale = other.previewScale;
+    range = other.range;
+    referenceParams = other.referenceParams;
+    estimatedParams = other.estimatedParams;
+    stats = std::move(other.stats);
+
+    other.data = nullptr;
+    other.mappedBytes = 0;
+    other.capacity = 0;
+    other.size = {0, 0, 0};
+    other.range = {0, 0};
+
+    return *this;
+}
+
+
 bool VoxelContainer::loadFromImages(const std::vector<std::string>& fileNames) {
     clear();
-    
-    if (!TiffImage<float>::getSizeFromFile(fileNames.front().data(), size.x, size.y)) {
-        return false;
-    }
 
-    size.z = fileNames.size();
+    LayerReader readLayer;
 
-    readImages(fileNames);
+    if (!openImageFiles(fileNames, readLayer)) {
+        return false;
+    }
 
-    auto rng = std::minmax_element(data, data + size.volume());
-    range = {*rng.first, *rng.second};
+    if (!readImages(readLayer, &range)) {
+        return false;
+    }
     printf("Range: %f, %f\n", range.min, range.max);
 
     return true;
 }
 
 
-bool VoxelContainer::loadFromJson(const std::string& fileName) {
-    // Open parameters file
-    std::ifstream fs(fileName);
-    if(!fs) {
-        printf("%s %s\n", "Unable to open file", fileName.data());
+bool VoxelContainer::loadFromImages(const std::vector<std::string>& fileNames, const Vector3& regionOrigin, const Vector3& regionSize) {
+    clear();
+
+    VolumeFiles files;
+
+    if (!openImageFiles(fileNames, files.readLayer)) {
         return false;
     }
 
-    // Parse JSON parameters
-    json data = json::parse(fs, nullptr, false);
-    if (data.is_discarded()) {
-        printf("Parse error");
+    return readVolumeRegion(files, regionOrigin, regionSize, &range);
+}
+
+
+bool VoxelContainer::openImageFiles(const std::vector<std::string>& fileNames, LayerReader& readLayer) {
+    sourceName = fileNames.front();
+
+    if (fileNames.size() == 1) {
+        // Single file is a stack of layers
+        return openStack(fileNames.front(), size, readLayer);
+    }
+
+    if (!TiffImage<float>::getSizeFromFile(fileNames.front().data(), size.x, size.y)) {
         return false;
     }
 
-    size.x = data["width"].get<int>();
-    size.y = data["depth"].get<int>();
-    size.z = data["height"].get<int>();
-    range.min = data["range_min"].get<float>();
-    range.max = data["range_max"].get<float>();
-    std::string format = data["format"].get<std::string>();
+    size.z = fileNames.size();
 
-    if (data.contains("part_begin")) {
-        referenceParams.offsetZ = data["part_begin"].get<int>();
-        referenceParams.offsetX = data["offset_y"].get<float>() * size.x / 2;
-        referenceParams.offsetY = data["offset_x"].get<float>() * size.y / 2;
+    return openImages(fileNames, readLayer);
+}
+
+
+bool VoxelContainer::loadFromJson(const std::string& fileName) {
+    return loadFromJson(fileName, {});
+}
+
+
+bool VoxelContainer::loadFromJson(const std::string& fileName, const std::vector<const VoxelContainer*>& loadedBands) {
+    clear();
+
+    VolumeFiles files;
+
+    if (!readInfo(fileName, files)) {
+        return false;
     }
-    // else {
-    //     printf("Warning: reconstruction info doesn't contain distortions parameters.\n");
-    // }
 
-    std::string imgPath = fileName.substr(0, fileName.find_last_of('/') + 1);
-    std::vector<std::string> imgNames;
+    // Compressed chunks become bricks as they are accessed
+    if (files.loadBricks && storage == Storage::Compressed) {
+        if (!allocate()) {
+            return false;
+        }
 
-    // Create image files list
-    for (int i = 0; i < size.z; ++i) {
-        imgNames.push_back(imgPath + std::to_string(i) + format);
+        bricks->setLoader(files.loadBricks);
+        stats.reset(0);
+
+        return true;
     }
 
-    return readImages(imgNames);
-}
+    // Reuse voxels decoded by the previous load
+    std::string imgPath = fileName.substr(0, fileName.find_last_of('/') + 1);
+    std::string cacheFileName = imgPath + "voxels";
 
+    if (layout == Layout::Bricked) {
+        cacheFileName += "_bricked";
+    }
 
-bool VoxelContainer::saveToJson(const std::string& dirName) {
-    json data;
-    data["width"] = size.x;
-    data["depth"] = size.y;
-    data["height"] = size.z;
-    data["range_min"] = range.min;
-    data["range_max"] = range.max;
-    data["format"] = ".tiff";
+    cacheFileName += std::string("_") + getSampleTypeName(sampleType) + ".cache";
 
-    mkdir(dirName.c_str(), ACCESSPERMS);
+    const bool cached = storage == Storage::Mapped && mappedFileName.empty();
+    const std::string stamp = cached ? getCacheStamp(fileName, files.sourceNames) : "";
 
-    std::string fileName = dirName;
-    
-    if (dirName.back() == '/') {
-        fileName += "info.json";
+    if (!stamp.empty() && mapCache(cacheFileName, stamp)) {
+        return true;
     }
-    else {
-        fileName += "/info.json";
+
+    // Voxels are decoded into a temporary file next to the cache, none if the directory isn't writable
+    std::string tmpFileName = stamp.empty() ? "" : cacheFileName;
+
+    if (!allocate(tmpFileName.empty() ? nullptr : &tmpFileName)) {
+        return false;
     }
 
-    std::ofstream fs(fileName);
-    
-    if (!fs.is_open()) {
+    reuseBands(files, loadedBands);
+
+    if (!readVolumeRegion(files, {0, 0, 0}, size)) {
+        if (!tmpFileName.empty()) {
+            unlink(tmpFileName.c_str());
+        }
+
         return false;
     }
 
-    fs << data.dump(4) << std::endl;
+    if (!tmpFileName.empty()) {
+        return commitCache(tmpFileName, cacheFileName, stamp);
+    }
 
-    return writeImages(dirName);
+    return true;
 }
 
 
-void VoxelContainer::create(const Vector3& _size, const Range& _range) {
+bool VoxelContainer::loadFromJson(const std::string& fileName, const int zBegin, const int zEnd) {
     clear();
-    size = _size;
-    range = _range;
-    data = new float[size.volume()];
-    memset(data, 0, sizeof(float) * size.volume());
-}
 
+    VolumeFiles files;
 
-void VoxelContainer::clear() {
-    if (data != nullptr) {
-        delete[] data;
-        data = nullptr;
-        size = {0, 0, 0};
-        range = {0, 0};
+    if (!readInfo(fileName, files)) {
+        return false;
     }
-}
 
+    if (zBegin < 0 || zEnd > static_cast<int>(size.z) || zBegin >= zEnd) {
+        printf("Error: Layers [%i, %i) out of Z range [0, %lu)\n", zBegin, zEnd, size.z);
+        return false;
+    }
 
-bool VoxelContainer::isEmpty() {
-    return data == nullptr;
+    return readVolumeRegion(files, {0, 0, static_cast<size_t>(zBegin)}, {size.x, size.y, static_cast<size_t>(zEnd - zBegin)});
 }
 
 
-float& VoxelContainer::at(const int x, const int y, const int z) {
-    return data[z * size.x * size.y + y * size.x + x];
-}
+bool VoxelContainer::loadFromJson(const std::string& fileName, const Vector3& regionOrigin, const Vector3& regionSize) {
+    clear();
 
+    VolumeFiles files;
 
-const float& VoxelContainer::at(const int x, const int y, const int z) const {
-    return data[z * size.x * size.y + y * size.x + x];
+    if (!readInfo(fileName, files)) {
+        return false;
+    }
+
+    return readVolumeRegion(files, regionOrigin, regionSize);
 }
 
 
-float* VoxelContainer::getData() const {
-    return data;
-}
+bool VoxelContainer::loadPreviewFromJson(const std::string& fileName, const int scale) {
+    clear();
 
+    VolumeFiles files;
 
-const VoxelContainer::Vector3& VoxelContainer::getSize() const {
-    return size;
-}
+    if (!readInfo(fileName, files)) {
+        return false;
+    }
 
+    if (scale < 1) {
+        printf("Error: Preview scale %i is not positive\n", scale);
+        return false;
+    }
 
-const VoxelContainer::Range& VoxelContainer::getRange() const {
-    return range;
-}
+    // Preview is placed among other previews in its own voxels
+    const Vector3 whole = size;
+    fullSize = whole;
+    previewScale = scale;
+    size = {(whole.x + scale - 1) / scale, (whole.y + scale - 1) / scale, (whole.z + scale - 1) / scale};
+    referenceParams = {referenceParams.offsetX / scale, referenceParams.offsetY / scale, referenceParams.offsetZ / scale};
 
+    const LayerReader& readLayer = files.readLayer;
+    const Vector3 binned = size;
 
-const VoxelContainer::StitchParams& VoxelContainer::getRefStitchParams() const {
-    return referenceParams;
-}
+    LayerReader readBinnedLayer = [&](void* dst, const int z, const SampleType type) {
+        std::vector<unsigned char> layer(whole.x * whole.y * getSampleSize(type));
 
+        if (!readLayer(layer.data(), z * scale, type)) {
+            return false;
+        }
 
-void VoxelContainer::setRefStitchParams(const VoxelContainer::StitchParams& params) {
-    referenceParams = params;
-}
+        std::vector<float> samples(whole.x * whole.y);
+        std::vector<float> bins(binned.x * binned.y, 0);
+        convertSamples(layer.data(), type, samples.data(), samples.size(), SampleType::Float32);
+
+        for (size_t y = 0; y < whole.y; ++y) {
+            for (size_t x = 0; x < whole.x; ++x) {
+                bins[(y / scale) * binned.x + x / scale] += samples[y * whole.x + x];
+            }
+        }
 
+        // Bins at the far borders might be incomplete
+        for (size_t y = 0; y < binned.y; ++y) {
+            for (size_t x = 0; x < binned.x; ++x) {
+                const size_t count = std::min<size_t>(scale, whole.y - y * scale) * std::min<size_t>(scale, whole.x - x * scale);
+                bins[y * binned.x + x] /= count;
+            }
+        }
 
-const VoxelContainer::StitchParams& VoxelContainer::getEstStitchParams() const {
-    return estimatedParams;
+        convertSamples(bins.data(), SampleType::Float32, dst, bins.size(), type);
+
+        return true;
+    };
+
+    return readVolume(readBinnedLayer, nullptr);
 }
 
 
-void VoxelContainer::setEstStitchParams(const VoxelContainer::StitchParams& params) {
-    estimatedParams = params;
+bool VoxelContainer::loadInfoFromJson(const std::string& fileName) {
+    clear();
+
+    VolumeFiles files;
+
+    return readInfo(fileName, files);
 }
 
 
-bool VoxelContainer::readImages(const std::vector<std::string>& fileNames) {
-    data = new float[size.volume()];
+bool VoxelContainer::readInfo(const std::string& fileName, VolumeFiles& files) {
+    sourceName = fileName;
+
+    // Open parameters file
+    std::ifstream fs(fileName);
+    if(!fs) {
+        printf("%s %s\n", "Unable to open file", fileName.data());
+        return false;
+    }
 
-    if (data == nullptr) {
+    // Parse JSON parameters
+    json data = json::parse(fs, nullptr, false);
+    if (data.is_discarded()) {
+        printf("Parse error");
         return false;
     }
 
-    size_t width = 0;
-    size_t height = 0;
+    size.x = data["width"].get<int>();
+    size.y = data["depth"].get<int>();
+    size.z = data["height"].get<int>();
+    range.min = data["range_min"].get<float>();
+    range.max = data["range_max"].get<float>();
+    referenceParams = {0, 0, 0};
+
+    if (data.contains("part_begin")) {
+        referenceParams.offsetZ = data["part_begin"].get<int>();
+        referenceParams.offsetX = data["offset_y"].get<float>() * size.x / 2;
+        referenceParams.offsetY = data["offset_x"].get<float>() * size.y / 2;
+    }
+    // else {
+    //     printf("Warning: reconstruction info doesn't contain distortions parameters.\n");
+    // }
+
+    std::string imgPath = fileName.substr(0, fileName.find_last_of('/') + 1);
+    files = VolumeFiles();
+    bool opened = false;
+
+    if (data.contains("chunks")) {
+        // Compressed chunks are found through the index of their offsets
+        if (!getSampleTypeByName(data["dtype"].get<std::string>(), sampleType)) {
+            printf("Error: Unknown data type %s\n", data["dtype"].get<std::string>().data());
+            return false;
+        }
 
-    for (int i = 0; i < size.z; ++i) {
-        if (!TiffImage<float>::readFromFile(fileNames.at(i).data(), data + i * size.x * size.y, width, height)) {
+        if (data["chunk_size"].get<size_t>() != ChunkFile::chunkSize || data["brick_size"].get<size_t>() != brickSize) {
+            printf("Error: Chunks of %zu and bricks of %zu voxels are not supported\n", data["chunk_size"].get<size_t>(), data["brick_size"].get<size_t>());
             return false;
         }
 
-        if (width != size.x || height != size.y) {
+        if ((data["endianness"].get<std::string>() == "little") != RawFile::isHostLittleEndian()) {
+            printf("Error: Chunks of %s byte order are not supported\n", data["endianness"].get<std::string>().data());
             return false;
         }
+
+        files.sourceNames.push_back(imgPath + data["chunks"].get<std::string>());
+        opened = openChunks(files.sourceNames.back(), data["chunk_offsets"].get<std::vector<uint64_t>>(), files);
     }
+    else if (data.contains("raw")) {
+        // Samples of the stored type follow each other in a single file
+        if (!getSampleTypeByName(data["dtype"].get<std::string>(), sampleType)) {
+            printf("Error: Unknown data type %s\n", data["dtype"].get<std::string>().data());
+            return false;
+        }
 
-    return true;
-}
+        bool littleEndian = RawFile::isHostLittleEndian();
 
+        if (data.contains("endianness")) {
+            littleEndian = data["endianness"].get<std::string>() != "big";
+        }
 
-bool VoxelContainer::writeImages(const std::string& dirName) {
-    std::string normDirName = dirName;
-    
-    if (normDirName.back() != '/') {
-        normDirName += "/";
+        files.sourceNames.push_back(imgPath + data["raw"].get<std::string>());
+        opened = openRaw(files.sourceNames.back(), littleEndian, files.readLayer, files.readRegion);
     }
+    else if (data.contains("stack")) {
+        // Layers are pages of a single file
+        std::string stackName = imgPath + data["stack"].get<std::string>();
+        Vector3 stackSize;
+        files.sourceNames.push_back(stackName);
 
-    for (int i = 0; i < size.z; ++i) {
-        std::string fileName = normDirName + std::to_string(i) + ".tiff";
+        if (!openStack(stackName, stackSize, files.readLayer)) {
+            return false;
+        }
 
-        if (!TiffImage<float>::save(fileName.c_str(), data + i * size.x * size.y, size.x, size.y)) {
+        if (stackSize.x != size.x || stackSize.y != size.y || stackSize.z < size.z) {
+            printf("Error: Stack %s of %zux%zux%zu doesn't hold %zux%zux%zu volume\n", stackName.data(), stackSize.x, stackSize.y, stackSize.z, size.x, size.y, size.z);
             return false;
         }
+
+        opened = true;
+    }
+    else {
+        std::string format = data["format"].get<std::string>();
+        std::vector<std::string> imgNames;
+
+        // Create image files list
+        for (int i = 0; i < size.z; ++i) {
+            imgNames.push_back(imgPath + std::to_string(i) + format);
+        }
+
+        opened = !imgNames.empty() && openImages(imgNames, files.readLayer);
+        files.sourceNames = std::move(imgNames);
+    }
+
+    if (!opened) {
+        return false;
+    }
+
+    if (data.contains("stored_min")) {
+        // Saved samples are mapped back to the values of the volume range
+        mapStoredValues(files, {data["stored_min"].get<float>(), data["stored_max"].get<float>()});
     }
 
     return true;
 }
 
 
-void substract(const VoxelContainer& a, const VoxelContainer& b, VoxelContainer& dst) {
-    VoxelContainer::Vector3 aSize = a.getSize();
-    VoxelContainer::Vector3 bSize = b.getSize();
+void VoxelContainer::mapStoredValues(VolumeFiles& files, const Range& storedRange) {
+    const LayerReader readStored = files.readLayer;
+    const size_t layerSpace = size.x * size.y;
+    const Range valuesRange = range;
 
-    if (aSize.x != bSize.x || aSize.y != bSize.y || aSize.z != bSize.z) {
-        return;
-    }
+    files.readLayer = [readStored, layerSpace, storedRange, valuesRange](void* dst, const int z, const SampleType type) {
+        std::vector<float> layer(layerSpace);
+
+        if (!readStored(layer.data(), z, SampleType::Float32)) {
+            return false;
+        }
+
+        for (float& value : layer) {
+            value = storedRange.fit(value, valuesRange);
+        }
+
+        convertSamples(layer.data(), SampleType::Float32, dst, layerSpace, type);
+
+        return true;
+    };
+
+    // Stored samples are never used as they are
+    files.readRegion = nullptr;
+    files.loadBricks = nullptr;
+    sampleType = SampleType::Float32;
+}
 
-    dst.create(aSize, a.getRange());
+
+void VoxelContainer::reuseBands(VolumeFiles& files, const std::vector<const VoxelContainer*>& loadedBands) const {
+    std::vector<const VoxelContainer*> bands;
+
+    for (const VoxelContainer* band : loadedBands) {
+        if (band != nullptr && band->hasVoxels() && band->getSize().x == size.x && band->getSize().y == size.y && band->getFullSize().z == size.z) {
+            bands.push_back(band);
+        }
+    }
+
+    if (bands.empty()) {
+        return;
+    }
+
+    // Gives the band covering layer z, or the first layer after z covered by any band
+    auto findBand = [bands](const size_t z, size_t& nextBegin) -> const VoxelContainer* {
+        nextBegin = std::numeric_limits<size_t>::max();
+
+        for (const VoxelContainer* band : bands) {
+            const size_t bandBegin = band->getRegionOrigin().z;
+
+            if (z >= bandBegin && z < bandBegin + band->getSize().z) {
+                return band;
+            }
+
+            if (bandBegin > z) {
+                nextBegin = std::min(nextBegin, bandBegin);
+            }
+        }
+
+        return nullptr;
+    };
+
+    const LayerReader readLayer = files.readLayer;
+
+    files.readLayer = [readLayer, findBand](void* dst, const int z, const SampleType type) {
+        size_t nextBegin;
+        const VoxelContainer* band = findBand(z, nextBegin);
+
+        if (band == nullptr) {
+            return readLayer(dst, z, type);
+        }
+
+        const int bandZ = z - static_cast<int>(band->getRegionOrigin().z);
+        band->copyLayers(dst, bandZ, bandZ + 1, type);
+
+        return true;
+    };
+
+    if (!files.readRegion) {
+        return;
+    }
+
+    // Regions of whole layers are split into runs read from the files and runs copied from the bands
+    const RegionReader readRegion = files.readRegion;
+    const Vector3 whole = size;
+    const SampleType type = sampleType;
+
+    files.readRegion = [readRegion, findBand, whole, type](void* dst, const Vector3& regionOrigin, const Vector3& regionSize) {
+        if (regionSize.x != whole.x || regionSize.y != whole.y) {
+            return readRegion(dst, regionOrigin, regionSize);
+        }
+
+        const size_t layerBytes = whole.x * whole.y * getSampleSize(type);
+        const size_t zEnd = regionOrigin.z + regionSize.z;
+
+        for (size_t z = regionOrigin.z; z < zEnd;) {
+            unsigned char* layers = static_cast<unsigned char*>(dst) + (z - regionOrigin.z) * layerBytes;
+            size_t nextBegin;
+            const VoxelContainer* band = findBand(z, nextBegin);
+
+            if (band == nullptr) {
+                const size_t runEnd = std::min(zEnd, nextBegin);
+
+                if (!readRegion(layers, {0, 0, z}, {whole.x, whole.y, runEnd - z})) {
+                    return false;
+                }
+
+                z = runEnd;
+                continue;
+            }
+
+            const size_t bandBegin = band->getRegionOrigin().z;
+            const size_t runEnd = std::min(zEnd, bandBegin + band->getSize().z);
+            band->copyLayers(layers, z - bandBegin, runEnd - bandBegin, type);
+            z = runEnd;
+        }
+
+        return true;
+    };
+}
+
+
+bool VoxelContainer::openImages(const std::vector<std::string>& fileNames, LayerReader& readLayer) {
+    if (!detectSampleType(fileNames.front())) {
+        return false;
+    }
+
+    const size_t layerWidth = size.x;
+    const size_t layerHeight = size.y;
+
+    readLayer = [fileNames, layerWidth, layerHeight](void* dst, const int z, const SampleType type) {
+        const char* fileName = fileNames.at(z).data();
+        size_t width = 0;
+        size_t height = 0;
+        bool read = false;
+
+        switch (type) {
+            case SampleType::UInt8:
+                read = TiffImage<uint8_t>::readFromFile(fileName, static_cast<uint8_t*>(dst), width, height);
+                break;
+            case SampleType::UInt16:
+                read = TiffImage<uint16_t>::readFromFile(fileName, static_cast<uint16_t*>(dst), width, height);
+                break;
+            default:
+                read = TiffImage<float>::readFromFile(fileName, static_cast<float*>(dst), width, height);
+                break;
+        }
+
+        if (!read) {
+            printf("Error: Unable to read image %s\n", fileName);
+            return false;
+        }
+
+        if (width != layerWidth || height != layerHeight) {
+            printf("Error: Image %s is %zux%zu instead of %zux%zu\n", fileName, width, height, layerWidth, layerHeight);
+            return false;
+        }
+
+        return true;
+    };
+
+    return true;
+}
+
+
+bool VoxelContainer::openStack(const std::string& fileName, Vector3& stackSize, LayerReader& readLayer) {
+    // Pages are indexed once and shared by all readers of the layers
+    std::shared_ptr<TiffStack> stack = std::make_shared<TiffStack>();
+
+    if (!stack->open(fileName)) {
+        return false;
+    }
+
+    stackSize = {stack->getWidth(), stack->getHeight(), stack->getPagesNum()};
+    selectSampleType(stack->getSampleFormat(), stack->getBitsPerSample());
+
+    readLayer = [stack](void* dst, const int z, const SampleType type) {
+        switch (type) {
+            case SampleType::UInt8:
+                return stack->readPage(z, static_cast<uint8_t*>(dst));
+            case SampleType::UInt16:
+                return stack->readPage(z, static_cast<uint16_t*>(dst));
+            default:
+                return stack->readPage(z, static_cast<float*>(dst));
+        }
+    };
+
+    return true;
+}
+
+
+bool VoxelContainer::openRaw(const std::string& fileName, const bool littleEndian, LayerReader& readLayer, RegionReader& readRegion) {
+    std::shared_ptr<RawFile> file = std::make_shared<RawFile>();
+
+    if (!file->open(fileName, directIo)) {
+        return false;
+    }
+
+    const SampleType fileType = sampleType;
+    const size_t fileSampleSize = sampleSize();
+    const size_t layerSpace = size.x * size.y;
+    const size_t layerBytes = layerSpace * fileSampleSize;
+    const bool swap = littleEndian != RawFile::isHostLittleEndian() && fileSampleSize > 1;
+
+    if (file->getSize() < size.z * layerBytes) {
+        printf("Error: Raw file %s is smaller than %zux%zux%zu %s volume\n", fileName.data(), size.x, size.y, size.z, getSampleTypeName(fileType));
+        return false;
+    }
+
+    readLayer = [file, fileType, fileSampleSize, layerSpace, layerBytes, swap](void* dst, const int z, const SampleType type) {
+        std::vector<unsigned char> layer;
+        void* samples = dst;
+
+        if (type != fileType) {
+            layer.resize(layerBytes);
+            samples = layer.data();
+        }
+
+        if (!file->read(z * layerBytes, samples, layerBytes)) {
+            return false;
+        }
+
+        if (swap) {
+            RawFile::swapBytes(samples, layerSpace, fileSampleSize);
+        }
+
+        if (type != fileType) {
+            convertSamples(samples, fileType, dst, layerSpace, type);
+        }
+
+        return true;
+    };
+
+    ThreadPool* pool = threadPool != nullptr ? threadPool : &ThreadPool::getDefault();
+
+    const size_t width = size.x;
+    const size_t height = size.y;
+
+    readRegion = [file, fileSampleSize, width, height, swap, pool](void* dst, const Vector3& regionOrigin, const Vector3& regionSize) {
+        const size_t rowBytes = width * fileSampleSize;
+        const size_t spanBytes = regionSize.y * rowBytes;
+        const size_t regionLayerBytes = regionSize.x * regionSize.y * fileSampleSize;
+        const bool wholeRows = regionSize.x == width;
+        const bool wholeLayers = wholeRows && regionSize.y == height;
+        const int chunkLayers = std::max<size_t>(1, rawChunkBytes / spanBytes);
+        std::atomic<bool> failed(false);
+
+        // Several large requests are kept in flight to saturate the device
+        pool->parallelFor(0, regionSize.z, chunkLayers, [&](const int chunkBegin, const int chunkEnd) {
+            unsigned char* chunk = static_cast<unsigned char*>(dst) + chunkBegin * regionLayerBytes;
+            const size_t bytes = (chunkEnd - chunkBegin) * regionLayerBytes;
+
+            if (failed) {
+                return;
+            }
+
+            if (wholeLayers) {
+                if (!file->read((regionOrigin.z + chunkBegin) * height * rowBytes, chunk, bytes)) {
+                    failed = true;
+                    return;
+                }
+            }
+            else {
+                // Only rows of the region are read, and they are cut to its width
+                std::vector<unsigned char> span(wholeRows ? 0 : spanBytes);
+
+                for (int z = chunkBegin; z < chunkEnd; ++z) {
+                    unsigned char* layer = chunk + (z - chunkBegin) * regionLayerBytes;
+                    unsigned char* rows = wholeRows ? layer : span.data();
+
+                    if (!file->read(((regionOrigin.z + z) * height + regionOrigin.y) * rowBytes, rows, spanBytes)) {
+                        failed = true;
+                        return;
+                    }
+
+                    for (size_t y = 0; y < regionSize.y && !wholeRows; ++y) {
+                        memcpy(layer + y * regionSize.x * fileSampleSize, rows + y * rowBytes + regionOrigin.x * fileSampleSize, regionSize.x * fileSampleSize);
+                    }
+                }
+            }
+
+            if (swap) {
+                RawFile::swapBytes(chunk, bytes / fileSampleSize, fileSampleSize);
+            }
+        });
+
+        return !failed;
+    };
+
+    return true;
+}
+
+
+bool VoxelContainer::openChunks(const std::string& fileName, const std::vector<uint64_t>& offsets, VolumeFiles& files) {
+    std::shared_ptr<ChunkFile> chunks = std::make_shared<ChunkFile>(size.x, size.y, size.z, brickSize, sampleSize());
+
+    if (!chunks->open(fileName, offsets)) {
+        return false;
+    }
+
+    const SampleType fileType = sampleType;
+    const size_t layerSpace = size.x * size.y;
+    const size_t layerBytes = layerSpace * sampleSize();
+    ThreadPool* pool = threadPool != nullptr ? threadPool : &ThreadPool::getDefault();
+
+    const Vector3 layerSize = {size.x, size.y, 1};
+
+    files.readRegion = [chunks, pool](void* dst, const Vector3& regionOrigin, const Vector3& regionSize) {
+        const size_t origin[3] = {regionOrigin.x, regionOrigin.y, regionOrigin.z};
+        const size_t extent[3] = {regionSize.x, regionSize.y, regionSize.z};
+
+        return chunks->readRegion(dst, origin, extent, *pool);
+    };
+
+    const RegionReader readRegion = files.readRegion;
+
+    files.readLayer = [readRegion, fileType, layerSpace, layerBytes, layerSize](void* dst, const int z, const SampleType type) {
+        const Vector3 layerOrigin = {0, 0, static_cast<size_t>(z)};
+
+        if (type == fileType) {
+            return readRegion(dst, layerOrigin, layerSize);
+        }
+
+        std::vector<unsigned char> layer(layerBytes);
+
+        if (!readRegion(layer.data(), layerOrigin, layerSize)) {
+            return false;
+        }
+
+        convertSamples(layer.data(), fileType, dst, layerSpace, type);
+
+        return true;
+    };
+
+    files.loadBricks = [chunks](const size_t brickId, BrickStore::Bricks& bricks) {
+        return chunks->readChunk(chunks->getBrickChunk(brickId), bricks);
+    };
+
+    return true;
+}
+
+
+bool VoxelContainer::saveToJson(const std::string& dirName, const FileFormat format, const SaveMapping* mapping) {
+    // Linear voxels are already laid out as the raw file
+    if (format == FileFormat::Raw && mapping == nullptr && layout == Layout::Linear && data != nullptr) {
+        return saveRaw(dirName, nullptr);
+    }
+
+    return saveToJson(dirName, size, range, sampleType, [this](void* dst, const int z, const SampleType type) {
+        copyLayers(dst, z, z + 1, type);
+    }, nullptr, format, mapping);
+}
+
+
+std::future<bool> VoxelContainer::saveToJsonAsync(const std::string& dirName, std::atomic<int>* savedLayers, const FileFormat format, const SaveMapping* mapping) const {
+    if (format == FileFormat::Raw && mapping == nullptr && layout == Layout::Linear && data != nullptr) {
+        return std::async(std::launch::async, [this, dirName, savedLayers]() {
+            return saveRaw(dirName, savedLayers);
+        });
+    }
+
+    return saveToJsonAsync(dirName, size, range, sampleType, [this](void* dst, const int z, const SampleType type) {
+        copyLayers(dst, z, z + 1, type);
+    }, savedLayers, format, mapping);
+}
+
+
+bool VoxelContainer::saveToJson(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const LayerSource& getLayer, std::atomic<int>* savedLayers, const FileFormat format, const SaveMapping* mapping) {
+    if (mapping == nullptr) {
+        return saveVolume(dirName, size, range, type, getLayer, savedLayers, format, nullptr);
+    }
+
+    if (!(range.max > range.min)) {
+        printf("Error: Range [%f, %f] can't be mapped to saved samples\n", range.min, range.max);
+        return false;
+    }
+
+    // Every layer is mapped on its way to the writers, so no converted copy of the volume is made
+    const size_t layerSpace = size.x * size.y;
+    const Range storedRange = mapping->range;
+
+    LayerSource getMappedLayer = [&getLayer, layerSpace, range, storedRange](void* dst, const int z, const SampleType dstType) {
+        std::vector<float> layer(layerSpace);
+        getLayer(layer.data(), z, SampleType::Float32);
+
+        for (float& value : layer) {
+            value = range.fit(value, storedRange);
+        }
+
+        convertSamples(layer.data(), SampleType::Float32, dst, layerSpace, dstType);
+    };
+
+    return saveVolume(dirName, size, range, mapping->type, getMappedLayer, savedLayers, format, &storedRange);
+}
+
+
+bool VoxelContainer::saveVolume(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const LayerSource& getSourceLayer, std::atomic<int>* savedLayers, const FileFormat format, const Range* storedRange) {
+    LayerSource getLayer = getSourceLayer;
+
+    // Getting layers is timed as copying into the saved volume
+    if (IoStats::isEnabled()) {
+        const std::string infoName = dirName + (dirName.back() == '/' ? "" : "/") + "info.json";
+
+        getLayer = [&getSourceLayer, infoName](void* dst, const int z, const SampleType dstType) {
+            IoStats::Timer timer(infoName.c_str(), IoStats::Stage::Copy);
+            getSourceLayer(dst, z, dstType);
+        };
+    }
+
+    if (format == FileFormat::Chunked) {
+        switch (type) {
+            case SampleType::UInt8:
+                return saveChunks<uint8_t>(dirName, size, range, type, getLayer, savedLayers, storedRange);
+            case SampleType::UInt16:
+                return saveChunks<uint16_t>(dirName, size, range, type, getLayer, savedLayers, storedRange);
+            case SampleType::Float16:
+                return saveChunks<half>(dirName, size, range, type, getLayer, savedLayers, storedRange);
+            default:
+                return saveChunks<float>(dirName, size, range, type, getLayer, savedLayers, storedRange);
+        }
+    }
+
+    if (format == FileFormat::Raw) {
+        if (!writeInfo(dirName, size, range, type, format, {}, storedRange)) {
+            return false;
+        }
+
+        switch (type) {
+            case SampleType::UInt8:
+                return saveLayers<uint8_t>(dirName, size, type, getLayer, savedLayers, format);
+            case SampleType::UInt16:
+                return saveLayers<uint16_t>(dirName, size, type, getLayer, savedLayers, format);
+            case SampleType::Float16:
+                return saveLayers<half>(dirName, size, type, getLayer, savedLayers, format);
+            default:
+                return saveLayers<float>(dirName, size, type, getLayer, savedLayers, format);
+        }
+    }
+
+    // TIFF has no half type, so it is written as float
+    const SampleType tiffType = type == SampleType::Float16 ? SampleType::Float32 : type;
+
+    if (!writeInfo(dirName, size, range, tiffType, format, {}, storedRange)) {
+        return false;
+    }
+
+    switch (tiffType) {
+        case SampleType::UInt8:
+            return saveLayers<uint8_t>(dirName, size, tiffType, getLayer, savedLayers, format);
+        case SampleType::UInt16:
+            return saveLayers<uint16_t>(dirName, size, tiffType, getLayer, savedLayers, format);
+        default:
+            return saveLayers<float>(dirName, size, tiffType, getLayer, savedLayers, format);
+    }
+}
+
+
+std::future<bool> VoxelContainer::saveToJsonAsync(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const LayerSource& getLayer, std::atomic<int>* savedLayers, const FileFormat format, const SaveMapping* mapping) {
+    const bool mapped = mapping != nullptr;
+    const SaveMapping savedMapping = mapped ? *mapping : SaveMapping();
+
+    return std::async(std::launch::async, [dirName, size, range, type, getLayer, savedLayers, format, mapped, savedMapping]() {
+        return saveToJson(dirName, size, range, type, getLayer, savedLayers, format, mapped ? &savedMapping : nullptr);
+    });
+}
+
+
+bool VoxelContainer::writeInfo(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const FileFormat format, const std::vector<uint64_t>& chunkOffsets, const Range* storedRange) {
+    json data;
+    data["width"] = size.x;
+    data["depth"] = size.y;
+    data["height"] = size.z;
+    data["range_min"] = range.min;
+    data["range_max"] = range.max;
+    data["format"] = ".tiff";
+
+    if (format == FileFormat::Stack) {
+        data["stack"] = "volume.tiff";
+    }
+    else if (format == FileFormat::Raw) {
+        data["format"] = ".raw";
+        data["raw"] = "volume.raw";
+        data["dtype"] = getSampleTypeName(type);
+        data["endianness"] = RawFile::isHostLittleEndian() ? "little" : "big";
+    }
+    else if (format == FileFormat::Chunked) {
+        data["format"] = ".chunks";
+        data["chunks"] = "volume.chunks";
+        data["dtype"] = getSampleTypeName(type);
+        data["endianness"] = RawFile::isHostLittleEndian() ? "little" : "big";
+        data["chunk_size"] = ChunkFile::chunkSize;
+        data["brick_size"] = brickSize;
+        data["chunk_offsets"] = chunkOffsets;
+    }
+
+    if (storedRange != nullptr) {
+        data["stored_min"] = storedRange->min;
+        data["stored_max"] = storedRange->max;
+    }
+
+    mkdir(dirName.c_str(), ACCESSPERMS);
+
+    std::string fileName = dirName;
+    
+    if (dirName.back() == '/') {
+        fileName += "info.json";
+    }
+    else {
+        fileName += "/info.json";
+    }
+
+    std::ofstream fs(fileName);
+    
+    if (!fs.is_open()) {
+        return false;
+    }
+
+    fs << data.dump(4) << std::endl;
+
+    return true;
+}
+
+
+bool VoxelContainer::saveRaw(const std::string& dirName, std::atomic<int>* savedLayers) const {
+    if (!writeInfo(dirName, size, range, sampleType, FileFormat::Raw)) {
+        return false;
+    }
+
+    std::string fileName = dirName;
+
+    if (fileName.back() != '/') {
+        fileName += "/";
+    }
+
+    fileName += "volume.raw";
+
+    const size_t layerBytes = size.x * size.y * sampleSize();
+    RawFile file;
+
+    if (!file.create(fileName, size.z * layerBytes, directIo)) {
+        return false;
+    }
+
+    std::atomic<bool> failed(false);
+    const int chunkLayers = std::max<size_t>(1, rawChunkBytes / layerBytes);
+    ThreadPool& pool = threadPool != nullptr ? *threadPool : ThreadPool::getDefault();
+
+    // Buffer is written as is by several large requests in flight
+    pool.parallelFor(0, size.z, chunkLayers, [&](const int zBegin, const int zEnd) {
+        const unsigned char* chunk = static_cast<const unsigned char*>(data) + zBegin * layerBytes;
+
+        if (failed || !file.write(zBegin * layerBytes, chunk, (zEnd - zBegin) * layerBytes)) {
+            failed = true;
+            return;
+        }
+
+        if (savedLayers != nullptr) {
+            *savedLayers += zEnd - zBegin;
+        }
+    });
+
+    return !failed;
+}
+
+
+void VoxelContainer::setStorage(const Storage _storage, const std::string& _mappedFileName) {
+    storage = _storage;
+    mappedFileName = _mappedFileName;
+}
+
+
+VoxelContainer::Storage VoxelContainer::getStorage() const {
+    return storage;
+}
+
+
+void VoxelContainer::setThreadPool(ThreadPool* pool) {
+    threadPool = pool;
+}
+
+
+void VoxelContainer::setDirectIo(const bool _directIo) {
+    directIo = _directIo;
+}
+
+
+void VoxelContainer::setLayout(const Layout _layout) {
+    if (layout == _layout) {
+        return;
+    }
+
+    if (!hasVoxels()) {
+        layout = _layout;
+        return;
+    }
+
+    convertVoxels(_layout, sampleType);
+}
+
+
+VoxelContainer::Layout VoxelContainer::getLayout() const {
+    return layout;
+}
+
+
+void VoxelContainer::setSampleType(const SampleType _sampleType) {
+    if (sampleType == _sampleType) {
+        return;
+    }
+
+    if (!hasVoxels()) {
+        sampleType = _sampleType;
+        return;
+    }
+
+    if (convertVoxels(layout, _sampleType)) {
+        stats.reset(0);
+    }
+}
+
+
+VoxelContainer::SampleType VoxelContainer::getSampleType() const {
+    return sampleType;
+}
+
+
+size_t VoxelContainer::sampleSize() const {
+    return getSampleSize(sampleType);
+}
+
+
+bool VoxelContainer::create(const Vector3& _size, const Range& _range) {
+    clear();
+    size = _size;
+    range = _range;
+
+    if (!allocate()) {
+        size = {0, 0, 0};
+        range = {0, 0};
+        return false;
+    }
+
+    // Fresh mapping is already zero-filled
+    if (data != nullptr && mappedBytes == 0) {
+        memset(data, 0, sampleSize() * storedVolume());
+    }
+
+    return true;
+}
+
+
+bool VoxelContainer::reshape(const Vector3& _size, const Range& _range) {
+    const Vector3 oldSize = size;
+    size = _size;
+    fullSize = {0, 0, 0};
+    origin = {0, 0, 0};
+    previewScale = 1;
+    stats.reset(0);
+
+    if (data != nullptr && mappedBytes == 0 && storedVolume() <= capacity) {
+        range = _range;
+        return true;
+    }
+
+    size = oldSize;
+    clear();
+    size = _size;
+    range = _range;
+
+    if (!allocate()) {
+        size = {0, 0, 0};
+        range = {0, 0};
+        return false;
+    }
+
+    return true;
+}
+
+
+void VoxelContainer::clear() {
+    stats.reset(0);
+    sourceName.clear();
+    fullSize = {0, 0, 0};
+    origin = {0, 0, 0};
+    previewScale = 1;
+
+    if (hasVoxels()) {
+        release();
+        size = {0, 0, 0};
+        range = {0, 0};
+    }
+}
+
+
+bool VoxelContainer::isEmpty() {
+    return !hasVoxels();
+}
+
+
+float& VoxelContainer::at(const int x, const int y, const int z) {
+    return static_cast<float*>(data)[index(x, y, z)];
+}
+
+
+const float& VoxelContainer::at(const int x, const int y, const int z) const {
+    return static_cast<const float*>(data)[index(x, y, z)];
+}
+
+
+float VoxelContainer::get(const int x, const int y, const int z) const {
+    size_t i = index(x, y, z);
+    const void* src = data;
+    unsigned char sample[sizeof(float)];
+
+    if (bricks != nullptr) {
+        bricks->read(i >> (3 * brickShift), i & (brickVolume - 1), sample);
+        src = sample;
+        i = 0;
+    }
+
+    switch (sampleType) {
+        case SampleType::UInt8:
+            return static_cast<const uint8_t*>(src)[i];
+        case SampleType::UInt16:
+            return static_cast<const uint16_t*>(src)[i];
+        case SampleType::Float16:
+            return static_cast<const half*>(src)[i];
+        default:
+            return static_cast<const float*>(src)[i];
+    }
+}
+
+
+void VoxelContainer::set(const int x, const int y, const int z, const float val) {
+    const size_t voxel = index(x, y, z);
+    size_t i = voxel;
+    void* dst = data;
+    unsigned char sample[sizeof(float)];
+
+    if (bricks != nullptr) {
+        dst = sample;
+        i = 0;
+    }
+
+    switch (sampleType) {
+        case SampleType::UInt8:
+            static_cast<uint8_t*>(dst)[i] = toSample<uint8_t>(val);
+            break;
+        case SampleType::UInt16:
+            static_cast<uint16_t*>(dst)[i] = toSample<uint16_t>(val);
+            break;
+        case SampleType::Float16:
+            static_cast<half*>(dst)[i] = toSample<half>(val);
+            break;
+        default:
+            static_cast<float*>(dst)[i] = val;
+            break;
+    }
+
+    if (bricks != nullptr) {
+        bricks->write(voxel >> (3 * brickShift), voxel & (brickVolume - 1), sample);
+    }
+}
+
+
+float* VoxelContainer::getData() const {
+    if (sampleType != SampleType::Float32) {
+        return nullptr;
+    }
+
+    return static_cast<float*>(data);
+}
+
+
+void* VoxelContainer::getRawData() const {
+    return data;
+}
+
+
+size_t VoxelContainer::getStoredBytes() const {
+    if (bricks != nullptr) {
+        return bricks->getStoredBytes();
+    }
+
+    if (mappedBytes > 0) {
+        return mappedBytes;
+    }
+
+    return capacity * sampleSize();
+}
+
+
+void VoxelContainer::copyLayers(void* dst, const int zBegin, const int zEnd, const SampleType dstType) const {
+    const size_t layerSpace = size.x * size.y;
+    const size_t srcSampleSize = sampleSize();
+    const unsigned char* src = static_cast<const unsigned char*>(data);
+
+    if (bricks != nullptr) {
+        copyBrickLayers(dst, zBegin, zEnd, dstType);
+        return;
+    }
+
+    if (dstType != sampleType) {
+        // Convert row by row
+        std::vector<unsigned char> row(size.x * srcSampleSize);
+        const size_t dstSampleSize = getSampleSize(dstType);
+
+        for (int z = zBegin; z < zEnd; ++z) {
+            for (int y = 0; y < size.y; ++y) {
+                unsigned char* dstRow = static_cast<unsigned char*>(dst) + ((z - zBegin) * layerSpace + y * size.x) * dstSampleSize;
+
+                for (int x = 0; x < size.x; x += brickSize) {
+                    const size_t count = std::min(brickSize, size.x - x);
+                    memcpy(row.data() + x * srcSampleSize, src + index(x, y, z) * srcSampleSize, count * srcSampleSize);
+                }
+
+                convertSamples(row.data(), sampleType, dstRow, size.x, dstType);
+            }
+        }
+
+        return;
+    }
+
+    if (layout == Layout::Linear) {
+        memcpy(dst, src + zBegin * layerSpace * srcSampleSize, (zEnd - zBegin) * layerSpace * srcSampleSize);
+        return;
+    }
+
+    // Gather rows brick by brick
+    for (int z = zBegin; z < zEnd; ++z) {
+        for (int y = 0; y < size.y; ++y) {
+            unsigned char* row = static_cast<unsigned char*>(dst) + ((z - zBegin) * layerSpace + y * size.x) * srcSampleSize;
+
+            for (int x = 0; x < size.x; x += brickSize) {
+                memcpy(row + x * srcSampleSize, src + index(x, y, z) * srcSampleSize, std::min(brickSize, size.x - x) * srcSampleSize);
+            }
+        }
+    }
+}
+
+
+const VoxelContainer::Vector3& VoxelContainer::getSize() const {
+    return size;
+}
+
+
+const VoxelContainer::Vector3& VoxelContainer::getFullSize() const {
+    return fullSize.volume() > 0 ? fullSize : size;
+}
+
+
+const VoxelContainer::Vector3& VoxelContainer::getRegionOrigin() const {
+    return origin;
+}
+
+
+int VoxelContainer::getPreviewScale() const {
+    return previewScale;
+}
+
+
+const VoxelContainer::Range& VoxelContainer::getRange() const {
+    return range;
+}
+
+
+const VolumeStats& VoxelContainer::getStats() const {
+    std::lock_guard<std::mutex> lock(statsMutex);
+
+    if (stats.isEmpty() && hasVoxels()) {
+        switch (sampleType) {
+            case SampleType::UInt8:
+                collectStats<uint8_t>();
+                break;
+            case SampleType::UInt16:
+                collectStats<uint16_t>();
+                break;
+            default:
+                collectStats<float>();
+                break;
+        }
+    }
+
+    return stats;
+}
+
+
+const VoxelContainer::StitchParams& VoxelContainer::getRefStitchParams() const {
+    return referenceParams;
+}
+
+
+void VoxelContainer::setRefStitchParams(const VoxelContainer::StitchParams& params) {
+    referenceParams = params;
+}
+
+
+const VoxelContainer::StitchParams& VoxelContainer::getEstStitchParams() const {
+    return estimatedParams;
+}
+
+
+void VoxelContainer::setEstStitchParams(const VoxelContainer::StitchParams& params) {
+    estimatedParams = params;
+}
+
+
+bool VoxelContainer::detectSampleType(const std::string& fileName) {
+    uint16_t sampleFormat = 0;
+    uint16_t bitsPerSample = 0;
+
+    if (!TiffImage<float>::getFormatFromFile(fileName.data(), sampleFormat, bitsPerSample)) {
+        return false;
+    }
+
+    selectSampleType(sampleFormat, bitsPerSample);
+
+    return true;
+}
+
+
+void VoxelContainer::selectSampleType(const uint16_t sampleFormat, const uint16_t bitsPerSample) {
+    // Unsigned 8 and 16-bit images are kept as is, others are widened to float
+    sampleType = SampleType::Float32;
+
+    if (sampleFormat == TINYTIFF_SAMPLEFORMAT_UINT && bitsPerSample == 8) {
+        sampleType = SampleType::UInt8;
+    }
+    else if (sampleFormat == TINYTIFF_SAMPLEFORMAT_UINT && bitsPerSample == 16) {
+        sampleType = SampleType::UInt16;
+    }
+}
+
+
+bool VoxelContainer::readVolume(const LayerReader& readLayer, const BulkReader& readBulk, Range* valuesRange) {
+    if (!hasVoxels() && !allocate()) {
+        return false;
+    }
+
+    if (readBulk) {
+        // Bands of brick height are read without conversion, contiguous layers straight into the linear buffer
+        const bool direct = layout == Layout::Linear && data != nullptr;
+        const size_t layerBytes = size.x * size.y * sampleSize();
+        ThreadPool& pool = threadPool != nullptr ? *threadPool : ThreadPool::getDefault();
+        std::atomic<bool> failed(false);
+
+        // Bands merge their statistics under the same lock getStats() takes
+        {
+            std::lock_guard<std::mutex> lock(statsMutex);
+            stats.reset(size.z);
+        }
+
+        pool.parallelFor(0, size.z, brickSize, [&](const int zBegin, const int zEnd) {
+            std::vector<unsigned char> band;
+            unsigned char* dst = static_cast<unsigned char*>(data) + zBegin * layerBytes;
+
+            if (!direct) {
+                band.resize((zEnd - zBegin) * layerBytes);
+                dst = band.data();
+            }
+
+            if (failed || !readBulk(dst, zBegin, zEnd)) {
+                failed = true;
+                return;
+            }
+
+            // Statistics are gathered while the band is still in cache
+            VolumeStats bandStats;
+            bandStats.reset(size.z);
+            addBandStats(bandStats, dst, zBegin, zEnd);
+
+            if (!direct) {
+                IoStats::Timer timer(sourceName.c_str(), IoStats::Stage::Copy);
+                setLayers(dst, zBegin, zEnd);
+            }
+
+            std::lock_guard<std::mutex> lock(statsMutex);
+            stats.merge(bandStats, zBegin, zEnd);
+        });
+
+        if (failed) {
+            return false;
+        }
+
+        if (valuesRange != nullptr) {
+            *valuesRange = {stats.getMin(), stats.getMax()};
+        }
+
+        return true;
+    }
+
+    return readImages(readLayer, valuesRange);
+}
+
+
+bool VoxelContainer::readVolumeRegion(const VolumeFiles& files, const Vector3& regionOrigin, const Vector3& regionSize, Range* valuesRange) {
+    const Vector3 whole = size;
+
+    if (regionSize.volume() == 0 || regionOrigin.x + regionSize.x > whole.x || regionOrigin.y + regionSize.y > whole.y || regionOrigin.z + regionSize.z > whole.z) {
+        printf("Error: Region %zux%zux%zu at (%zu, %zu, %zu) is out of %zux%zux%zu volume\n", regionSize.x, regionSize.y, regionSize.z, regionOrigin.x, regionOrigin.y, regionOrigin.z, whole.x, whole.y, whole.z);
+        return false;
+    }
+
+    // Region keeps its place in the whole reconstruction, offsets follow x2 = x + offsetX and z2 = z - offsetZ of the placed voxels
+    size = regionSize;
+    fullSize = whole;
+    origin = regionOrigin;
+    referenceParams.offsetX -= regionOrigin.x;
+    referenceParams.offsetY -= regionOrigin.y;
+    referenceParams.offsetZ += regionOrigin.z;
+
+    const LayerReader& readLayer = files.readLayer;
+    const RegionReader& readRegion = files.readRegion;
+    const bool wholeLayers = regionSize.x == whole.x && regionSize.y == whole.y;
+
+    LayerReader readRegionLayer = [&](void* dst, const int z, const SampleType type) {
+        if (wholeLayers) {
+            return readLayer(dst, regionOrigin.z + z, type);
+        }
+
+        // Rows of the region are cut from the whole layer
+        const size_t sampleBytes = getSampleSize(type);
+        std::vector<unsigned char> layer(whole.x * whole.y * sampleBytes);
+
+        if (!readLayer(layer.data(), regionOrigin.z + z, type)) {
+            return false;
+        }
+
+        for (size_t y = 0; y < regionSize.y; ++y) {
+            memcpy(static_cast<unsigned char*>(dst) + y * regionSize.x * sampleBytes, layer.data() + ((regionOrigin.y + y) * whole.x + regionOrigin.x) * sampleBytes, regionSize.x * sampleBytes);
+        }
+
+        return true;
+    };
+
+    BulkReader readRegionBulk;
+
+    if (readRegion) {
+        readRegionBulk = [&](void* dst, const int zBegin, const int zEnd) {
+            return readRegion(dst, {regionOrigin.x, regionOrigin.y, regionOrigin.z + zBegin}, {regionSize.x, regionSize.y, static_cast<size_t>(zEnd - zBegin)});
+        };
+    }
+
+    return readVolume(readRegionLayer, readRegionBulk, valuesRange);
+}
+
+
+bool VoxelContainer::readImages(const LayerReader& readLayer, Range* valuesRange) {
+    if (!hasVoxels() && !allocate()) {
+        return false;
+    }
+
+    switch (sampleType) {
+        case SampleType::UInt8:
+            return readLayers<uint8_t>(readLayer, valuesRange);
+        case SampleType::UInt16:
+            return readLayers<uint16_t>(readLayer, valuesRange);
+        default:
+            return readLayers<float>(readLayer, valuesRange);
+    }
+}
+
+
+template<typename S>
+bool VoxelContainer::readLayers(const LayerReader& readLayer, Range* valuesRange) {
+    const size_t layerSpace = size.x * size.y;
+    const size_t layerBytes = layerSpace * sampleSize();
+    const bool direct = layout == Layout::Linear && sampleType != SampleType::Float16;
+    const SampleType readType = sampleType == SampleType::Float16 ? SampleType::Float32 : sampleType;
+    std::atomic<bool> failed(false);
+
+    // Bands merge their statistics under the same lock getStats() takes
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        stats.reset(size.z);
+    }
+
+    // Bands of brick height are decoded in parallel, each worker writes its own layers
+    ThreadPool& pool = threadPool != nullptr ? *threadPool : ThreadPool::getDefault();
+
+    pool.parallelFor(0, size.z, brickSize, [&](const int zBegin, const int zEnd) {
+        // Bricked or half layers are decoded into the intermediate buffer first
+        std::vector<S> layer;
+        std::vector<half> halfLayer;
+        VolumeStats bandStats;
+
+        if (!direct) {
+            layer.resize(layerSpace);
+        }
+
+        // Compressed bricks are stored whole, so the band is gathered into a slab
+        std::vector<unsigned char> slab;
+
+        if (bricks != nullptr) {
+            slab.resize((zEnd - zBegin) * layerBytes);
+        }
+
+        bandStats.reset(size.z);
+
+        for (int i = zBegin; i < zEnd && !failed; ++i) {
+            S* dst = direct ? static_cast<S*>(data) + i * layerSpace : layer.data();
+
+            if (!readLayer(dst, i, readType)) {
+                failed = true;
+                break;
+            }
+
+            bandStats.addLayer(i, dst, layerSpace);
+
+            if (direct) {
+                continue;
+            }
+
+            IoStats::Timer timer(sourceName.c_str(), IoStats::Stage::Copy);
+            const void* samples = dst;
+
+            if (sampleType == SampleType::Float16) {
+                halfLayer.resize(layerSpace);
+                convertSamples(layer.data(), SampleType::Float32, halfLayer.data(), layerSpace, sampleType);
+                samples = halfLayer.data();
+            }
+
+            if (bricks == nullptr) {
+                setLayers(samples, i, i + 1);
+            }
+            else {
+                memcpy(slab.data() + (i - zBegin) * layerBytes, samples, layerBytes);
+            }
+        }
+
+        if (failed) {
+            return;
+        }
+
+        if (bricks != nullptr) {
+            IoStats::Timer timer(sourceName.c_str(), IoStats::Stage::Copy);
+            setLayers(slab.data(), zBegin, zEnd);
+        }
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        stats.merge(bandStats, zBegin, zEnd);
+    });
+
+    if (failed) {
+        return false;
+    }
+
+    if (valuesRange != nullptr) {
+        *valuesRange = {stats.getMin(), stats.getMax()};
+    }
+
+    return true;
+}
+
+
+void VoxelContainer::addBandStats(VolumeStats& bandStats, const void* band, const int zBegin, const int zEnd) const {
+    const size_t layerSpace = size.x * size.y;
+    std::vector<float> layer;
+
+    for (int z = zBegin; z < zEnd; ++z) {
+        const size_t layerOffset = (z - zBegin) * layerSpace;
+
+        switch (sampleType) {
+            case SampleType::UInt8:
+                bandStats.addLayer(z, static_cast<const uint8_t*>(band) + layerOffset, layerSpace);
+                break;
+            case SampleType::UInt16:
+                bandStats.addLayer(z, static_cast<const uint16_t*>(band) + layerOffset, layerSpace);
+                break;
+            case SampleType::Float16:
+                layer.resize(layerSpace);
+                convertSamples(static_cast<const half*>(band) + layerOffset, sampleType, layer.data(), layerSpace, SampleType::Float32);
+                bandStats.addLayer(z, layer.data(), layerSpace);
+                break;
+            default:
+                bandStats.addLayer(z, static_cast<const float*>(band) + layerOffset, layerSpace);
+                break;
+        }
+    }
+}
+
+
+template<typename S>
+void VoxelContainer::collectStats() const {
+    const size_t layerSpace = size.x * size.y;
+    std::vector<S> layer(layerSpace);
+    const SampleType type = std::is_integral<S>::value ? sampleType : SampleType::Float32;
+
+    stats.reset(size.z);
+
+    for (int z = 0; z < size.z; ++z) {
+        copyLayers(layer.data(), z, z + 1, type);
+        stats.addLayer(z, layer.data(), layerSpace);
+    }
+}
+
+
+template<typename S>
+bool VoxelContainer::saveLayers(const std::string& dirName, const Vector3& size, const SampleType type, const LayerSource& getLayer, std::atomic<int>* savedLayers, const FileFormat format) {
+    std::string normDirName = dirName;
+    
+    if (normDirName.back() != '/') {
+        normDirName += "/";
+    }
+
+    if (format == FileFormat::Raw) {
+        const size_t layerBytes = size.x * size.y * sizeof(S);
+        RawFile file;
+
+        if (!file.create(normDirName + "volume.raw", size.z * layerBytes)) {
+            return false;
+        }
+
+        return writeLayers<S>(size, type, getLayer, [&file, layerBytes](const S* layer, const int z) {
+            return file.write(z * layerBytes, layer, layerBytes);
+        }, savedLayers);
+    }
+
+    if (format == FileFormat::Stack) {
+        TiffStack stack;
+
+        if (!stack.create(normDirName + "volume.tiff", size.x, size.y, size.z, 8 * sizeof(S), TiffStack::getFormatOf<S>())) {
+            return false;
+        }
+
+        return writeLayers<S>(size, type, getLayer, [&stack](const S* layer, const int z) {
+            return stack.writePage(z, layer);
+        }, savedLayers);
+    }
+
+    return writeLayers<S>(size, type, getLayer, [&normDirName, &size](const S* layer, const int z) {
+        std::string fileName = normDirName + std::to_string(z) + ".tiff";
+
+        if (!TiffImage<S>::save(fileName.c_str(), layer, size.x, size.y)) {
+            printf("Error: Unable to write image %s\n", fileName.data());
+            return false;
+        }
+
+        return true;
+    }, savedLayers);
+}
+
+
+template<typename S>
+bool VoxelContainer::saveChunks(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const LayerSource& getLayer, std::atomic<int>* savedLayers, const Range* storedRange) {
+    std::string fileName = dirName;
+
+    if (fileName.back() != '/') {
+        fileName += "/";
+    }
+
+    fileName += "volume.chunks";
+    mkdir(dirName.c_str(), ACCESSPERMS);
+
+    ChunkFile chunks(size.x, size.y, size.z, brickSize, sizeof(S));
+
+    if (!chunks.create(fileName)) {
+        return false;
+    }
+
+    // Layers are gathered into rows of chunks, which are compressed in parallel
+    const size_t layerSpace = size.x * size.y;
+    std::vector<S> band(ChunkFile::chunkSize * layerSpace);
+
+    for (int zBegin = 0; zBegin < size.z; zBegin += ChunkFile::chunkSize) {
+        const int zEnd = std::min<int>(zBegin + ChunkFile::chunkSize, size.z);
+
+        for (int z = zBegin; z < zEnd; ++z) {
+            getLayer(band.data() + (z - zBegin) * layerSpace, z, type);
+        }
+
+        if (!chunks.appendLayers(band.data(), zBegin, ThreadPool::getDefault())) {
+            return false;
+        }
+
+        if (savedLayers != nullptr) {
+            *savedLayers += zEnd - zBegin;
+        }
+    }
+
+    return writeInfo(dirName, size, range, type, FileFormat::Chunked, chunks.getOffsets(), storedRange);
+}
+
+
+template<typename S>
+bool VoxelContainer::writeLayers(const Vector3& size, const SampleType type, const LayerSource& getLayer, const std::function<bool(const S* layer, const int z)>& writeLayer, std::atomic<int>* savedLayers) {
+    const size_t layerSpace = size.x * size.y;
+    std::deque<std::pair<int, std::vector<S>>> queue;
+    std::vector<std::vector<S>> spareLayers;
+    std::mutex mutex;
+    std::condition_variable queueChanged;
+    std::atomic<bool> failed(false);
+    bool producing = true;
+
+    auto write = [&]() {
+        while (true) {
+            std::pair<int, std::vector<S>> layer;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queueChanged.wait(lock, [&]() { return !queue.empty() || !producing; });
+
+                if (queue.empty()) {
+                    return;
+                }
+
+                layer = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            queueChanged.notify_all();
+
+            if (failed) {
+                continue;
+            }
+
+            if (!writeLayer(layer.second.data(), layer.first)) {
+                failed = true;
+                continue;
+            }
+
+            if (savedLayers != nullptr) {
+                ++*savedLayers;
+            }
+
+            // Written buffers are reused by the next layers
+            std::lock_guard<std::mutex> lock(mutex);
+            spareLayers.push_back(std::move(layer.second));
+        }
+    };
+
+    std::vector<std::thread> writers;
+
+    for (int i = 0; i < saveWritersNum; ++i) {
+        writers.emplace_back(write);
+    }
+
+    for (int z = 0; z < size.z && !failed; ++z) {
+        std::vector<S> layer;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!spareLayers.empty()) {
+                layer = std::move(spareLayers.back());
+                spareLayers.pop_back();
+            }
+        }
+
+        layer.resize(layerSpace);
+        getLayer(layer.data(), z, type);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        queueChanged.wait(lock, [&]() { return static_cast<int>(queue.size()) < saveQueueLength || failed; });
+        queue.emplace_back(z, std::move(layer));
+        lock.unlock();
+        queueChanged.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        producing = false;
+    }
+
+    queueChanged.notify_all();
+
+    for (auto& writer : writers) {
+        writer.join();
+    }
+
+    return !failed;
+}
+
+
+bool VoxelContainer::getSlicePlane(const Vector3& size, const int planeId, const int sliceId, int* origin, int* du, int* dv, size_t& width, size_t& height) {
+    for (int i = 0; i < 3; ++i) {
+        origin[i] = 0;
+        du[i] = 0;
+        dv[i] = 0;
+    }
+
+    dv[2] = 1;
+    height = size.z;
+
+    switch (planeId) {
+        // Sagittal plane
+        case 0: {
+            if (sliceId < 0 || sliceId >= size.x) {
+                printf("Error: Slice %i out of X range [0, %lu]\n", sliceId, size.x);
+                fflush(stdout);
+                exit(1);
+            }
+
+            origin[0] = sliceId;
+            du[1] = 1;
+            width = size.y;
+            return true;
+        }
+
+        // Coronal plane
+        case 1: {
+            if (sliceId < 0 || sliceId >= size.y) {
+                printf("Error: Slice %i out of Y range [0, %lu]\n", sliceId, size.y);
+                fflush(stdout);
+                exit(1);
+            }
+
+            origin[1] = sliceId;
+            du[0] = 1;
+            width = size.x;
+            return true;
+        }
+
+        // Transverse plane
+        case 2: {
+            if (sliceId < 0 || sliceId >= size.z) {
+                printf("Error: Slice %i out of Z range [0, %lu]\n", sliceId, size.z);
+                fflush(stdout);
+                exit(1);
+            }
+
+            origin[2] = sliceId;
+            du[0] = 1;
+            dv[2] = 0;
+            dv[1] = 1;
+            width = size.x;
+            height = size.y;
+            return true;
+        }
+
+        // Diagonal plane
+        case 3: {
+            du[0] = 1;
+            du[1] = 1;
+            width = std::min(size.x, size.y);
+            return true;
+        }
+
+        // Diagonal plane
+        case 4: {
+            width = std::min(size.x, size.y);
+            origin[0] = width - 1;
+            du[0] = -1;
+            du[1] = 1;
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+
+VoxelContainer::Range VoxelContainer::getSliceWindow(const Range& window) {
+    // Degenerate window would divide by zero in Range::fit()
+    if (window.max > window.min) {
+        return window;
+    }
+
+    return {window.min, window.min + 1};
+}
+
+
+void VoxelContainer::setLayers(const void* src, const int zBegin, const int zEnd) {
+    const size_t layerSpace = size.x * size.y;
+    const size_t bytes = sampleSize();
+    unsigned char* dst = static_cast<unsigned char*>(data);
+
+    if (bricks != nullptr) {
+        setBrickLayers(src, zBegin, zEnd);
+        return;
+    }
+
+    if (layout == Layout::Linear) {
+        memcpy(dst + zBegin * layerSpace * bytes, src, (zEnd - zBegin) * layerSpace * bytes);
+        return;
+    }
+
+    // Scatter rows brick by brick
+    for (int z = zBegin; z < zEnd; ++z) {
+        for (int y = 0; y < size.y; ++y) {
+            const unsigned char* row = static_cast<const unsigned char*>(src) + ((z - zBegin) * layerSpace + y * size.x) * bytes;
+
+            for (int x = 0; x < size.x; x += brickSize) {
+                memcpy(dst + index(x, y, z) * bytes, row + x * bytes, std::min(brickSize, size.x - x) * bytes);
+            }
+        }
+    }
+}
+
+
+void VoxelContainer::copyBrickLayers(void* dst, const int zBegin, const int zEnd, const SampleType dstType) const {
+    const size_t layerSpace = size.x * size.y;
+    const size_t srcSampleSize = sampleSize();
+    const size_t dstSampleSize = getSampleSize(dstType);
+    const int mask = brickSize - 1;
+    std::vector<unsigned char> brick(brickVolume * srcSampleSize);
+
+    // Every touched brick is decompressed once, bypassing the cache
+    for (int bz = zBegin & ~mask; bz < zEnd; bz += brickSize) {
+        const int zFirst = std::max(zBegin, bz);
+        const int zLast = std::min(zEnd, bz + static_cast<int>(brickSize));
+
+        for (int by = 0; by < size.y; by += brickSize) {
+            const int yLast = std::min(size.y, by + brickSize);
+
+            for (int bx = 0; bx < size.x; bx += brickSize) {
+                const size_t count = std::min(brickSize, size.x - bx);
+                bricks->load(index(bx, by, bz) >> (3 * brickShift), brick.data());
+
+                for (int z = zFirst; z < zLast; ++z) {
+                    for (int y = by; y < yLast; ++y) {
+                        const unsigned char* srcRow = brick.data() + ((((z & mask) << brickShift) + (y & mask)) << brickShift) * srcSampleSize;
+                        unsigned char* dstRow = static_cast<unsigned char*>(dst) + ((z - zBegin) * layerSpace + y * size.x + bx) * dstSampleSize;
+                        convertSamples(srcRow, sampleType, dstRow, count, dstType);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+void VoxelContainer::setBrickLayers(const void* src, const int zBegin, const int zEnd) {
+    const size_t layerSpace = size.x * size.y;
+    const size_t bytes = sampleSize();
+    const int mask = brickSize - 1;
+    std::vector<unsigned char> brick(brickVolume * bytes);
+
+    // Bricks are compressed whole, so zBegin must be at the brick border
+    for (int bz = zBegin; bz < zEnd; bz += brickSize) {
+        const int zLast = std::min(zEnd, bz + static_cast<int>(brickSize));
+
+        for (int by = 0; by < size.y; by += brickSize) {
+            const int yLast = std::min(size.y, by + brickSize);
+
+            for (int bx = 0; bx < size.x; bx += brickSize) {
+                const size_t count = std::min(brickSize, size.x - bx);
+                std::fill(brick.begin(), brick.end(), 0);
+
+                for (int z = bz; z < zLast; ++z) {
+                    for (int y = by; y < yLast; ++y) {
+                        const unsigned char* srcRow = static_cast<const unsigned char*>(src) + ((z - zBegin) * layerSpace + y * size.x + bx) * bytes;
+                        memcpy(brick.data() + ((((z & mask) << brickShift) + (y & mask)) << brickShift) * bytes, srcRow, count * bytes);
+                    }
+                }
+
+                bricks->store(index(bx, by, bz) >> (3 * brickShift), brick.data());
+            }
+        }
+    }
+}
+
+
+size_t VoxelContainer::storedVolume() const {
+    if (layout == Layout::Linear) {
+        return size.volume();
+    }
+
+    // Bricks at the far borders are padded to the full size
+    const size_t bricksX = (size.x + brickSize - 1) >> brickShift;
+    const size_t bricksY = (size.y + brickSize - 1) >> brickShift;
+    const size_t bricksZ = (size.z + brickSize - 1) >> brickShift;
+
+    return (bricksX * bricksY * bricksZ) << (3 * brickShift);
+}
+
+
+bool VoxelContainer::hasVoxels() const {
+    return data != nullptr || bricks != nullptr;
+}
+
+
+bool VoxelContainer::allocate(std::string* cacheFileName) {
+    if (storage == Storage::Compressed) {
+        layout = Layout::Bricked;
+        bricks.reset(new BrickStore(storedVolume() / brickVolume, brickVolume, sampleSize()));
+
+        return true;
+    }
+
+    if (storage == Storage::Heap) {
+        data = alignedAlloc(storedVolume() * sampleSize());
+
+        if (data == nullptr) {
+            printf("Error: Unable to allocate %zu bytes\n", storedVolume() * sampleSize());
+            return false;
+        }
+
+        capacity = storedVolume();
+
+        return true;
+    }
+
+    std::string fileName = mappedFileName;
+    int fd = -1;
+
+    if (!fileName.empty()) {
+        fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    else if (cacheFileName != nullptr) {
+        // Cache is created under a unique name, the caller renames it when complete
+        std::string tmpName = *cacheFileName + "_XXXXXX";
+        fd = mkstemp(&tmpName[0]);
+        *cacheFileName = fd >= 0 ? tmpName : "";
+    }
+
+    if (fileName.empty() && fd < 0) {
+        // Anonymous backing file, removed as soon as it is unmapped, also if the cache can't be created
+        char tmpName[] = "/tmp/voxels_XXXXXX";
+        fd = mkstemp(tmpName);
+
+        if (fd >= 0) {
+            unlink(tmpName);
+        }
+    }
+
+    if (fd < 0) {
+        printf("Error: Unable to create mapped file %s\n", fileName.data());
+        return false;
+    }
+
+    size_t bytes = storedVolume() * sampleSize();
+
+    if (ftruncate(fd, bytes) != 0) {
+        printf("Error: Unable to resize mapped file %s to %lu bytes\n", fileName.data(), bytes);
+        close(fd);
+        return false;
+    }
+
+    void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        printf("Error: Unable to map file %s\n", fileName.data());
+        return false;
+    }
+
+    data = addr;
+    mappedBytes = bytes;
+
+    return true;
+}
+
+
+bool VoxelContainer::mapCache(const std::string& cacheFileName, const std::string& stamp) {
+    if (storage != Storage::Mapped || !mappedFileName.empty()) {
+        return false;
+    }
+
+    int fd = open(cacheFileName.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    // Cache is valid only if the stamp of the source files follows the voxels
+    size_t bytes = storedVolume() * sampleSize();
+    struct stat cacheStat;
+    std::string cacheStamp(stamp.size(), '\0');
+
+    if (fstat(fd, &cacheStat) != 0 || static_cast<size_t>(cacheStat.st_size) != bytes + stamp.size() ||
+        pread(fd, &cacheStamp[0], stamp.size(), bytes) != static_cast<ssize_t>(stamp.size()) || cacheStamp != stamp) {
+        close(fd);
+        return false;
+    }
+
+    // Private mapping keeps changes of the voxels out of the cache
+    void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    data = addr;
+    mappedBytes = bytes;
+
+    return true;
+}
+
+
+bool VoxelContainer::commitCache(const std::string& tmpFileName, const std::string& cacheFileName, const std::string& stamp) {
+    size_t bytes = storedVolume() * sampleSize();
+    int fd = open(tmpFileName.c_str(), O_WRONLY);
+    bool written = fd >= 0 && pwrite(fd, stamp.data(), stamp.size(), bytes) == static_cast<ssize_t>(stamp.size());
+
+    // Temporary file is private, while the cache is shared like the files created by the process
+    static const mode_t fileMask = []() {
+        const mode_t mask = umask(0);
+        umask(mask);
+        return mask;
+    }();
+
+    written = written && fchmod(fd, 0644 & ~fileMask) == 0;
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    // Decoded voxels stay valid in memory even if the cache can't be kept
+    if (!written || rename(tmpFileName.c_str(), cacheFileName.c_str()) != 0) {
+        unlink(tmpFileName.c_str());
+        return true;
+    }
+
+    // Voxels are remapped privately from the complete cache, its pages are still in memory
+    void* decoded = data;
+    const size_t decodedBytes = mappedBytes;
+
+    if (!mapCache(cacheFileName, stamp)) {
+        // Decoded voxels are kept, but changes of them mustn't reach the cache
+        unlink(cacheFileName.c_str());
+        return true;
+    }
+
+    munmap(decoded, decodedBytes);
+
+    return true;
+}
+
+
+std::string VoxelContainer::getCacheStamp(const std::string& infoFileName, const std::vector<std::string>& sourceNames) {
+    std::string stamp;
+    struct stat fileStat;
+
+    if (stat(infoFileName.c_str(), &fileStat) != 0) {
+        return "";
+    }
+
+    stamp = infoFileName + " " + std::to_string(fileStat.st_size) + " " + std::to_string(fileStat.st_mtim.tv_sec) + "." + std::to_string(fileStat.st_mtim.tv_nsec) + "\n";
+
+    for (const auto& name : sourceNames) {
+        if (stat(name.c_str(), &fileStat) != 0) {
+            return "";
+        }
+
+        stamp += name + " " + std::to_string(fileStat.st_size) + " " + std::to_string(fileStat.st_mtim.tv_sec) + "." + std::to_string(fileStat.st_mtim.tv_nsec) + "\n";
+    }
+
+    return stamp;
+}
+
+
+bool VoxelContainer::convertVoxels(const Layout _layout, const SampleType _sampleType) {
+    // Named mapped file backs the current voxels, the new mapping would truncate it
+    if (storage == Storage::Mapped && !mappedFileName.empty()) {
+        printf("Error: Unable to convert voxels mapped to %s\n", mappedFileName.data());
+        return false;
+    }
+
+    VoxelContainer converted;
+    converted.storage = storage;
+    converted.layout = _layout;
+    converted.sampleType = _sampleType;
+    converted.size = size;
+
+    if (!converted.allocate()) {
+        return false;
+    }
+
+    // Voxels are passed by bands of bricks, so no full copy of a mapped volume becomes resident on the heap
+    std::vector<unsigned char> band(brickSize * size.x * size.y * getSampleSize(_sampleType));
+
+    for (int zBegin = 0; zBegin < size.z; zBegin += brickSize) {
+        const int zEnd = std::min<int>(size.z, zBegin + brickSize);
+        copyLayers(band.data(), zBegin, zEnd, _sampleType);
+        converted.setLayers(band.data(), zBegin, zEnd);
+    }
+
+    release();
+
+    data = converted.data;
+    bricks = std::move(converted.bricks);
+    layout = converted.layout;
+    sampleType = converted.sampleType;
+    mappedBytes = converted.mappedBytes;
+    capacity = converted.capacity;
+
+    converted.data = nullptr;
+    converted.mappedBytes = 0;
+    converted.capacity = 0;
+
+    return true;
+}
+
+
+void VoxelContainer::release() {
+    if (mappedBytes > 0) {
+        munmap(data, mappedBytes);
+        mappedBytes = 0;
+    }
+    else {
+        alignedFree(data);
+    }
+
+    data = nullptr;
+    bricks.reset();
+    capacity = 0;
+}
+
+
+void substract(const VoxelContainer& a, const VoxelContainer& b, VoxelContainer& dst) {
+    VoxelContainer::Vector3 aSize = a.getSize();
+    VoxelContainer::Vector3 bSize = b.getSize();
+
+    if (aSize.x != bSize.x || aSize.y != bSize.y || aSize.z != bSize.z) {
+        return;
+    }
+
+    if (!dst.reshape(aSize, a.getRange())) {
+        return;
+    }
 
     for (int z = 0; z < aSize.z; ++z) {
         for (int y = 0; y < aSize.y; ++y) {
             for (int x = 0; x < aSize.x; ++x) {
-                dst.at(x, y, z) = a.at(x, y, z) - b.at(x, y, z);
+                dst.set(x, y, z, a.get(x, y, z) - b.get(x, y, z));
             }
         }
     }
@@ -1,23 +1,56 @@
 #ifndef VOXELCONTAINER_H
 #define VOXELCONTAINER_H
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
+#include "aligned_memory.h"
+#include "brick_store.h"
+#include "chunk_file.h"
+#include "half.h"
+#include "raw_file.h"
+#include "thread_pool.h"
 #include "tiff_image.h"
+#include "tiff_stack.h"
+#include "volume_stats.h"
+
+
+class VoxelView;
 
 
 /**
  * \brief Special data structure for storing 3D reconstructions.
  * 
  * VoxelContainer stores a 3D volume of CT reconstruction as an one-dimensional
- * array of float values representing each voxel. There are several ways to
+ * array of values representing each voxel. Values are kept in the sample type
+ * of the source images (8 or 16-bit unsigned integers, otherwise float), or in
+ * any other type set by setSampleType(). There are several ways to
  * initialize it:
  * - Create an empty one using VoxelContainer().
  * - Read it from the list of images using VoxelContainer(const std::vector<std::string>&)
  *   for new or loadFromImages(const std::vector<std::string>&) for an existing one.
  * - Create it on existing data using VoxelContainer(float*, const Vector3&, const Range&, const StitchParams&).
  * - Read it from the special parameters file using loadFromJson(const std::string&).
+ *   Parameters point to a set of slice images, a single multi-page TIFF stack,
+ *   a raw data file or a file of compressed chunks, see FileFormat.
  * - Reallocate empty memory using create(const Vector3&, const Range&).
+ *
+ * Voxels are kept on the heap by default. Call setStorage() with
+ * Storage::Mapped before loading or creating to keep them in a memory-mapped
+ * file instead, so that the kernel pages voxels in on demand and volumes
+ * larger than RAM can be opened. Storage::Compressed keeps bricks losslessly
+ * compressed in memory and decompresses only the ones being accessed.
+ *
+ * Voxels are laid out in z-y-x order by default. Layout::Bricked groups them
+ * into cubic bricks of brickSize voxels per side instead, so that slices in
+ * any plane touch compact memory regions. Use index() to address the buffer
+ * returned by getData() independently of the layout.
  */
 class VoxelContainer {
 public:
@@ -50,11 +83,85 @@ public:
         float fit(float val, const Range nr) const;
     };
 
-    /// Structure for storing transformation params of the reconstruction.
+    /// Memory backing of the voxel buffer.
+    enum class Storage {
+        Heap,      ///< Buffer is allocated on the heap
+        Mapped,    ///< Buffer is mapped from a file on disk
+        Compressed ///< Bricks are compressed in memory, see BrickStore
+    };
+
+    /// Order of voxels in the buffer.
+    enum class Layout {
+        Linear, ///< Voxels are stored in z-y-x order
+        Bricked ///< Voxels are grouped into cubic bricks, each stored in z-y-x order
+    };
+
+    /// Type of voxel values in the buffer.
+    enum class SampleType {
+        Float32, ///< 32-bit float
+        UInt8,   ///< 8-bit unsigned integer
+        UInt16,  ///< 16-bit unsigned integer
+        Float16  ///< 16-bit float, see half
+    };
+
+    /// Layout of saved volume files.
+    enum class FileFormat {
+        Slices, ///< Every layer is a separate TIFF image
+        Stack,  ///< Layers are pages of a single TIFF file, see TiffStack
+        Raw,    ///< Samples of any type in z-y-x order in a single file, see RawFile
+        Chunked ///< Compressed cubic chunks indexed in the parameters file, see ChunkFile
+    };
+
+    /// Conversion of voxel values into saved samples.
+    struct SaveMapping {
+        SampleType type; ///< Type of saved samples
+        Range range;     ///< Saved values the volume range is linearly mapped to
+    };
+
+    /// Log2 of the brick side for Layout::Bricked.
+    static const size_t brickShift = 4;
+
+    /// Brick side for Layout::Bricked.
+    static const size_t brickSize = 1 << brickShift;
+
+    /**
+     * \brief Structure for storing transformation params of the reconstruction.
+     *
+     * Offsets are kept as whole voxels plus the remaining fractions in
+     * [-0.5, 0.5], so placement by whole voxels stays exact and sub-voxel
+     * parts are resampled only where present. Params initialized with the
+     * whole offsets only have zero fractions.
+     */
     struct StitchParams {
         int offsetX;
         int offsetY;
         int offsetZ;
+        float fractionX;
+        float fractionY;
+        float fractionZ;
+
+        /**
+         * \brief Makes params of offsets given in voxels.
+         *
+         * \param[in] x, y, z Offsets along the axes, rounded to the nearest whole voxels
+         * \return Stitch params.
+         */
+        static StitchParams fromOffsets(const float x, const float y, const float z);
+
+        /**
+         * \brief Checks if offsets are whole voxels.
+         *
+         * \return True - if all fractions are zero, false - otherwise.
+         */
+        bool isWhole() const;
+
+        /**
+         * \brief Sums offsets, carrying whole voxels out of the fractions.
+         *
+         * \param[in] other Offsets to be added
+         * \return Sum of offsets.
+         */
+        StitchParams operator+(const StitchParams& other) const;
     };
     
     /// Default constructor. Creates an empty instance.
@@ -70,7 +177,7 @@ public:
     /**
      * \brief Constructs container on existing data.
      * 
-     * \param[in] _data Allocated memory buffer of _size.volume() size
+     * \param[in] _data Memory buffer of _size.volume() size allocated with alignedAlloc()
      * \param[in] _size Size of the given data
      * \param[in] _range Range of the given data
      * \param[in] _refParams Rederence transformation parameters
@@ -85,17 +192,52 @@ public:
      */
     VoxelContainer(const Vector3& _size, const Range& _range = {0, 0});
 
+    /**
+     * \brief Move constructor. Takes the data buffer leaving other empty.
+     * 
+     * \param[in] other Container to move from
+     */
+    VoxelContainer(VoxelContainer&& other) noexcept;
+
+    /// Containers own large buffers, so they are never copied implicitly.
+    VoxelContainer(const VoxelContainer&) = delete;
+
     /// Destructor.
     ~VoxelContainer();
 
+    /**
+     * \brief Move assignment. Takes the data buffer leaving other empty.
+     * 
+     * \param[in] other Container to move from
+     * \return Reference to this container.
+     */
+    VoxelContainer& operator=(VoxelContainer&& other) noexcept;
+
+    /// Containers own large buffers, so they are never copied implicitly.
+    VoxelContainer& operator=(const VoxelContainer&) = delete;
+
     /**
      * \brief Reads reconstruction from horizontal slice images.
      * 
+     * A single file is read as a multi-page TIFF stack with a layer per page.
+     * 
      * \param[in] fileNames List of images paths
      * \return True - if success, false - if failed.
      */
     bool loadFromImages(const std::vector<std::string>& fileNames);
 
+    /**
+     * \brief Reads a region of the reconstruction from horizontal slice images.
+     *
+     * See loadFromJson(const std::string&, const Vector3&, const Vector3&).
+     *
+     * \param[in] fileNames List of images paths
+     * \param[in] regionOrigin First voxel of the region
+     * \param[in] regionSize Size of the region
+     * \return True - if success, false - if failed.
+     */
+    bool loadFromImages(const std::vector<std::string>& fileNames, const Vector3& regionOrigin, const Vector3& regionSize);
+
     /**
      * \brief Reads reconstruction from the special parameters file.
      * 
@@ -104,21 +246,249 @@ public:
      */
     bool loadFromJson(const std::string& fileName);
 
+    /**
+     * \brief Reads reconstruction reusing bands of it read before.
+     *
+     * Layers covered by the bands, read by loadFromJson(const std::string&, const int, const int)
+     * from the same parameters file, are copied from them, so only the
+     * remaining layers are read from disk. Bands not covering whole layers
+     * are ignored. The bands must not be changed until the load is finished.
+     *
+     * \param[in] fileName Path to the parameters file
+     * \param[in] loadedBands Bands of the reconstruction already read, might be empty
+     * \return True - if success, false - if failed.
+     */
+    bool loadFromJson(const std::string& fileName, const std::vector<const VoxelContainer*>& loadedBands);
+
+    /**
+     * \brief Reads a band of horizontal layers of the reconstruction.
+     *
+     * Only images of the band are read, so parts of reconstructions larger
+     * than memory can be processed. Reference offset along z is shifted by
+     * zBegin to keep the band placement in the whole reconstruction.
+     *
+     * \param[in] fileName Path to the parameters file
+     * \param[in] zBegin First layer of the band
+     * \param[in] zEnd Layer after the last one of the band
+     * \return True - if success, false - if failed.
+     */
+    bool loadFromJson(const std::string& fileName, const int zBegin, const int zEnd);
+
+    /**
+     * \brief Reads a region of the reconstruction.
+     *
+     * Only the layers of the region are read, and raw and chunked files are
+     * read by rows or chunks intersecting the region, so estimation on small
+     * parts of large archives touches a small fraction of the files. The
+     * container gets the size of the region, while getFullSize() and
+     * getRegionOrigin() keep its placement in the whole reconstruction.
+     * Reference offsets are shifted by the region origin along every axis,
+     * so voxels of the region are placed where they are in the whole one.
+     *
+     * \param[in] fileName Path to the parameters file
+     * \param[in] regionOrigin First voxel of the region
+     * \param[in] regionSize Size of the region
+     * \return True - if success, false - if failed.
+     */
+    bool loadFromJson(const std::string& fileName, const Vector3& regionOrigin, const Vector3& regionSize);
+
+    /**
+     * \brief Reads a downsampled preview of the reconstruction.
+     *
+     * Only every scale-th layer is read, and its blocks of scale x scale
+     * voxels are averaged while decoding, so the preview is ready after
+     * reading a small part of the files. Reference stitch parameters are
+     * divided by scale to keep placement of the preview among other
+     * previews of the same scale. getFullSize() gives the size of the whole
+     * reconstruction.
+     *
+     * \param[in] fileName Path to the parameters file
+     * \param[in] scale Downsampling factor along every axis
+     * \return True - if success, false - if failed.
+     */
+    bool loadPreviewFromJson(const std::string& fileName, const int scale);
+
+    /**
+     * \brief Reads parameters of the reconstruction without its voxels.
+     *
+     * Size, range, reference stitch parameters and sample type are set,
+     * while the container stays empty.
+     *
+     * \param[in] fileName Path to the parameters file
+     * \return True - if success, false - if failed.
+     */
+    bool loadInfoFromJson(const std::string& fileName);
+
     /**
      * \brief Saves reconstruction into special format.
      * 
      * \param[in] fileName Path to the parameters file
+     * \param[in] format Layout of the saved files
+     * \param[in] mapping Conversion of values into saved samples, might be nullptr to save them as they are
      * \return True - if success, false - if failed.
      */
-    bool saveToJson(const std::string& dirName);
+    bool saveToJson(const std::string& dirName, const FileFormat format = FileFormat::Slices, const SaveMapping* mapping = nullptr);
+
+    /**
+     * \brief Saves reconstruction into special format in the background.
+     *
+     * See the static saveToJsonAsync(). The container must not be changed
+     * or destroyed until the save is finished.
+     *
+     * \param[in] dirName Path to the output directory
+     * \param[out] savedLayers Counter of written layers, might be nullptr
+     * \param[in] format Layout of the saved files
+     * \param[in] mapping Conversion of values into saved samples, might be nullptr to save them as they are
+     * \return Future giving true - if success, false - if failed.
+     */
+    std::future<bool> saveToJsonAsync(const std::string& dirName, std::atomic<int>* savedLayers = nullptr, const FileFormat format = FileFormat::Slices, const SaveMapping* mapping = nullptr) const;
+
+    /**
+     * \brief Selects memory backing for the subsequent allocations.
+     *
+     * With Storage::Mapped the voxels are stored in a file mapped into the
+     * address space. When loading from JSON without an explicit file name,
+     * the decoded volume is cached next to the parameters file in the
+     * 'voxels[_bricked]_<type>.cache' file, e.g. 'voxels_bricked_uint16.cache'.
+     * Cached voxels are mapped as they are, so the name includes the layout
+     * and the sample type they are stored in, and containers configured
+     * differently keep separate caches of the same volume. The cache is
+     * reused by the next load while the parameters and volume files keep
+     * their sizes and modification times. The cache is
+     * renamed into place only once decoded completely and is mapped
+     * privately, so changes of the voxels don't reach it. Otherwise, or if
+     * the directory isn't writable, an unlinked temporary file is used.
+     *
+     * With Storage::Compressed the voxels are always bricked and there is no
+     * voxels buffer, so getData(), getRawData() and at() are not available.
+     * Values are accessed with get(), set(), copyLayers() and getSlice(),
+     * which decompress only the touched bricks. This typically shrinks
+     * reconstructions with large air regions several times at the cost of
+     * slower voxel access. Volumes saved with FileFormat::Chunked are opened
+     * lazily with this storage: loadFromJson() reads only the index, and
+     * chunks are read when their voxels are accessed for the first time.
+     *
+     * \param[in] _storage Memory backing
+     * \param[in] _mappedFileName Path to the backing file for Storage::Mapped
+     */
+    void setStorage(const Storage _storage, const std::string& _mappedFileName = "");
+
+    /**
+     * \brief Gives memory backing of the container.
+     *
+     * \return Memory backing.
+     */
+    Storage getStorage() const;
+
+    /**
+     * \brief Selects pool of threads decoding images.
+     *
+     * Images are decoded in parallel by bands of brickSize layers. The pool
+     * must outlive loads of the container.
+     *
+     * \param[in] pool Thread pool, nullptr selects ThreadPool::getDefault()
+     */
+    void setThreadPool(ThreadPool* pool);
+
+    /**
+     * \brief Selects direct I/O for raw data files.
+     *
+     * Linear containers read and write raw files straight from the voxels
+     * buffer by large aligned requests. With direct I/O they bypass the page
+     * cache as well, which is faster for volumes read once and keeps the cache
+     * for other data.
+     *
+     * \param[in] _directIo Use direct I/O
+     */
+    void setDirectIo(const bool _directIo);
+
+    /**
+     * \brief Selects voxels layout.
+     *
+     * Applies to the subsequent loads and allocations. If the container is
+     * not empty its voxels are reordered to the new layout by bands of
+     * bricks into newly allocated memory of the same storage. Voxels mapped
+     * to a file given to setStorage() are not reordered, as the file backs
+     * them, and the layout stays unchanged.
+     *
+     * \param[in] _layout Voxels layout
+     */
+    void setLayout(const Layout _layout);
+
+    /**
+     * \brief Gives voxels layout of the container.
+     *
+     * \return Voxels layout.
+     */
+    Layout getLayout() const;
+
+    /**
+     * \brief Selects type of voxel values.
+     *
+     * Applies to the subsequent allocations. Loading from images or JSON
+     * detects the type from the files instead. If the container is not empty
+     * its values are converted to the new type by bands of bricks, as
+     * setLayout() reorders them, integers are rounded and clamped.
+     *
+     * \param[in] _sampleType Type of voxel values
+     */
+    void setSampleType(const SampleType _sampleType);
+
+    /**
+     * \brief Gives type of voxel values.
+     *
+     * \return Type of voxel values.
+     */
+    SampleType getSampleType() const;
+
+    /**
+     * \brief Gives size of a single voxel value in bytes.
+     *
+     * \return Size of voxel value.
+     */
+    size_t sampleSize() const;
+
+    /**
+     * \brief Gives size of a single value of the sample type in bytes.
+     *
+     * \param[in] type Sample type
+     * \return Size of value.
+     */
+    static size_t getSampleSize(const SampleType type);
+
+    /**
+     * \brief Converts values between sample types.
+     *
+     * \param[in] src Source values
+     * \param[in] srcType Type of source values
+     * \param[in] dst Destination buffer
+     * \param[in] count Number of values
+     * \param[in] dstType Type of destination values
+     */
+    static void convertSamples(const void* src, const SampleType srcType, void* dst, const size_t count, const SampleType dstType);
 
     /**
      * \brief Reallocates empty memory of given size.
      * 
      * \param[in] _size Size to allocate
      * \param[in] _range Initial range of data
+     * \return True - if success, false - if memory can't be allocated, the container is left empty.
+     */
+    bool create(const Vector3& _size, const Range& _range = {0, 0});
+
+    /**
+     * \brief Changes size keeping allocated memory if it is large enough.
+     * 
+     * Unlike create() values are left uninitialized, so the caller must
+     * overwrite the whole volume. Memory is reallocated only if the new size
+     * needs more of it, which allows reusing the same container as a
+     * workspace for volumes of varying size.
+     * 
+     * \param[in] _size New size
+     * \param[in] _range Initial range of data
+     * \return True - if success, false - if memory can't be allocated, the container is left empty.
      */
-    void create(const Vector3& _size, const Range& _range = {0, 0});
+    bool reshape(const Vector3& _size, const Range& _range = {0, 0});
 
     /// Clears container deallocating memory.
     void clear();
@@ -133,6 +503,8 @@ public:
     /**
      * \brief Voxel access by its 3D index.
      *
+     * Valid only for SampleType::Float32 containers without Storage::Compressed.
+     *
      * \return Reference to voxel value.
      */
     float& at(const int x, const int y, const int z);
@@ -140,17 +512,68 @@ public:
     /**
      * \brief Constant voxel access by its 3D index.
      *
+     * Valid only for SampleType::Float32 containers without Storage::Compressed.
+     *
      * \return Constant reference to voxel value.
      */
     const float& at(const int x, const int y, const int z) const;
 
+    /**
+     * \brief Gives voxel value of any sample type by its 3D index.
+     *
+     * \return Voxel value converted to float.
+     */
+    float get(const int x, const int y, const int z) const;
+
+    /**
+     * \brief Sets voxel value of any sample type by its 3D index.
+     *
+     * \param[in] val Value to be converted to the sample type
+     */
+    void set(const int x, const int y, const int z, const float val);
+
+    /**
+     * \brief Gives position of the voxel in the buffer.
+     *
+     * \param[in] x, y, z 3D index of the voxel
+     * \return Offset of the voxel from the beginning of getData().
+     */
+    size_t index(const size_t x, const size_t y, const size_t z) const;
+
     /**
      * \brief Voxels buffer access.
      *
-     * \return Pointer to the buffer.
+     * The buffer is ordered according to getLayout(). Use index() to address
+     * it. Valid only for SampleType::Float32 containers.
+     *
+     * \return Pointer to the buffer or nullptr for other sample types or Storage::Compressed.
      */
     float* getData() const;
 
+    /**
+     * \brief Voxels buffer access for any sample type.
+     *
+     * \return Pointer to the buffer of getSampleType() values or nullptr for Storage::Compressed.
+     */
+    void* getRawData() const;
+
+    /**
+     * \brief Gives memory occupied by voxels.
+     *
+     * \return Size in bytes.
+     */
+    size_t getStoredBytes() const;
+
+    /**
+     * \brief Copies horizontal layers in z-y-x order regardless of the layout.
+     *
+     * \param[in] dst Destination buffer of (zEnd - zBegin) layers size
+     * \param[in] zBegin First layer to copy
+     * \param[in] zEnd Layer after the last one to copy
+     * \param[in] dstType Type of values in the destination buffer
+     */
+    void copyLayers(void* dst, const int zBegin, const int zEnd, const SampleType dstType) const;
+
     /**
      * \brief Gives container size.
      *
@@ -158,6 +581,29 @@ public:
      */
     const Vector3& getSize() const;
 
+    /**
+     * \brief Gives size of the whole reconstruction.
+     *
+     * \return Size of the reconstruction the container was read from, or
+     *         container size if it was read or created whole.
+     */
+    const Vector3& getFullSize() const;
+
+    /**
+     * \brief Gives placement of the container in the whole reconstruction.
+     *
+     * \return First voxel of the region read by the region or band loads,
+     *         zeros otherwise.
+     */
+    const Vector3& getRegionOrigin() const;
+
+    /**
+     * \brief Gives downsampling factor of the preview.
+     *
+     * \return Scale given to loadPreviewFromJson(), 1 for other containers.
+     */
+    int getPreviewScale() const;
+
     /**
      * \brief Gives container range.
      *
@@ -165,6 +611,20 @@ public:
      */
     const Range& getRange() const;
 
+    /**
+     * \brief Gives statistics of voxel values.
+     *
+     * Statistics are collected in the same pass with reading images, or by
+     * one pass over the data on the first request otherwise. Later changes
+     * of voxels through at(), set() or getRawData() are not reflected.
+     * The first request may come from several threads at once. Statistics
+     * of a container being loaded are incomplete, so it must not be queried
+     * until the load is finished.
+     *
+     * \return Value statistics.
+     */
+    const VolumeStats& getStats() const;
+
     /**
      * \brief Gives reference stitch parameters.
      *
@@ -209,131 +669,333 @@ public:
     template<typename T>
     void getSlice(TiffImage<T>& img, const int planeId, const int sliceId, bool fitToRange = true) const;
 
+    /**
+     * \brief Gives a specified slice with values windowed to the data type.
+     *
+     * Values of the window are stretched to the whole range of T, values
+     * outside of it are clamped. Usually the window is taken from
+     * getStats() percentiles to suppress hot pixels.
+     *
+     * \param[in] img Destination image of slice
+     * \param[in] planeId Index of the slice plane, same as for getSlice()
+     * \param[in] sliceId Index of the slice. Must be inside container borders
+     * \param[in] window Range of values to be displayed
+     */
+    template<typename T>
+    void getSlice(TiffImage<T>& img, const int planeId, const int sliceId, const Range& window) const;
+
+    /**
+     * \brief Gives geometry of a slice plane.
+     *
+     * Slice pixel (u, v) corresponds to voxel origin + u * du + v * dv. Exits
+     * if the slice is out of the volume borders.
+     *
+     * \param[in] size Volume size
+     * \param[in] planeId Index of the slice plane, see getSlice()
+     * \param[in] sliceId Index of the slice
+     * \param[out] origin Voxel of the first slice pixel
+     * \param[out] du Voxel step along the slice row
+     * \param[out] dv Voxel step along the slice column
+     * \param[out] width Slice width
+     * \param[out] height Slice height
+     * \return True - if plane exists, false - if not.
+     */
+    static bool getSlicePlane(const Vector3& size, const int planeId, const int sliceId, int* origin, int* du, int* dv, size_t& width, size_t& height);
+
+    /// Function writing layer z of the volume into dst converted to the given sample type.
+    using LayerSource = std::function<void(void* dst, const int z, const SampleType type)>;
+
+    /// Number of threads encoding and writing images of a save.
+    static const int saveWritersNum = 4;
+
+    /// Number of layers waiting for the writers, bounds memory of a save.
+    static const int saveQueueLength = 2 * saveWritersNum;
+
+    /**
+     * \brief Saves a volume provided layer by layer into special format.
+     *
+     * Layers are requested from the source one at a time in z order by the
+     * calling thread, so the volume never has to be allocated as a whole and
+     * the source needs no locking. Requested layers are queued and written
+     * by saveWritersNum threads, so getting layers overlaps with encoding
+     * and writing images. Pages of FileFormat::Stack and layers of
+     * FileFormat::Raw are laid out in advance, so they are written in parallel
+     * as well. TIFF files keep half values as float, raw files keep any type.
+     *
+     * With a mapping each layer is requested as float, mapped from the volume
+     * range onto the mapping range and converted to the mapping type before
+     * it is queued. The mapping range is recorded in the parameters file, so
+     * loadFromJson() restores the original values as float.
+     *
+     * \param[in] dirName Path to the output directory
+     * \param[in] size Volume size
+     * \param[in] range Volume range
+     * \param[in] type Sample type of the written images
+     * \param[in] getLayer Source of layers
+     * \param[out] savedLayers Counter of written layers, might be nullptr
+     * \param[in] format Layout of the saved files
+     * \param[in] mapping Conversion of values into saved samples replacing type, might be nullptr
+     * \return True - if success, false - if failed.
+     */
+    static bool saveToJson(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const LayerSource& getLayer, std::atomic<int>* savedLayers = nullptr, const FileFormat format = FileFormat::Slices, const SaveMapping* mapping = nullptr);
+
+    /**
+     * \brief Saves a volume provided layer by layer in the background.
+     *
+     * Same as saveToJson() run by a new thread. The source and the counter
+     * must stay valid until the future is ready.
+     *
+     * \param[in] dirName Path to the output directory
+     * \param[in] size Volume size
+     * \param[in] range Volume range
+     * \param[in] type Sample type of the written images
+     * \param[in] getLayer Source of layers
+     * \param[out] savedLayers Counter of written layers, might be nullptr
+     * \param[in] format Layout of the saved files
+     * \param[in] mapping Conversion of values into saved samples replacing type, might be nullptr
+     * \return Future giving true - if success, false - if failed.
+     */
+    static std::future<bool> saveToJsonAsync(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const LayerSource& getLayer, std::atomic<int>* savedLayers = nullptr, const FileFormat format = FileFormat::Slices, const SaveMapping* mapping = nullptr);
+
 //    QPixmap getXSlice(const int sliceId); // Sagittal plane
 //    QPixmap getYSlice(const int sliceId); // Coronal plane
 //    QPixmap getZSlice(const int sliceId); // Transverse plane
 
 private:
-    bool readImages(const std::vector<std::string>& fileNames);
-    bool writeImages(const std::string& dirName);
+    friend class VoxelView;
+
+    /// Function reading layer z of the source files into dst of the given sample type.
+    using LayerReader = std::function<bool(void* dst, const int z, const SampleType type)>;
+
+    /// Function reading layers [zBegin, zEnd) of the source files into dst in z-y-x order of the stored type.
+    using BulkReader = std::function<bool(void* dst, const int zBegin, const int zEnd)>;
+
+    /// Function reading a region of the source files into dst in z-y-x order of the stored type.
+    using RegionReader = std::function<bool(void* dst, const Vector3& regionOrigin, const Vector3& regionSize)>;
 
-    float* data = nullptr;
+    /// Readers of the volume files given by the parameters file.
+    struct VolumeFiles {
+        LayerReader readLayer;
+        RegionReader readRegion;
+        BrickStore::Loader loadBricks;
+        std::vector<std::string> sourceNames;
+    };
+
+    template<typename S>
+    bool readLayers(const LayerReader& readLayer, Range* valuesRange);
+    template<typename S>
+    static bool writeLayers(const Vector3& size, const SampleType type, const LayerSource& getLayer, const std::function<bool(const S* layer, const int z)>& writeLayer, std::atomic<int>* savedLayers);
+    template<typename S>
+    static bool saveLayers(const std::string& dirName, const Vector3& size, const SampleType type, const LayerSource& getLayer, std::atomic<int>* savedLayers, const FileFormat format);
+    template<typename S>
+    static bool saveChunks(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const LayerSource& getLayer, std::atomic<int>* savedLayers, const Range* storedRange);
+    template<typename T>
+    void getRegionSlice(TiffImage<T>& img, const int planeId, const int sliceId, const Range& srcRange, const Range& newRange, const bool clamp, const Vector3& regionOrigin, const Vector3& regionSize) const;
+    template<typename S, typename T>
+    void fillSlice(const S* src, T* bits, const size_t width, const size_t height, const int* origin, const int* du, const int* dv, const Range& srcRange, const Range& newRange, const bool clamp) const;
+    void addBandStats(VolumeStats& bandStats, const void* band, const int zBegin, const int zEnd) const;
+    template<typename S>
+    void collectStats() const;
+    template<typename T>
+    static Range getTypeRange();
+    static Range getSliceWindow(const Range& window);
+
+    static bool writeInfo(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const FileFormat format, const std::vector<uint64_t>& chunkOffsets = {}, const Range* storedRange = nullptr);
+    static bool saveVolume(const std::string& dirName, const Vector3& size, const Range& range, const SampleType type, const LayerSource& getSourceLayer, std::atomic<int>* savedLayers, const FileFormat format, const Range* storedRange);
+    bool saveRaw(const std::string& dirName, std::atomic<int>* savedLayers) const;
+    bool readInfo(const std::string& fileName, VolumeFiles& files);
+    void mapStoredValues(VolumeFiles& files, const Range& storedRange);
+    void reuseBands(VolumeFiles& files, const std::vector<const VoxelContainer*>& loadedBands) const;
+    bool openImages(const std::vector<std::string>& fileNames, LayerReader& readLayer);
+    bool openStack(const std::string& fileName, Vector3& stackSize, LayerReader& readLayer);
+    bool openRaw(const std::string& fileName, const bool littleEndian, LayerReader& readLayer, RegionReader& readRegion);
+    bool openChunks(const std::string& fileName, const std::vector<uint64_t>& offsets, VolumeFiles& files);
+    bool openImageFiles(const std::vector<std::string>& fileNames, LayerReader& readLayer);
+    bool readVolume(const LayerReader& readLayer, const BulkReader& readBulk, Range* valuesRange = nullptr);
+    bool readVolumeRegion(const VolumeFiles& files, const Vector3& regionOrigin, const Vector3& regionSize, Range* valuesRange = nullptr);
+    bool detectSampleType(const std::string& fileName);
+    void selectSampleType(const uint16_t sampleFormat, const uint16_t bitsPerSample);
+    bool readImages(const LayerReader& readLayer, Range* valuesRange = nullptr);
+    void setLayers(const void* src, const int zBegin, const int zEnd);
+    void copyBrickLayers(void* dst, const int zBegin, const int zEnd, const SampleType dstType) const;
+    void setBrickLayers(const void* src, const int zBegin, const int zEnd);
+    size_t storedVolume() const;
+    bool hasVoxels() const;
+    bool allocate(std::string* cacheFileName = nullptr);
+    bool convertVoxels(const Layout _layout, const SampleType _sampleType);
+    bool mapCache(const std::string& cacheFileName, const std::string& stamp);
+    bool commitCache(const std::string& tmpFileName, const std::string& cacheFileName, const std::string& stamp);
+    static std::string getCacheStamp(const std::string& infoFileName, const std::vector<std::string>& sourceNames);
+    void release();
+
+    void* data = nullptr;
+    std::unique_ptr<BrickStore> bricks;
+    SampleType sampleType = SampleType::Float32;
+    Storage storage = Storage::Heap;
+    Layout layout = Layout::Linear;
+    ThreadPool* threadPool = nullptr;
+    bool directIo = false;
+    std::string mappedFileName;
+    std::string sourceName;
+    size_t mappedBytes = 0;
+    size_t capacity = 0;
     Vector3 size = {0, 0, 0};
+    Vector3 fullSize = {0, 0, 0};
+    Vector3 origin = {0, 0, 0};
+    int previewScale = 1;
     Range range = {0, 0};
     StitchParams referenceParams = {0, 0, 0};
     StitchParams estimatedParams = {0, 0, 0};
+    mutable VolumeStats stats;
+    mutable std::mutex statsMutex;
 };
 
 
 void substract(const VoxelContainer& a, const VoxelContainer& b, VoxelContainer& dst);
 
 
-template<typename T>
-void VoxelContainer::getSlice(TiffImage<T>& img, const int planeId, const int sliceId, bool fitToRange) const {
-    if (data == nullptr) {
-        img.clear();
-        return;
+/**
+ * \brief Converts float value to the voxel sample type.
+ *
+ * Integer types are rounded and clamped to their limits, NaN gives zero.
+ *
+ * \param[in] val Value to be converted
+ * \return Sample value.
+ */
+template<typename S>
+inline S toSample(const float val) {
+    if (!(val > std::numeric_limits<S>::min())) {
+        return std::numeric_limits<S>::min();
+    }
+
+    if (val >= std::numeric_limits<S>::max()) {
+        return std::numeric_limits<S>::max();
     }
 
-    Range newRange = range;
+    return static_cast<S>(val + 0.5f);
+}
 
-    if (fitToRange) {
-        newRange.max = std::numeric_limits<T>::max();
-        newRange.min = std::numeric_limits<T>::min();
+
+template<>
+inline float toSample<float>(const float val) {
+    return val;
+}
+
+
+template<>
+inline half toSample<half>(const float val) {
+    return half(val);
+}
+
+
+inline size_t VoxelContainer::index(const size_t x, const size_t y, const size_t z) const {
+    if (layout == Layout::Linear) {
+        return (z * size.y + y) * size.x + x;
     }
 
-    switch (planeId) {
-        // Sagittal plane
-        case 0: {
-            if (sliceId < 0 || sliceId >= size.x) {
-                printf("Error: Slice %i out of X range [0, %lu]\n", sliceId, size.x);
-                fflush(stdout);
-                exit(1);
-            }
+    const size_t bricksX = (size.x + brickSize - 1) >> brickShift;
+    const size_t bricksY = (size.y + brickSize - 1) >> brickShift;
+    const size_t brickId = ((z >> brickShift) * bricksY + (y >> brickShift)) * bricksX + (x >> brickShift);
+    const size_t mask = brickSize - 1;
 
-            img.resize(size.y, size.z);
-            T* bits = img.getData();
+    return (brickId << (3 * brickShift)) + ((((z & mask) << brickShift) + (y & mask)) << brickShift) + (x & mask);
+}
 
-            for (int z = 0; z < size.z; ++z) {
-                for (int y = 0; y < size.y; ++y) {
-                    bits[z * size.y + y] = range.fit(data[z * size.x * size.y + y * size.x + sliceId], newRange);
-                }
-            }
 
-            return;
-        }
+template<typename T>
+void VoxelContainer::getSlice(TiffImage<T>& img, const int planeId, const int sliceId, bool fitToRange) const {
+    getRegionSlice(img, planeId, sliceId, range, fitToRange ? getTypeRange<T>() : range, false, {0, 0, 0}, size);
+}
 
-        // Coronal plane
-        case 1: {
-            if (sliceId < 0 || sliceId >= size.y) {
-                printf("Error: Slice %i out of Y range [0, %lu]\n", sliceId, size.y);
-                fflush(stdout);
-                exit(1);
-            }
 
-            img.resize(size.x, size.z);
-            T* bits = img.getData();
+template<typename T>
+void VoxelContainer::getSlice(TiffImage<T>& img, const int planeId, const int sliceId, const Range& window) const {
+    getRegionSlice(img, planeId, sliceId, getSliceWindow(window), getTypeRange<T>(), true, {0, 0, 0}, size);
+}
 
-            for (int z = 0; z < size.z; ++z) {
-                for (int x = 0; x < size.x; ++x) {
-                    bits[z * size.x + x] = range.fit(data[z * size.x * size.y + sliceId * size.y + x], newRange);
-                }
-            }
 
-            return;
-        }
+template<typename T>
+VoxelContainer::Range VoxelContainer::getTypeRange() {
+    return {static_cast<float>(std::numeric_limits<T>::min()), static_cast<float>(std::numeric_limits<T>::max())};
+}
 
-        // Transverse plane
-        case 2: {
-            if (sliceId < 0 || sliceId >= size.z) {
-                printf("Error: Slice %i out of Z range [0, %lu]\n", sliceId, size.z);
-                fflush(stdout);
-                exit(1);
-            }
 
-            img.resize(size.x, size.y);
-            T* bits = img.getData();
+template<typename T>
+void VoxelContainer::getRegionSlice(TiffImage<T>& img, const int planeId, const int sliceId, const Range& srcRange, const Range& newRange, const bool clamp, const Vector3& regionOrigin, const Vector3& regionSize) const {
+    if (!hasVoxels()) {
+        img.clear();
+        return;
+    }
 
-            for (int y = 0; y < size.y; ++y) {
-                for (int x = 0; x < size.x; ++x) {
-                    bits[y * size.x + x] = range.fit(data[sliceId * size.x * size.y + y * size.x + x], newRange);
-                }
-            }
+    // Slice pixel (u, v) maps to voxel origin + u * du + v * dv
+    int origin[3];
+    int du[3];
+    int dv[3];
+    size_t width = 0;
+    size_t height = 0;
 
-            return;
-        }
+    if (!getSlicePlane(regionSize, planeId, sliceId, origin, du, dv, width, height)) {
+        img.clear();
+        return;
+    }
 
-        // Diagonal plane
-        case 3: {
-            img.resize(size.y, size.z);
-            T* bits = img.getData();
+    origin[0] += regionOrigin.x;
+    origin[1] += regionOrigin.y;
+    origin[2] += regionOrigin.z;
 
-            for (int z = 0; z < size.z; ++z) {
-                for (int y = 0; y < size.y; ++y) {
-                    bits[z * size.y + y] = range.fit(data[z * size.x * size.y + y * size.x + y], newRange);
-                }
-            }
+    img.resize(width, height);
+    T* bits = img.getData();
 
-            return;
-        }
+    // Compressed voxels are read through the brick cache
+    if (bricks != nullptr) {
+        fillSlice(static_cast<const float*>(nullptr), bits, width, height, origin, du, dv, srcRange, newRange, clamp);
+        return;
+    }
 
-        // Diagonal plane
-        case 4: {
-            img.resize(size.x, size.z);
-            T* bits = img.getData();
+    switch (sampleType) {
+        case SampleType::Float32:
+            fillSlice(static_cast<const float*>(data), bits, width, height, origin, du, dv, srcRange, newRange, clamp);
+            break;
 
-            for (int z = 0; z < size.z; ++z) {
-                for (int x = 0; x < size.x; ++x) {
-                    bits[z * size.x + x] = range.fit(data[z * size.x * size.y + x * size.y + size.x - x - 1], newRange);
+        case SampleType::UInt8:
+            fillSlice(static_cast<const uint8_t*>(data), bits, width, height, origin, du, dv, srcRange, newRange, clamp);
+            break;
+
+        case SampleType::UInt16:
+            fillSlice(static_cast<const uint16_t*>(data), bits, width, height, origin, du, dv, srcRange, newRange, clamp);
+            break;
+
+        case SampleType::Float16:
+            fillSlice(static_cast<const half*>(data), bits, width, height, origin, du, dv, srcRange, newRange, clamp);
+            break;
+    }
+}
+
+
+template<typename S, typename T>
+void VoxelContainer::fillSlice(const S* src, T* bits, const size_t width, const size_t height, const int* origin, const int* du, const int* dv, const Range& srcRange, const Range& newRange, const bool clamp) const {
+    // Walk the slice in brick-sized tiles, so each brick is fetched once
+    for (size_t v0 = 0; v0 < height; v0 += brickSize) {
+        const size_t vEnd = std::min(v0 + brickSize, height);
+
+        for (size_t u0 = 0; u0 < width; u0 += brickSize) {
+            const size_t uEnd = std::min(u0 + brickSize, width);
+
+            for (size_t v = v0; v < vEnd; ++v) {
+                for (size_t u = u0; u < uEnd; ++u) {
+                    const size_t x = origin[0] + u * du[0] + v * dv[0];
+                    const size_t y = origin[1] + u * du[1] + v * dv[1];
+                    const size_t z = origin[2] + u * du[2] + v * dv[2];
+                    float val = srcRange.fit(src != nullptr ? static_cast<float>(src[index(x, y, z)]) : get(x, y, z), newRange);
+
+                    if (clamp) {
+                        val = std::min(std::max(val, newRange.min), newRange.max);
+                    }
+
+                    bits[v * width + u] = val;
                 }
             }
-
-            return;
         }
-
-        default:
-            img.clear();
-            return;
     }
 }
 
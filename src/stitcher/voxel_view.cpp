@@ -0,0 +1,83 @@
+#include <algorithm>
+#include "voxel_view.h"
+
+
+VoxelView::VoxelView(const VoxelContainer& _volume) :
+    volume(&_volume),
+    size(_volume.getSize()) {}
+
+
+VoxelView::VoxelView(const VoxelContainer& _volume, const VoxelContainer::Vector3& _origin, const VoxelContainer::Vector3& _size) :
+    volume(&_volume),
+    origin(_origin),
+    size(_size) {}
+
+
+VoxelView VoxelView::region(const VoxelContainer::Vector3& _origin, const VoxelContainer::Vector3& _size) const {
+    // Region is clipped by the view, so it never reaches voxels outside of it
+    const VoxelContainer::Vector3 first = {std::min(_origin.x, size.x), std::min(_origin.y, size.y), std::min(_origin.z, size.z)};
+    const VoxelContainer::Vector3 extent = {std::min(_size.x, size.x - first.x), std::min(_size.y, size.y - first.y), std::min(_size.z, size.z - first.z)};
+
+    return VoxelView(*volume, {origin.x + first.x, origin.y + first.y, origin.z + first.z}, extent);
+}
+
+
+VoxelView VoxelView::band(const int zBegin, const int zEnd) const {
+    const int first = std::max(0, std::min(zBegin, static_cast<int>(size.z)));
+    const int last = std::max(first, std::min(zEnd, static_cast<int>(size.z)));
+
+    return region({0, 0, static_cast<size_t>(first)}, {size.x, size.y, static_cast<size_t>(last - first)});
+}
+
+
+bool VoxelView::isEmpty() const {
+    return volume == nullptr || size.volume() == 0;
+}
+
+
+const VoxelContainer& VoxelView::getVolume() const {
+    return *volume;
+}
+
+
+const VoxelContainer::Vector3& VoxelView::getOrigin() const {
+    return origin;
+}
+
+
+const VoxelContainer::Vector3& VoxelView::getSize() const {
+    return size;
+}
+
+
+const VoxelContainer::Range& VoxelView::getRange() const {
+    return volume->getRange();
+}
+
+
+VoxelContainer::SampleType VoxelView::getSampleType() const {
+    return volume->getSampleType();
+}
+
+
+float VoxelView::get(const int x, const int y, const int z) const {
+    return volume->get(x + origin.x, y + origin.y, z + origin.z);
+}
+
+
+const void* VoxelView::getRawData() const {
+    if (volume == nullptr || volume->getLayout() != VoxelContainer::Layout::Linear) {
+        return nullptr;
+    }
+
+    const unsigned char* data = static_cast<const unsigned char*>(volume->getRawData());
+
+    return data + volume->index(origin.x, origin.y, origin.z) * volume->sampleSize();
+}
+
+
+VoxelContainer::Vector3 VoxelView::getStrides() const {
+    const VoxelContainer::Vector3& volumeSize = volume->getSize();
+
+    return {1, volumeSize.x, volumeSize.x * volumeSize.y};
+}
@@ -0,0 +1,184 @@
+#ifndef VOXEL_VIEW_H
+#define VOXEL_VIEW_H
+
+#include "voxel_container.h"
+
+
+/**
+ * \brief Non-owning view of a box-shaped region of a VoxelContainer.
+ *
+ * VoxelView is defined by the origin and extents of the region inside the
+ * viewed container and addresses voxels relative to its origin, so code
+ * working on a part of a reconstruction (like an overlap band) does not need
+ * to copy it or to track offsets. Views are cheap to copy and must not
+ * outlive the viewed container. A VoxelContainer converts to a view of
+ * itself implicitly.
+ */
+class VoxelView {
+public:
+    /// Default constructor. Creates an empty view.
+    VoxelView() = default;
+
+    /**
+     * \brief Constructs view of the whole container.
+     *
+     * \param[in] _volume Viewed container
+     */
+    VoxelView(const VoxelContainer& _volume);
+
+    /**
+     * \brief Constructs view of the container region.
+     *
+     * \param[in] _volume Viewed container
+     * \param[in] _origin First voxel of the region in the container
+     * \param[in] _size Size of the region, must fit into the container
+     */
+    VoxelView(const VoxelContainer& _volume, const VoxelContainer::Vector3& _origin, const VoxelContainer::Vector3& _size);
+
+    /**
+     * \brief Gives view of a region inside this view.
+     *
+     * The region is clipped by the borders of this view, so its parts
+     * outside of them are dropped and the view might become empty.
+     *
+     * \param[in] _origin First voxel of the region relative to this view
+     * \param[in] _size Size of the region
+     * \return View of the region.
+     */
+    VoxelView region(const VoxelContainer::Vector3& _origin, const VoxelContainer::Vector3& _size) const;
+
+    /**
+     * \brief Gives view of horizontal layers of this view.
+     *
+     * Layers are clamped to [0, size.z], so an inverted band or a band out
+     * of the view gives an empty view.
+     *
+     * \param[in] zBegin First layer of the band
+     * \param[in] zEnd Layer after the last one of the band
+     * \return View of the band.
+     */
+    VoxelView band(const int zBegin, const int zEnd) const;
+
+    /**
+     * \brief Checks if view is empty.
+     *
+     * \return True - if empty, false - if not.
+     */
+    bool isEmpty() const;
+
+    /**
+     * \brief Gives viewed container.
+     *
+     * \return Viewed container.
+     */
+    const VoxelContainer& getVolume() const;
+
+    /**
+     * \brief Gives origin of the view in the viewed container.
+     *
+     * \return First voxel of the view.
+     */
+    const VoxelContainer::Vector3& getOrigin() const;
+
+    /**
+     * \brief Gives view size.
+     *
+     * \return View size.
+     */
+    const VoxelContainer::Vector3& getSize() const;
+
+    /**
+     * \brief Gives range of the viewed container.
+     *
+     * \return Range of values.
+     */
+    const VoxelContainer::Range& getRange() const;
+
+    /**
+     * \brief Gives sample type of the viewed container.
+     *
+     * \return Sample type.
+     */
+    VoxelContainer::SampleType getSampleType() const;
+
+    /**
+     * \brief Gives voxel value by its 3D index in the view.
+     *
+     * \return Voxel value converted to float.
+     */
+    float get(const int x, const int y, const int z) const;
+
+    /**
+     * \brief Gives data of the first voxel of the view.
+     *
+     * Data is available only for the viewed containers with
+     * VoxelContainer::Layout::Linear, use getStrides() to walk it.
+     *
+     * \return Pointer to the first voxel or nullptr if data is not linear.
+     */
+    const void* getRawData() const;
+
+    /**
+     * \brief Gives distances between neighbouring voxels in the data.
+     *
+     * \return Strides along x, y and z in samples.
+     */
+    VoxelContainer::Vector3 getStrides() const;
+
+    /**
+     * \brief Gives a specified slice of the view.
+     *
+     * Same as VoxelContainer::getSlice() applied to the region.
+     *
+     * \param[in] img Destination image of slice
+     * \param[in] planeId Index of the slice plane
+     * \param[in] sliceId Index of the slice. Must be inside view borders
+     * \param[in] fitToRange Is needed to fit slice to the range of its data type
+     */
+    template<typename T>
+    void getSlice(TiffImage<T>& img, const int planeId, const int sliceId, bool fitToRange = true) const;
+
+    /**
+     * \brief Gives a specified slice of the view with values windowed to the data type.
+     *
+     * Same as VoxelContainer::getSlice() with window applied to the region.
+     *
+     * \param[in] img Destination image of slice
+     * \param[in] planeId Index of the slice plane
+     * \param[in] sliceId Index of the slice. Must be inside view borders
+     * \param[in] window Range of values to be displayed
+     */
+    template<typename T>
+    void getSlice(TiffImage<T>& img, const int planeId, const int sliceId, const VoxelContainer::Range& window) const;
+
+private:
+    const VoxelContainer* volume = nullptr;
+    VoxelContainer::Vector3 origin = {0, 0, 0};
+    VoxelContainer::Vector3 size = {0, 0, 0};
+};
+
+
+template<typename T>
+void VoxelView::getSlice(TiffImage<T>& img, const int planeId, const int sliceId, bool fitToRange) const {
+    if (volume == nullptr) {
+        img.clear();
+        return;
+    }
+
+    const VoxelContainer::Range& range = volume->getRange();
+    volume->getRegionSlice(img, planeId, sliceId, range, fitToRange ? VoxelContainer::getTypeRange<T>() : range, false, origin, size);
+}
+
+
+template<typename T>
+void VoxelView::getSlice(TiffImage<T>& img, const int planeId, const int sliceId, const VoxelContainer::Range& window) const {
+    if (volume == nullptr) {
+        img.clear();
+        return;
+    }
+
+    volume->getRegionSlice(img, planeId, sliceId, VoxelContainer::getSliceWindow(window), VoxelContainer::getTypeRange<T>(), true, origin, size);
+}
+
+
+#endif // VOXEL_VIEW_H
@@ -2,6 +2,7 @@
 #include <fstream>
 #include <chrono>
 #include <stitcher/nlohmann/json.hpp>
+#include "io_stats.h"
 #include "stitcher.h"
 #include "separation_stitcher.h"
 #include "direct_alignment_stitcher.h"
@@ -28,6 +29,8 @@ int main(int argc, char *argv[]) {
         "pores_2_x256",
     };
 
+    IoStats::setEnabled(true);
+
     for (std::string& recon_name : recons_names) {
         // Parse JSON parameters
         std::string recon_path = "../testing/" + recon_name;
@@ -48,6 +51,7 @@ int main(int argc, char *argv[]) {
 
         // Load reconstructions
         std::vector<std::shared_ptr<VoxelContainer>> recons(parts_num);
+        IoStats::reset();
 
         for (int part_id = 0; part_id < parts_num; ++part_id) {
             std::string recon_part_path = recon_path + "/source/" + std::to_string(part_id) + "/info.json";
@@ -55,6 +59,8 @@ int main(int argc, char *argv[]) {
             recons[part_id]->loadFromJson(recon_part_path);
         }
 
+        IoStats::writeReport(recon_path + "/io.json");
+
         // Stitch
         for (auto stitcher : stitchers) {
             std::string recon_result_path = recon_path + "/" + stitcher.second;
@@ -62,6 +68,13 @@ int main(int argc, char *argv[]) {
             auto result_recon = stitcher.first->stitch(recons);
             std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
             float time = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+            IoStats::reset();
+
+            if (result_recon == nullptr) {
+                printf("%s %s. Failed to stitch\n", recon_name.data(), stitcher.second.data());
+                continue;
+            }
+
             result_recon->saveToJson(recon_result_path);
 
             printf("%s %s. Time: %f\n", recon_name.data(), stitcher.second.data(), time);
@@ -70,9 +83,9 @@ int main(int argc, char *argv[]) {
             std::vector<json> params_data_vec(parts_num);
             for (int part_id = 0; part_id < parts_num; ++part_id) {
                 auto params = recons[part_id]->getEstStitchParams();
-                params_data_vec[part_id]["offset_x"] = params.offsetX;
-                params_data_vec[part_id]["offset_y"] = params.offsetY;
-                params_data_vec[part_id]["offset_z"] = params.offsetZ;
+                params_data_vec[part_id]["offset_x"] = params.offsetX + params.fractionX;
+                params_data_vec[part_id]["offset_y"] = params.offsetY + params.fractionY;
+                params_data_vec[part_id]["offset_z"] = params.offsetZ + params.fractionZ;
             }
 
             json params_data;
@@ -86,6 +99,9 @@ int main(int argc, char *argv[]) {
             }
             pfs << params_data.dump(4) << std::endl;
 
+            // Dump I/O timings of the save, loading ones are in io.json of the reconstruction
+            IoStats::writeReport(recon_result_path + "/io.json");
+
             // Write slice image
             TiffImage<uint8_t> img;
             result_recon->getSlice<uint8_t>(img, 0, result_recon->getSize().x / 2, true);
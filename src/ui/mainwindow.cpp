@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <iterator>
 #include <QDebug>
@@ -11,10 +12,19 @@
 using json = nlohmann::json;
 
 
+/// Downsampling factor of scans shown while the full ones are loaded.
+static const int previewScale = 4;
+
+
+static QString getSizeText(const VoxelContainer::Vector3& size) {
+    return QString::number(size.x) + "x" + QString::number(size.y) + "x" + QString::number(size.z);
+}
+
+
 MainWindow::MainWindow(AlgoList* stitchAlgos_, QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
-    stitchedScan(std::make_shared<VoxelContainer>()),
+    stitchedScan(std::make_shared<CompositeVolume>()),
     stitchAlgos(stitchAlgos_),
     stitcher(stitchAlgos_->first().first) {
     ui->setupUi(this);
@@ -30,10 +40,23 @@ MainWindow::MainWindow(AlgoList* stitchAlgos_, QWidget *parent) :
         SIGNAL(rowsMoved(QModelIndex, int, int, QModelIndex, int)),
         this,
         SLOT(on_scansListrowsMoved(QModelIndex, int, int, QModelIndex, int)));
+
+    connect(&saveTimer, SIGNAL(timeout()), this, SLOT(checkSaveProgress()));
+    connect(&loadTimer, SIGNAL(timeout()), this, SLOT(checkLoadProgress()));
 }
 
 
 MainWindow::~MainWindow() {
+    // Saving thread refers to the saved scan and the progress counter
+    if (saveResult.valid()) {
+        saveResult.wait();
+    }
+
+    // Loading thread fills the full scans
+    if (loadResult.valid()) {
+        loadResult.wait();
+    }
+
     delete ui;
 }
 
@@ -107,7 +130,10 @@ void MainWindow::updateSliceBounds(int plane) {
 
 void MainWindow::updateDisplay(int plane, int slice) {
     TiffImage<uint8_t> img;
-    stitchedScan->getSlice<uint8_t>(img, plane, slice, true);
+
+    // Window by percentiles, so single hot voxels do not darken the slice
+    const VolumeStats& stats = stitchedScan->getStats();
+    stitchedScan->getSlice<uint8_t>(img, plane, slice, {stats.getPercentile(0.001), stats.getPercentile(0.999)});
     currSliceItem.setPixmap(QPixmap::fromImage(QImage(img.getData(), img.getWidth(), img.getHeight(), QImage::Format_Grayscale8)));
 
     // Fit slice into view frame
@@ -115,16 +141,22 @@ void MainWindow::updateDisplay(int plane, int slice) {
 }
 
 
-void MainWindow::updateStitch() {
-    if (partialScans.size() > 0) {
-        stitchedScan = stitcher->stitch(partialScans);
+void MainWindow::updateStitch(std::shared_ptr<CompositeVolume> composite) {
+    if (composite != nullptr) {
+        stitchedScan = composite;
+    }
+    else if (partialScans.size() > 0) {
+        composite = stitcher->compose(partialScans);
 
-        if (stitchedScan == nullptr) {
+        if (composite == nullptr) {
             return;
         }
+
+        stitchedScan = composite;
     }
     else {
-        stitchedScan->clear();
+        // Scan might be still referenced by the background save
+        stitchedScan = std::make_shared<CompositeVolume>();
     }
 
     int plane = ui->slicePlaneBox->currentIndex();
@@ -135,19 +167,29 @@ void MainWindow::updateStitch() {
 
 
 void MainWindow::appendScansList() {
-    auto scanShape = partialScans.back()->getSize();
+    auto scan = partialScans.back();
+    QString label = "Scan " + QString::number(partialScans.size()) + "   " + getSizeText(scan->getSize());
+
+    if (scan->getPreviewScale() > 1) {
+        label += " (preview)";
+    }
 
     // Add new scan to visible list
-    new QListWidgetItem(
-        "Scan " +
-        QString::number(partialScans.size()) +
-        "   " +
-        QString::number(scanShape.x) +
-        "x" +
-        QString::number(scanShape.y) +
-        "x" +
-        QString::number(scanShape.z),
-        ui->scansList);
+    new QListWidgetItem(label, ui->scansList);
+}
+
+
+std::shared_ptr<VoxelContainer> MainWindow::newScan() {
+    auto scan = std::make_shared<VoxelContainer>();
+
+    if (ui->actionMappedStorage->isChecked()) {
+        scan->setStorage(VoxelContainer::Storage::Mapped);
+    }
+    else if (ui->actionCompressedStorage->isChecked()) {
+        scan->setStorage(VoxelContainer::Storage::Compressed);
+    }
+
+    return scan;
 }
 
 
@@ -200,41 +242,65 @@ void MainWindow::on_fileLoadButton_clicked() {
             return;
         }
 
+        std::vector<std::string> info_files;
+
         if (data.contains("parts_num")) {
-            // Try to load several reconstructions from common parameters file
+            // Several reconstructions are described by the common parameters file
             int parts_num = data["parts_num"].get<int>();
             std::string param_path = json_file.substr(0, json_file.find_last_of('/') + 1);
 
             for (int part_id = 0; part_id < parts_num; ++part_id) {
-                // Try to load part reconstruction from parameters
-                partialScans.emplace_back(std::make_shared<VoxelContainer>());
-                std::string part_info_file = param_path + std::to_string(part_id) + "/info.json";
+                info_files.push_back(param_path + std::to_string(part_id) + "/info.json");
+            }
+        }
+        else {
+            info_files.push_back(json_file);
+        }
+
+        // Previews are not mixed with full scans, loading is disabled until previews are replaced
+        if (ui->actionPreviewLoad->isChecked() && partialScans.empty()) {
+            loadPreviews(info_files);
+            updateStitch();
+            return;
+        }
 
-                if (!partialScans.back()->loadFromJson(part_info_file)) {
-                    partialScans.pop_back();
-                    QMessageBox::information(nullptr, "Load error", QString("Unable to load from JSON file '%1'").arg(part_info_file.data()));
-                    return;
-                }
+        std::vector<std::shared_ptr<VoxelContainer>> parts;
 
-                appendScansList();
+        for (size_t part_id = 0; part_id < info_files.size(); ++part_id) {
+            parts.emplace_back(newScan());
+        }
+
+        // Parts stitched alone are estimated on their overlaps while being loaded
+        std::shared_ptr<CompositeVolume> composite;
+
+        if (partialScans.empty() && parts.size() > 1) {
+            composite = stitcher->composeFromJson(info_files, parts);
+
+            if (composite == nullptr) {
+                QMessageBox::information(nullptr, "Load error", QString("Unable to load parts from JSON file '%1'").arg(json_file.data()));
+                return;
             }
         }
-        else {
-            // Try to load reconstruction from parameters
-            partialScans.emplace_back(std::make_shared<VoxelContainer>());
 
-            if (!partialScans.back()->loadFromJson(json_file)) {
-                partialScans.pop_back();
-                QMessageBox::information(nullptr, "Load error", QString("Unable to load from JSON file '%1'").arg(json_file.data()));
+        for (size_t part_id = 0; part_id < parts.size(); ++part_id) {
+            // Try to load part reconstruction from parameters
+            if (composite == nullptr && !parts[part_id]->loadFromJson(info_files[part_id])) {
+                QMessageBox::information(nullptr, "Load error", QString("Unable to load from JSON file '%1'").arg(info_files[part_id].data()));
                 return;
             }
 
+            partialScans.push_back(parts[part_id]);
             appendScansList();
         }
+
+        if (composite != nullptr) {
+            updateStitch(composite);
+            return;
+        }
     }
     else {
         // Try to load reconstruction from chosen images
-        partialScans.emplace_back(std::make_shared<VoxelContainer>());
+        partialScans.emplace_back(newScan());
 
         if (!partialScans.back()->loadFromImages(fileNamesStd)) {
             partialScans.pop_back();
@@ -249,6 +315,88 @@ void MainWindow::on_fileLoadButton_clicked() {
 }
 
 
+void MainWindow::loadPreviews(const std::vector<std::string>& infoFiles) {
+    for (const std::string& info_file : infoFiles) {
+        auto preview = std::make_shared<VoxelContainer>();
+
+        if (!preview->loadPreviewFromJson(info_file, previewScale)) {
+            QMessageBox::information(nullptr, "Load error", QString("Unable to load from JSON file '%1'").arg(info_file.data()));
+            break;
+        }
+
+        partialScans.push_back(preview);
+        appendScansList();
+        previewScans.push_back(preview);
+        loadingScans.push_back(newScan());
+    }
+
+    if (previewScans.empty()) {
+        return;
+    }
+
+    // Full scans are loaded in the background and replace the previews when ready
+    std::vector<std::string> files(infoFiles.begin(), std::next(infoFiles.begin(), loadingScans.size()));
+    std::vector<std::shared_ptr<VoxelContainer>> scans = loadingScans;
+
+    // Nothing else is loaded until the previews are replaced, so they are never mixed with full scans
+    ui->fileLoadButton->setEnabled(false);
+
+    loadResult = std::async(std::launch::async, [files, scans]() {
+        for (size_t scan_id = 0; scan_id < scans.size(); ++scan_id) {
+            if (!scans[scan_id]->loadFromJson(files[scan_id])) {
+                return false;
+            }
+        }
+
+        return true;
+    });
+
+    loadTimer.start(200);
+}
+
+
+void MainWindow::checkLoadProgress() {
+    if (loadResult.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        if (savingScan == nullptr) {
+            ui->statusbar->showMessage("Loading full resolution scans");
+        }
+
+        return;
+    }
+
+    loadTimer.stop();
+
+    if (savingScan == nullptr) {
+        ui->statusbar->clearMessage();
+    }
+
+    if (!loadResult.get()) {
+        QMessageBox::information(nullptr, "Load error", QString("Unable to load full resolution scans, previews are kept."));
+    }
+    else {
+        // Previews might be moved or removed by the user meanwhile
+        for (size_t scan_id = 0; scan_id < previewScans.size(); ++scan_id) {
+            auto it = std::find(partialScans.begin(), partialScans.end(), previewScans[scan_id]);
+
+            if (it == partialScans.end()) {
+                continue;
+            }
+
+            *it = loadingScans[scan_id];
+
+            QListWidgetItem* item = ui->scansList->item(std::distance(partialScans.begin(), it));
+            item->setText(item->text().section("   ", 0, 0) + "   " + getSizeText((*it)->getSize()));
+        }
+
+        updateStitch();
+    }
+
+    previewScans.clear();
+    loadingScans.clear();
+    ui->fileLoadButton->setEnabled(true);
+}
+
+
 void MainWindow::on_sliceSpinBox_valueChanged(int slice) {
     updateDisplay(ui->slicePlaneBox->currentIndex(), slice);
 }
@@ -295,7 +443,7 @@ void MainWindow::on_algorithmBox_currentIndexChanged(int index) {
 
 
 void MainWindow::on_actionSave_triggered() {
-    if (stitchedScan->isEmpty()) {
+    if (stitchedScan->isEmpty() || savingScan != nullptr) {
         return;
     }
 
@@ -308,10 +456,42 @@ void MainWindow::on_actionSave_triggered() {
         return;
     }
 
-    if (!stitchedScan->saveToJson(dirName.toStdString())) {
-        QMessageBox::information(nullptr, "Save error", QString("An error occured while image writing."));
+    // Composite keeps its parts and placement until the save is finished
+    savingScan = stitchedScan;
+    savedLayers = 0;
+    VoxelContainer::FileFormat format = VoxelContainer::FileFormat::Slices;
+
+    if (ui->actionStackFormat->isChecked()) {
+        format = VoxelContainer::FileFormat::Stack;
+    }
+    else if (ui->actionRawFormat->isChecked()) {
+        format = VoxelContainer::FileFormat::Raw;
     }
+    else if (ui->actionChunkedFormat->isChecked()) {
+        format = VoxelContainer::FileFormat::Chunked;
+    }
+
+    // Range of the volume is spread over all 16-bit values
+    const VoxelContainer::SaveMapping mapping = {VoxelContainer::SampleType::UInt16, {0, 65535}};
+
+    saveResult = savingScan->saveToJsonAsync(dirName.toStdString(), &savedLayers, format, ui->actionSave16Bit->isChecked() ? &mapping : nullptr);
+    saveTimer.start(200);
+}
+
 
+void MainWindow::checkSaveProgress() {
+    if (saveResult.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        ui->statusbar->showMessage("Saving: " + QString::number(savedLayers) + " / " + QString::number(savingScan->getSize().z) + " slices");
+        return;
+    }
+
+    saveTimer.stop();
+    savingScan.reset();
+    ui->statusbar->clearMessage();
+
+    if (!saveResult.get()) {
+        QMessageBox::information(nullptr, "Save error", QString("An error occured while image writing."));
+    }
 }
 
 
@@ -372,7 +552,8 @@ void MainWindow::on_actionExportSlice_triggered() {
     int plane = ui->slicePlaneBox->currentIndex();
     int slice = ui->sliceSpinBox->value();
     TiffImage<uint8_t> img;
-    stitchedScan->getSlice<uint8_t>(img, plane, slice, true);
+    const VolumeStats& stats = stitchedScan->getStats();
+    stitchedScan->getSlice<uint8_t>(img, plane, slice, {stats.getPercentile(0.001), stats.getPercentile(0.999)});
     img.saveAs(fileName.toStdString().c_str());
 }
 
@@ -1,13 +1,17 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include <atomic>
+#include <future>
 #include <memory>
 #include <vector>
 #include <QGraphicsScene>
 #include <QMainWindow>
 #include <QGraphicsPixmapItem>
 #include <QList>
+#include <QTimer>
 #include <QWheelEvent>
+#include "composite_volume.h"
 #include "stitcher.h"
 #include "voxel_container.h"
 
@@ -39,13 +43,17 @@ private slots:
     void on_actionSave_triggered();
     void on_actionSaveSlice_triggered();
     void on_actionExportSlice_triggered();
+    void checkSaveProgress();
+    void checkLoadProgress();
 
 private:
     void updateSeamHighlight(int state);
     void updateSliceBounds(int plane);
     void updateDisplay(int plane, int slice);
-    void updateStitch();
+    void updateStitch(std::shared_ptr<CompositeVolume> composite = nullptr);
     void appendScansList();
+    void loadPreviews(const std::vector<std::string>& infoFiles);
+    std::shared_ptr<VoxelContainer> newScan();
     void wheelEvent(QWheelEvent* event);
 
     Ui::MainWindow *ui;
@@ -55,7 +63,19 @@ private:
     std::vector<QGraphicsRectItem*> seamHighlights;
 
     std::vector<std::shared_ptr<VoxelContainer>> partialScans;
-    std::shared_ptr<VoxelContainer> stitchedScan;
+    std::shared_ptr<CompositeVolume> stitchedScan;
+
+    // Background save of the stitched scan
+    std::shared_ptr<CompositeVolume> savingScan;
+    std::future<bool> saveResult;
+    std::atomic<int> savedLayers;
+    QTimer saveTimer;
+
+    // Background load of the full scans replacing their previews
+    std::vector<std::shared_ptr<VoxelContainer>> previewScans;
+    std::vector<std::shared_ptr<VoxelContainer>> loadingScans;
+    std::future<bool> loadResult;
+    QTimer loadTimer;
 
     std::shared_ptr<StitcherImpl> stitcher;
     AlgoList* stitchAlgos;